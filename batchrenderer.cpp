@@ -0,0 +1,233 @@
+#include "batchrenderer.h"
+
+#include <QDir>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QTextStream>
+#include <QTimer>
+
+#include <iostream>
+#include <stdexcept>
+
+
+namespace {
+
+// loading scenes are painted meanwhile, so their points get uploaded like in viewer
+const int LOAD_PAINT_INTERVAL = 10;
+// out-of-core view gets that many frames to stream nodes seen from new pose
+const int MAX_LOD_FRAMES = 500;
+// clipping planes of viewer when pose has none
+const double DEFAULT_FRONT_CLIPPING_DISTANCE = -0.0005;
+const double DEFAULT_REAR_CLIPPING_DISTANCE = 1;
+
+
+// runs event loop for a while, loaded pieces and nodes are announced through it
+void processEventsFor(int msecs) {
+  QEventLoop loop;
+  QTimer::singleShot(msecs, &loop, &QEventLoop::quit);
+  loop.exec();
+}
+
+
+// cloud.ply, cloud.ply.gz and cloud.lod give cloud, directory of tiles gives its name
+QString imageBaseName(const QString& path) {
+  const QFileInfo info(path);
+  QString name = info.isDir() ? QDir(path).dirName() : info.fileName();
+  if (name.endsWith(".gz", Qt::CaseInsensitive)) {
+    name.chop(3);
+  }
+  if (name.endsWith(".ply", Qt::CaseInsensitive) || name.endsWith(".lod", Qt::CaseInsensitive)) {
+    name.chop(4);
+  }
+  return name;
+}
+
+} // namespace
+
+
+// file being loaded or rendered, flags are set by its scene
+struct BatchRenderer::Job {
+  QString filePath;
+  QSharedPointer<Camera> camera;
+  std::unique_ptr<Scene> scene;
+  QElapsedTimer timer;
+  bool loaded;
+  bool viewComplete;
+  QString error;
+};
+
+
+std::vector<RenderPose> BatchRenderer::readPoses(const QString& path)
+{
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+    throw std::runtime_error("cannot open poses file");
+  }
+  std::vector<RenderPose> poses;
+  QTextStream stream(&file);
+  while (!stream.atEnd()) {
+    const QString line = stream.readLine().section('#', 0, 0).trimmed();
+    if (line.isEmpty()) {
+      continue;
+    }
+    const QStringList tokens = line.split(' ', QString::SkipEmptyParts);
+    bool ok = (tokens.size() == 6 || tokens.size() == 8);
+    RenderPose pose;
+    for (int axis = 0; axis < 3 && ok; ++axis) {
+      pose.position[axis] = tokens[axis].toFloat(&ok);
+      if (ok) {
+        pose.rotation[axis] = tokens[3 + axis].toInt(&ok);
+      }
+    }
+    pose.frontClippingDistance = DEFAULT_FRONT_CLIPPING_DISTANCE;
+    pose.rearClippingDistance = DEFAULT_REAR_CLIPPING_DISTANCE;
+    if (ok && tokens.size() == 8) {
+      bool rearOk = false;
+      pose.frontClippingDistance = tokens[6].toDouble(&ok);
+      pose.rearClippingDistance = tokens[7].toDouble(&rearOk);
+      ok = ok && rearOk;
+    }
+    if (!ok) {
+      throw std::runtime_error("malformed pose line: " + line.toStdString());
+    }
+    poses.push_back(pose);
+  }
+  if (poses.empty()) {
+    throw std::runtime_error("no poses in poses file");
+  }
+  return poses;
+}
+
+
+BatchRenderer::BatchRenderer(const std::vector<RenderPose>& poses, const QString& outputDirectory)
+  : _poses(poses),
+    _outputDirectory(outputDirectory),
+    _imageSize(1280, 720),
+    _pointSize(1),
+    _colorMode(Scene::COLOR_BY_Z),
+    _jobs(2)
+{
+}
+
+
+int BatchRenderer::render(const QStringList& filePaths)
+{
+  if (!QDir().mkpath(_outputDirectory)) {
+    std::cerr << "pcviewer: cannot create " << _outputDirectory.toStdString() << std::endl;
+    return filePaths.size();
+  }
+
+  int failures = 0;
+  int next = 0;
+  std::vector<std::unique_ptr<Job> > jobs;
+  while (next < filePaths.size() || !jobs.empty()) {
+    // keep few files loading
+    while (next < filePaths.size() && static_cast<int>(jobs.size()) < _jobs) {
+      std::unique_ptr<Job> job(new Job());
+      job->filePath = filePaths[next++];
+      try {
+        _startJob(*job);
+        jobs.push_back(std::move(job));
+      } catch (const std::exception& e) {
+        std::cerr << job->filePath.toStdString() << ": " << e.what() << std::endl;
+        ++failures;
+      }
+    }
+
+    // loaded ones are rendered while the rest keep loading in background
+    bool rendered = false;
+    for (auto it = jobs.begin(); it != jobs.end(); ) {
+      Job& job = **it;
+      if (!job.loaded && job.error.isEmpty()) {
+        ++it;
+        continue;
+      }
+      if (job.error.isEmpty()) {
+        try {
+          _renderJob(job);
+        } catch (const std::exception& e) {
+          job.error = QString::fromLocal8Bit(e.what());
+        }
+      }
+      if (job.error.isEmpty()) {
+        std::cout << job.filePath.toStdString() << ": " << _poses.size() << " images in "
+                  << job.timer.elapsed() << " ms" << std::endl;
+      } else {
+        std::cerr << job.filePath.toStdString() << ": " << job.error.toStdString() << std::endl;
+        ++failures;
+      }
+      it = jobs.erase(it);
+      rendered = true;
+    }
+
+    if (!rendered) {
+      for (const auto& job : jobs) {
+        job->scene->grabFramebuffer();
+      }
+      processEventsFor(LOAD_PAINT_INTERVAL);
+    }
+  }
+  return failures;
+}
+
+
+void BatchRenderer::_startJob(Job& job)
+{
+  job.timer.start();
+  job.loaded = false;
+  job.viewComplete = true;
+  job.camera.reset(new Camera());
+  // wrong files fail here with exception
+  job.scene.reset(new Scene(job.filePath));
+
+  Scene* scene = job.scene.get();
+  Job* flags = &job;
+  QObject::connect(scene, &Scene::loadFinished, scene, [flags](const LoadTimings&) {flags->loaded = true;});
+  QObject::connect(scene, &Scene::loadFailed, scene, [flags](const QString& error) {flags->error = error;});
+  QObject::connect(scene, &Scene::lodStatsChanged, scene, [flags](const LodStats& stats) {
+    flags->viewComplete = stats.drawnNodes >= stats.selectedNodes;
+  });
+  scene->attachCamera(job.camera);
+  scene->setPointSize(_pointSize);
+  scene->setColorAxisMode(_colorMode);
+  scene->resize(_imageSize);
+  scene->show();
+}
+
+
+void BatchRenderer::_renderJob(Job& job)
+{
+  Scene& scene = *job.scene;
+  const QString baseName = imageBaseName(job.filePath);
+  for (size_t i = 0; i < _poses.size(); ++i) {
+    const RenderPose& pose = _poses[i];
+    {
+      Camera::UpdateGuard update(*job.camera);
+      job.camera->setPosition(pose.position);
+      job.camera->setXRotation(pose.rotation[0]);
+      job.camera->setYRotation(pose.rotation[1]);
+      job.camera->setZRotation(pose.rotation[2]);
+      job.camera->setFrontCPDistance(pose.frontClippingDistance);
+      job.camera->setRearCPDistance(pose.rearClippingDistance);
+    }
+
+    QImage image = scene.grabFramebuffer();
+    // out-of-core view streams nodes of new pose first
+    for (int frame = 0; scene.isOutOfCore() && !job.viewComplete && frame < MAX_LOD_FRAMES; ++frame) {
+      processEventsFor(LOAD_PAINT_INTERVAL);
+      image = scene.grabFramebuffer();
+    }
+    if (!job.error.isEmpty()) {
+      return;
+    }
+
+    const QString imagePath = QDir(_outputDirectory).filePath(
+          QString("%1_%2.png").arg(baseName).arg(static_cast<int>(i), 3, 10, QChar('0')));
+    if (!image.save(imagePath, "PNG")) {
+      throw std::runtime_error("cannot write " + imagePath.toStdString());
+    }
+  }
+}
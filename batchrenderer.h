@@ -0,0 +1,63 @@
+#pragma once
+
+#include <QSize>
+#include <QString>
+#include <QStringList>
+#include <QVector3D>
+
+#include "scene.h"
+
+#include <algorithm>
+#include <vector>
+
+
+// camera of rendered image, same values as CameraState
+struct RenderPose {
+  QVector3D position;
+  int rotation[3];  // degrees around x, y, z
+  double frontClippingDistance;
+  double rearClippingDistance;
+};
+
+
+//
+// Renders clouds into PNG images without main window, e.g. nightly thumbnails.
+//
+// Every file (or directory of tiles) gets own Scene widget rendered offscreen.
+// Few files are open at once: once one is loaded it's rendered from every pose
+// on GUI thread, while thread pool keeps decoding others. Without GPU it runs on
+// offscreen platform plugin with Mesa software rasterizer, as renderbench does.
+//
+class BatchRenderer
+{
+public:
+  // one pose per line, "x y z rx ry rz [front rear]", '#' starts comment;
+  // throws on malformed file
+  static std::vector<RenderPose> readPoses(const QString& path);
+
+  BatchRenderer(const std::vector<RenderPose>& poses, const QString& outputDirectory);
+
+  void setImageSize(const QSize& size) {_imageSize = size;}
+  void setPointSize(size_t size) {_pointSize = size;}
+  void setColorMode(Scene::colorAxisMode mode) {_colorMode = mode;}
+  // files loaded at once
+  void setJobs(int jobs) {_jobs = std::max(jobs, 1);}
+
+  // writes <output directory>/<file name>_<pose>.png for every file and pose,
+  // reports files on stdout and failures on stderr; returns count of failed files
+  int render(const QStringList& filePaths);
+
+
+private:
+  struct Job;
+
+  void _startJob(Job& job);
+  void _renderJob(Job& job);
+
+  std::vector<RenderPose> _poses;
+  QString _outputDirectory;
+  QSize _imageSize;
+  size_t _pointSize;
+  Scene::colorAxisMode _colorMode;
+  int _jobs;
+};
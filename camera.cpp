@@ -8,6 +8,33 @@ Camera::Camera() {
   _zRotation = 0;
   _frontClippingPlaneDistance = 0;
   _rearClippingDistance = 0;
+  _updateDepth = 0;
+  _changedInUpdate = false;
+}
+
+
+void Camera::beginUpdate()
+{
+  ++_updateDepth;
+}
+
+
+void Camera::endUpdate()
+{
+  if (--_updateDepth == 0 && _changedInUpdate) {
+    _changedInUpdate = false;
+    emit changed(state());
+  }
+}
+
+
+void Camera::_notify()
+{
+  if (_updateDepth > 0) {
+    _changedInUpdate = true;
+  } else {
+    emit changed(state());
+  }
 }
 
 
@@ -55,6 +82,14 @@ void Camera::down()
 }
 
 
+void Camera::move(const QVector3D& steps)
+{
+  // left is +x and down is +y, as in single step moves
+  _position += steps * CAMERA_STEP;
+  _notify();
+}
+
+
 void Camera::setFrontCPDistance(double distance) {
   _frontClippingPlaneDistance = distance;
   _notify();
@@ -106,6 +141,7 @@ void Camera::setZRotation(int angle)
 
 
 void Camera::rotate(int dx, int dy, int dz) {
+  UpdateGuard update(*this);
   setXRotation(_xRotation + dx);
   setYRotation(_yRotation + dy);
   setZRotation(_zRotation + dz);
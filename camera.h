@@ -34,6 +34,8 @@ public:
   void right();
   void up();
   void down();
+  // move by steps of forward(), left() and down() along x, y, z, fractions allowed
+  void move(const QVector3D& steps);
   void setPosition(const QVector3D& position);
 
   void rotate(int dx, int dy, int dz);
@@ -43,6 +45,21 @@ public:
 
   CameraState state() const;
 
+  // changes between beginUpdate() and endUpdate() are announced with single changed(),
+  // calls nest
+  void beginUpdate();
+  void endUpdate();
+
+  // beginUpdate() and endUpdate() for scope
+  class UpdateGuard {
+  public:
+    explicit UpdateGuard(Camera& camera) : _camera(camera) {_camera.beginUpdate();}
+    ~UpdateGuard() {_camera.endUpdate();}
+  private:
+    Q_DISABLE_COPY(UpdateGuard)
+    Camera& _camera;
+  };
+
 
 signals:
   void changed(const CameraState& newState);
@@ -64,8 +81,10 @@ private:
   int _xRotation;
   int _yRotation;
   int _zRotation;
+  int _updateDepth;
+  bool _changedInUpdate;
 
-  void _notify() {emit changed(state());}
+  void _notify();
 
 };
 
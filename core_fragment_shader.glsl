@@ -0,0 +1,31 @@
+#version 410 core
+
+// core profile version of fragment_shader.glsl
+uniform float pointsCount;
+uniform float colorAxisMode;
+// intensity by Z, ramp texels spread evenly from min to max of Z range
+uniform sampler2D zRamp;
+uniform float zRampMin;
+uniform float zRampMax;
+uniform float zRampSize;
+
+in vec3 vert;
+in float pointIdx;
+in float selected;
+
+out vec4 fragColor;
+
+void main() {
+  float intensity = pointIdx/pointsCount;
+  if (colorAxisMode == 1) {
+    float range = max(zRampMax - zRampMin, 1e-20);
+    float t = clamp((vert.z - zRampMin) / range, 0.0, 1.0);
+    // first and last texel centers are at ends of range
+    intensity = texture(zRamp, vec2((t * (zRampSize - 1.0) + 0.5) / zRampSize, 0.5)).r;
+  }
+  vec3 color = vec3(intensity, intensity, intensity);
+  if (selected > 0.5) {
+    color = mix(color, vec3(1.0, 0.5, 0.0), 0.7);
+  }
+  fragColor = vec4(color, 0.);
+}
@@ -0,0 +1,18 @@
+#version 410 core
+
+uniform mat4 viewMatrix;
+uniform vec2 viewportSize;
+
+in vec3 position;
+// pixels on screen, keeps markers same size at any distance
+in vec2 offset;
+in vec4 color;
+
+out vec4 lineColor;
+
+void main() {
+  vec4 projected = viewMatrix * vec4(position, 1.0);
+  projected.xy += offset * 2.0 / viewportSize * projected.w;
+  gl_Position = projected;
+  lineColor = color;
+}
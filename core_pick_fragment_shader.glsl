@@ -0,0 +1,11 @@
+#version 410 core
+
+flat in uint pointId;
+
+out vec4 fragColor;
+
+void main() {
+  // id bytes go into color channels exactly, read back as unsigned bytes
+  fragColor = vec4(float(pointId & 255u), float((pointId >> 8) & 255u),
+                   float((pointId >> 16) & 255u), float(pointId >> 24)) / 255.0;
+}
@@ -0,0 +1,25 @@
+#version 410 core
+
+// core profile version of pick_vertex_shader.glsl
+uniform float pointSize;
+uniform mat4 viewMatrix;
+// id of first vertex of draw call, 0 is left for background
+uniform uint idBase;
+// rear and front clipping planes of clip coordinates
+uniform vec4 clippingPlanes[2];
+
+in vec4 vertex;
+// bounds of compact vertices, see core_vertex_shader.glsl
+in vec3 chunkMin;
+in vec3 chunkSize;
+
+flat out uint pointId;
+
+void main() {
+  gl_Position = viewMatrix * vec4(chunkMin + vertex.xyz * chunkSize, 1.0);
+  gl_PointSize  = pointSize;
+  gl_ClipDistance[0] = dot(clippingPlanes[0], gl_Position);
+  gl_ClipDistance[1] = dot(clippingPlanes[1], gl_Position);
+  // vertex id of indirect draw counts from first vertex of buffer as well
+  pointId = idBase + uint(gl_VertexID) + 1u;
+}
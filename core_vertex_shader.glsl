@@ -0,0 +1,42 @@
+#version 410 core
+
+// core profile version of vertex_shader.glsl
+uniform float pointSize;
+uniform mat4 viewMatrix;
+uniform float rowScale;
+// points on inner side of all planes of box selection are highlighted
+uniform float selectionActive;
+uniform vec4 selectionPlanes[8];
+// rear and front clipping planes of clip coordinates
+uniform vec4 clippingPlanes[2];
+
+in vec4 vertex;
+in float pointRowIndex;
+// bounds of compact vertices, per chunk of indirect draw (read at its base instance)
+// or constant for whole draw call; floats come with zero min and unit size
+in vec3 chunkMin;
+in vec3 chunkSize;
+
+out float pointIdx;
+out vec3 vert;
+out float selected;
+
+void main() {
+  vec4 position = vec4(chunkMin + vertex.xyz * chunkSize, 1.0);
+  gl_Position = viewMatrix * position;
+  gl_PointSize  = pointSize;
+  gl_ClipDistance[0] = dot(clippingPlanes[0], gl_Position);
+  gl_ClipDistance[1] = dot(clippingPlanes[1], gl_Position);
+
+  // for use in fragment shader
+  pointIdx = pointRowIndex * rowScale;
+  vert = position.xyz;
+  selected = selectionActive;
+  if (selectionActive > 0.5) {
+    for (int i = 0; i < 8; ++i) {
+      if (dot(selectionPlanes[i], position) < 0.0) {
+        selected = 0.0;
+      }
+    }
+  }
+}
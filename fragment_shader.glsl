@@ -1,17 +1,28 @@
-#version 120
-
-uniform float pointsCount;
-uniform float colorAxisMode;
-uniform vec3 pointsBoundMin;
-uniform vec3 pointsBoundMax;
-
-varying vec3 vert;
-varying float pointIdx;
-
-void main() {
-  float intensity = pointIdx/pointsCount;
-  if (colorAxisMode == 1) {
-    intensity = (vert.z + abs(pointsBoundMin.z))/(pointsBoundMax.z - pointsBoundMin.z);
-  }
-  gl_FragColor = vec4(intensity, intensity, intensity, 0.);
-}
+#version 120
+
+uniform float pointsCount;
+uniform float colorAxisMode;
+// intensity by Z, ramp texels spread evenly from min to max of Z range
+uniform sampler2D zRamp;
+uniform float zRampMin;
+uniform float zRampMax;
+uniform float zRampSize;
+
+varying vec3 vert;
+varying float pointIdx;
+varying float selected;
+
+void main() {
+  float intensity = pointIdx/pointsCount;
+  if (colorAxisMode == 1) {
+    float range = max(zRampMax - zRampMin, 1e-20);
+    float t = clamp((vert.z - zRampMin) / range, 0.0, 1.0);
+    // first and last texel centers are at ends of range
+    intensity = texture2D(zRamp, vec2((t * (zRampSize - 1.0) + 0.5) / zRampSize, 0.5)).r;
+  }
+  vec3 color = vec3(intensity, intensity, intensity);
+  if (selected > 0.5) {
+    color = mix(color, vec3(1.0, 0.5, 0.0), 0.7);
+  }
+  gl_FragColor = vec4(color, 0.);
+}
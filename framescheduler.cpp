@@ -0,0 +1,91 @@
+#include "framescheduler.h"
+
+#include <QGuiApplication>
+#include <QScreen>
+#include <QWidget>
+#include <QWindow>
+
+#include <algorithm>
+
+
+namespace {
+
+const qreal DEFAULT_REFRESH_RATE = 60;
+// ticks after pause don't jump by whole pause
+const double MAX_TICK_SECONDS = 0.1;
+
+} // namespace
+
+
+FrameScheduler::FrameScheduler(QWidget* widget)
+  : _widget(widget),
+    _framePending(false),
+    _tickPending(false),
+    _refreshing(false)
+{
+  _timer.setSingleShot(true);
+  _timer.setTimerType(Qt::PreciseTimer);
+  connect(&_timer, &QTimer::timeout, this, &FrameScheduler::_onRefresh);
+}
+
+
+void FrameScheduler::requestFrame()
+{
+  _framePending = true;
+  _arm();
+}
+
+
+void FrameScheduler::requestTick()
+{
+  if (!_lastTick.isValid()) {
+    _lastTick.start();
+  }
+  _tickPending = true;
+  _arm();
+}
+
+
+int FrameScheduler::_refreshInterval() const
+{
+  const QWindow* window = _widget->window()->windowHandle();
+  const QScreen* screen = window ? window->screen() : QGuiApplication::primaryScreen();
+  const qreal rate = screen && screen->refreshRate() > 1 ? screen->refreshRate() : DEFAULT_REFRESH_RATE;
+  return std::max(1, static_cast<int>(1000 / rate));
+}
+
+
+void FrameScheduler::_arm()
+{
+  // requests made by tick handlers are served by refresh in progress
+  if (_refreshing || _timer.isActive()) {
+    return;
+  }
+  const qint64 sinceRefresh = _lastRefresh.isValid() ? _lastRefresh.elapsed() : _refreshInterval();
+  _timer.start(static_cast<int>(std::max<qint64>(0, _refreshInterval() - sinceRefresh)));
+}
+
+
+void FrameScheduler::_onRefresh()
+{
+  _lastRefresh.start();
+  _refreshing = true;
+  if (_tickPending) {
+    _tickPending = false;
+    const double seconds = std::min(MAX_TICK_SECONDS, _lastTick.nsecsElapsed() / 1e9);
+    _lastTick.start();
+    emit tick(seconds);
+  }
+  if (_framePending) {
+    _framePending = false;
+    _widget->update();
+  }
+  _refreshing = false;
+
+  if (_tickPending) {
+    _arm();
+  } else {
+    // next motion starts from its first tick
+    _lastTick.invalidate();
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+
+class QWidget;
+
+
+//
+// Paces repaints of widget to display refresh.
+//
+// Any number of requestFrame() calls within one refresh interval give single
+// update() of widget, so bursts of input are drawn once per refresh.
+// Continuous motion asks for requestTick(): tick() comes on next refresh with
+// seconds passed since previous tick, handlers ask again while still moving,
+// and frames they request on tick are painted in the same refresh.
+//
+class FrameScheduler : public QObject
+{
+  Q_OBJECT
+
+public:
+  explicit FrameScheduler(QWidget* widget);
+
+  void requestFrame();
+  void requestTick();
+
+
+signals:
+  void tick(double seconds);
+
+
+private slots:
+  void _onRefresh();
+
+
+private:
+  int _refreshInterval() const;
+  void _arm();
+
+  QWidget* _widget;
+  QTimer _timer;
+  QElapsedTimer _lastRefresh;
+  QElapsedTimer _lastTick;
+  bool _framePending;
+  bool _tickPending;
+  bool _refreshing;
+};
@@ -0,0 +1,104 @@
+#include "gzipreader.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace {
+
+// compressed bytes read from file at once
+const size_t INPUT_SIZE = 1 << 20;
+const size_t SKIP_SIZE = 1 << 16;
+
+// window bits of gzip wrapper, see inflateInit2()
+const int GZIP_WINDOW_BITS = 15 + 16;
+
+} // namespace
+
+
+bool GzipReader::isGzip(const QString& filePath)
+{
+  QFile file(filePath);
+  char magic[2];
+  return file.open(QIODevice::ReadOnly) && file.read(magic, 2) == 2 &&
+      static_cast<uchar>(magic[0]) == 0x1f && static_cast<uchar>(magic[1]) == 0x8b;
+}
+
+
+GzipReader::GzipReader(const QString& filePath)
+  : _file(filePath),
+    _stream(new z_stream()),
+    _input(INPUT_SIZE),
+    _end(false)
+{
+  if (!_file.open(QIODevice::ReadOnly)) {
+    delete _stream;
+    throw std::runtime_error("cannot open ply file");
+  }
+  _stream->zalloc = Z_NULL;
+  _stream->zfree = Z_NULL;
+  _stream->opaque = Z_NULL;
+  _stream->next_in = Z_NULL;
+  _stream->avail_in = 0;
+  if (inflateInit2(_stream, GZIP_WINDOW_BITS) != Z_OK) {
+    delete _stream;
+    throw std::runtime_error("cannot initialize zlib");
+  }
+}
+
+
+GzipReader::~GzipReader()
+{
+  inflateEnd(_stream);
+  delete _stream;
+}
+
+
+size_t GzipReader::read(char* data, size_t size)
+{
+  _stream->next_out = reinterpret_cast<Bytef*>(data);
+  _stream->avail_out = static_cast<uInt>(size);
+  while (_stream->avail_out > 0 && !_end) {
+    if (_stream->avail_in == 0) {
+      const qint64 bytes = _file.read(_input.data(), static_cast<qint64>(_input.size()));
+      if (bytes < 0) {
+        throw std::runtime_error("cannot read ply file");
+      }
+      _stream->next_in = reinterpret_cast<Bytef*>(_input.data());
+      _stream->avail_in = static_cast<uInt>(bytes);
+    }
+    if (_stream->avail_in == 0) {
+      // file ended, either after complete member or within one
+      _end = true;
+      if (_stream->total_in > 0) {
+        throw std::runtime_error("truncated gzip file");
+      }
+      break;
+    }
+
+    const int status = inflate(_stream, Z_NO_FLUSH);
+    if (status == Z_STREAM_END) {
+      // next member may follow
+      inflateReset(_stream);
+    } else if (status != Z_OK && status != Z_BUF_ERROR) {
+      throw std::runtime_error("corrupt gzip file");
+    }
+  }
+  return size - _stream->avail_out;
+}
+
+
+bool GzipReader::skip(size_t bytes)
+{
+  std::vector<char> dropped(std::min(bytes, SKIP_SIZE));
+  while (bytes > 0) {
+    const size_t chunk = std::min(bytes, dropped.size());
+    if (read(dropped.data(), chunk) != chunk) {
+      return false;
+    }
+    bytes -= chunk;
+  }
+  return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <QFile>
+#include <QString>
+
+#include <vector>
+
+struct z_stream_s;
+
+
+//
+// Sequential reader of gzip compressed file, inflated by zlib as it's read.
+//
+// Concatenated gzip members (as written by parallel compressors) are read one after
+// another. Compressed input is read in large pieces, so there's no other buffering.
+//
+class GzipReader
+{
+public:
+  // by gzip magic of file content, not by its name
+  static bool isGzip(const QString& filePath);
+
+  // throws std::runtime_error if file can't be opened
+  explicit GzipReader(const QString& filePath);
+  ~GzipReader();
+
+  // inflates up to size bytes, fewer only at end of data; throws on corrupt data
+  size_t read(char* data, size_t size);
+  // drops bytes, false if data ends before
+  bool skip(size_t bytes);
+  bool atEnd() const {return _end;}
+  // compressed bytes consumed so far
+  qint64 compressedPosition() const {return _file.pos();}
+
+
+private:
+  Q_DISABLE_COPY(GzipReader)
+
+  QFile _file;
+  z_stream_s* _stream;
+  std::vector<char> _input;
+  bool _end;
+};
@@ -0,0 +1,134 @@
+#include "indirectdraw.h"
+
+#include <algorithm>
+#include <cassert>
+
+
+namespace {
+
+// commands per part of first buffer
+const size_t MIN_CAPACITY = 1 << 10;
+// fence wait is repeated after that, nanoseconds
+const GLuint64 FENCE_TIMEOUT = 1000000000;
+
+} // namespace
+
+
+IndirectDraw::IndirectDraw()
+  : _gl(nullptr),
+    _buffer(0),
+    _commands(nullptr),
+    _capacity(0),
+    _part(0),
+    _count(0)
+{
+  std::fill(_fences, _fences + PARTS, GLsync(0));
+}
+
+
+IndirectDraw::~IndirectDraw()
+{
+}
+
+
+void IndirectDraw::create(QOpenGLFunctions_4_4_Core* gl)
+{
+  _gl = gl;
+}
+
+
+void IndirectDraw::destroy()
+{
+  if (!_gl) {
+    return;
+  }
+  for (int part = 0; part < PARTS; ++part) {
+    if (_fences[part]) {
+      _gl->glDeleteSync(_fences[part]);
+      _fences[part] = 0;
+    }
+  }
+  // deleted buffer is unmapped
+  if (_buffer) {
+    _gl->glDeleteBuffers(1, &_buffer);
+    _buffer = 0;
+  }
+  _commands = nullptr;
+  _capacity = 0;
+  _count = 0;
+  _gl = nullptr;
+}
+
+
+void IndirectDraw::_wait(int part)
+{
+  if (!_fences[part]) {
+    return;
+  }
+  // flush makes sure fence reaches GPU, so waiting for it ends
+  while (_gl->glClientWaitSync(_fences[part], GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT) == GL_TIMEOUT_EXPIRED) {
+  }
+  _gl->glDeleteSync(_fences[part]);
+  _fences[part] = 0;
+}
+
+
+void IndirectDraw::_allocate(size_t capacity)
+{
+  // storage is immutable, so larger one replaces it once GPU is done with all parts
+  for (int part = 0; part < PARTS; ++part) {
+    _wait(part);
+  }
+  if (_buffer) {
+    _gl->glDeleteBuffers(1, &_buffer);
+  }
+  _capacity = std::max(std::max(capacity, 2 * _capacity), MIN_CAPACITY);
+  const GLsizeiptr bytes = static_cast<GLsizeiptr>(PARTS * _capacity * sizeof(Command));
+  const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  _gl->glGenBuffers(1, &_buffer);
+  _gl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _buffer);
+  _gl->glBufferStorage(GL_DRAW_INDIRECT_BUFFER, bytes, nullptr, flags);
+  _commands = static_cast<Command*>(_gl->glMapBufferRange(GL_DRAW_INDIRECT_BUFFER, 0, bytes, flags));
+  _gl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+
+void IndirectDraw::begin(size_t maxCommands)
+{
+  assert(_gl);
+  if (maxCommands > _capacity || !_commands) {
+    _allocate(maxCommands);
+  }
+  _part = (_part + 1) % PARTS;
+  _wait(_part);
+  _count = 0;
+}
+
+
+void IndirectDraw::add(GLuint first, GLuint count, GLuint baseInstance)
+{
+  assert(_count < _capacity);
+  if (!_commands) {
+    return;
+  }
+  Command& command = _commands[_part * _capacity + _count++];
+  command.count = count;
+  command.instanceCount = 1;
+  command.first = first;
+  command.baseInstance = baseInstance;
+}
+
+
+size_t IndirectDraw::draw(GLenum mode)
+{
+  if (_count == 0 || !_commands) {
+    return 0;
+  }
+  // coherent mapping makes commands visible to GPU without flush
+  const size_t offset = _part * _capacity * sizeof(Command);
+  _gl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _buffer);
+  _gl->glMultiDrawArraysIndirect(mode, reinterpret_cast<const void*>(offset), static_cast<GLsizei>(_count), 0);
+  _gl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+  _fences[_part] = _gl->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  return _count;
+}
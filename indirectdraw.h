@@ -0,0 +1,55 @@
+#pragma once
+
+#include <QOpenGLFunctions_4_4_Core>
+
+
+//
+// Ranges of bound vertex buffer drawn by single glMultiDrawArraysIndirect (GL 4.3).
+//
+// Commands are written straight into persistently mapped buffer (GL 4.4) split into
+// ring of parts, every draw takes next part. Part is written again only once fence
+// of its last draw has passed, so neither commands are copied into driver nor CPU
+// waits for GPU reading recent ones. Parts grow with number of commands.
+// Base instance of command is up to caller: instanced attributes (divisor 1)
+// are read at it, e.g. bounds of chunk of compact vertices.
+//
+class IndirectDraw
+{
+public:
+  IndirectDraw();
+  ~IndirectDraw();
+
+  // functions of current context, it must stay current for all calls
+  void create(QOpenGLFunctions_4_4_Core* gl);
+  // releases GL resources, create() is needed again
+  void destroy();
+
+  // starts commands of next draw, up to given count of them
+  void begin(size_t maxCommands);
+  void add(GLuint first, GLuint count, GLuint baseInstance);
+  // issues commands added since begin() by single call, returns count of them
+  size_t draw(GLenum mode);
+
+
+private:
+  // layout of GL indirect command of glDrawArraysIndirect
+  struct Command {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint first;
+    GLuint baseInstance;
+  };
+
+  static const int PARTS = 3;
+
+  void _allocate(size_t capacity);
+  void _wait(int part);
+
+  QOpenGLFunctions_4_4_Core* _gl;
+  GLuint _buffer;
+  Command* _commands;  // mapped buffer
+  size_t _capacity;    // commands per part
+  int _part;
+  size_t _count;       // commands of current part
+  GLsync _fences[PARTS];
+};
@@ -0,0 +1,213 @@
+//
+// PLY loader throughput benchmark.
+//
+// Loads every given file with PlyLoader, the same way viewer does, with worker
+// pool limited to each of given thread counts, and prints JSON with MB/s, points/s,
+// heap allocations and speedup over single thread. Corpus comes from plygen:
+//
+//   loaderbench --threads 1,2,4,8 --runs 5 terrain_ascii.ply terrain_binary.ply
+//
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+#include <QThreadPool>
+
+#include "plyloader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+
+//
+// heap allocations counter, glibc lets executable wrap its allocator
+//
+#ifdef __GLIBC__
+
+namespace {
+std::atomic<quint64> allocations(0);
+std::atomic<quint64> allocatedBytes(0);
+} // namespace
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+
+void* malloc(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocatedBytes.fetch_add(count * size, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  return __libc_realloc(p, size);
+}
+}
+
+#else
+
+namespace {
+// not counted elsewhere, reported as zero
+std::atomic<quint64> allocations(0);
+std::atomic<quint64> allocatedBytes(0);
+} // namespace
+
+#endif
+
+
+namespace {
+
+struct Run {
+  double wallMsecs;   // constructor (header) to finished signal
+  double parseMsecs;
+  quint64 allocations;
+  quint64 allocatedBytes;
+};
+
+
+Run loadOnce(const QString& path, size_t& points) {
+  const quint64 allocationsBefore = allocations.load();
+  const quint64 bytesBefore = allocatedBytes.load();
+  QElapsedTimer wallTimer;
+  wallTimer.start();
+
+  QString error;
+  Run run;
+  {
+    PlyLoader loader(path);
+    QEventLoop loop;
+    QObject::connect(&loader, &PlyLoader::finished, &loop, &QEventLoop::quit);
+    QObject::connect(&loader, &PlyLoader::failed, [&](const QString& e) {
+      error = e;
+      loop.quit();
+    });
+    loader.start();
+    if (!loader.isFinished() && error.isEmpty()) {
+      loop.exec();
+    }
+    run.wallMsecs = wallTimer.nsecsElapsed() / 1e6;
+    run.parseMsecs = loader.timings().parse;
+    points = loader.pointsCount();
+  }
+  if (!error.isEmpty()) {
+    throw std::runtime_error(path.toStdString() + ": " + error.toStdString());
+  }
+  run.allocations = allocations.load() - allocationsBefore;
+  run.allocatedBytes = allocatedBytes.load() - bytesBefore;
+  return run;
+}
+
+
+// 1, 2, 4 ... up to all cores
+QString defaultThreadCounts() {
+  QStringList counts;
+  const int cores = std::max(QThread::idealThreadCount(), 1);
+  for (int n = 1; n < cores; n *= 2) {
+    counts << QString::number(n);
+  }
+  counts << QString::number(cores);
+  return counts.join(',');
+}
+
+
+double median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  return values.empty() ? 0 : values[values.size() / 2];
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Measures PLY loading throughput across worker thread counts.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("files", "PLY files to load.", "files...");
+  QCommandLineOption threadsOption("threads", "Comma separated worker thread counts, powers of two up to all cores by default.",
+                                   "list", defaultThreadCounts());
+  QCommandLineOption runsOption("runs", "Runs per file and thread count, median is reported.", "count", "3");
+  parser.addOptions({threadsOption, runsOption});
+  parser.process(app);
+
+  std::vector<int> threadCounts;
+  for (const auto& value : parser.value(threadsOption).split(',')) {
+    threadCounts.push_back(value.toInt());
+    if (threadCounts.back() <= 0) {
+      parser.showHelp(1);
+    }
+  }
+  const int runs = parser.value(runsOption).toInt();
+  if (parser.positionalArguments().isEmpty() || runs <= 0) {
+    parser.showHelp(1);
+  }
+
+  try {
+    QJsonArray results;
+    for (const auto& path : parser.positionalArguments()) {
+      const double sizeMb = QFileInfo(path).size() / double(1 << 20);
+      double singleThreadMsecs = 0;
+      for (int threads : threadCounts) {
+        QThreadPool::globalInstance()->setMaxThreadCount(threads);
+
+        // first load warms page cache, so runs compare parsing rather than disk
+        size_t points = 0;
+        loadOnce(path, points);
+        std::vector<double> wall, parse;
+        Run last = {0, 0, 0, 0};
+        for (int i = 0; i < runs; ++i) {
+          last = loadOnce(path, points);
+          wall.push_back(last.wallMsecs);
+          parse.push_back(last.parseMsecs);
+        }
+
+        const double wallMsecs = median(wall);
+        if (threads == 1) {
+          singleThreadMsecs = wallMsecs;
+        }
+        QJsonObject result;
+        result["file"] = path;
+        result["sizeMb"] = sizeMb;
+        result["points"] = static_cast<double>(points);
+        result["threads"] = threads;
+        result["runs"] = runs;
+        result["wallMs"] = wallMsecs;
+        result["bestWallMs"] = *std::min_element(wall.begin(), wall.end());
+        result["parseMs"] = median(parse);
+        result["mbPerSec"] = wallMsecs > 0 ? sizeMb / wallMsecs * 1000 : 0;
+        result["pointsPerSec"] = wallMsecs > 0 ? points / wallMsecs * 1000 : 0;
+        result["allocations"] = static_cast<double>(last.allocations);
+        result["allocatedMb"] = last.allocatedBytes / double(1 << 20);
+        if (singleThreadMsecs > 0) {
+          result["speedup"] = singleThreadMsecs / wallMsecs;
+        }
+        results.append(result);
+      }
+    }
+    std::cout << QJsonDocument(results).toJson().constData();
+  } catch (const std::exception& e) {
+    std::cerr << "loaderbench: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
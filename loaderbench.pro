@@ -0,0 +1,27 @@
+# PLY loader throughput benchmark, see loaderbench.cpp
+TARGET = loaderbench
+
+HEADERS  = plyloader.h \
+    plyheader.h \
+    gzipreader.h \
+    plydecoders.h \
+    pointstorage.h \
+    pointcache.h \
+    pointindex.h
+SOURCES  = loaderbench.cpp \
+    plyloader.cpp \
+    plyheader.cpp \
+    gzipreader.cpp \
+    plydecoders.cpp \
+    pointstorage.cpp \
+    pointcache.cpp \
+    pointindex.cpp
+
+QT -= gui
+QT += concurrent
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+# system zlib, one bundled with Qt has no public headers
+LIBS += -lz
@@ -0,0 +1,302 @@
+#include "lodbuilder.h"
+#include "lodoctree.h"
+#include "plyloader.h"
+
+#include <QFile>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace {
+
+// internal node gets about that many points, split stops there
+const size_t NODE_POINTS = 1 << 15;
+// finest grid points are counted on, 2^8 cells per axis
+const int MAX_GRID_LEVEL = 8;
+const size_t SCAN_BATCH_POINTS = 1 << 20;
+const int PASSES = 4;
+
+
+// stable pseudo random value in [0, 1) for every row, decides which level takes point
+inline float sampleKey(quint64 row) {
+  quint64 z = row + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return static_cast<float>(z >> 40) / (1 << 24);
+}
+
+
+struct Grid {
+  int level;
+  int dim;
+  float min[3];
+  float size;
+
+  int cell(float value, int axis) const {
+    const int c = static_cast<int>((value - min[axis]) / size * dim);
+    return std::max(0, std::min(dim - 1, c));
+  }
+};
+
+
+struct BuildNode {
+  LodNode node;
+  quint64 subtreeCount;
+  int cell[3];  // cell of node cube on grid of its depth
+};
+
+
+// octree nodes in breadth first order from point counts of every grid level
+std::vector<BuildNode> makeNodes(const Grid& grid, const std::vector<std::vector<quint64> >& levels) {
+  std::vector<BuildNode> nodes(1);
+  BuildNode& root = nodes[0];
+  std::copy(grid.min, grid.min + 3, root.node.min);
+  root.node.size = grid.size;
+  root.node.first = root.node.count = 0;
+  root.node.firstChild = root.node.childMask = root.node.depth = 0;
+  root.subtreeCount = levels[0][0];
+  root.cell[0] = root.cell[1] = root.cell[2] = 0;
+
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const int depth = nodes[i].node.depth;
+    if (nodes[i].subtreeCount <= NODE_POINTS || depth == grid.level) {
+      continue;
+    }
+
+    const int childDim = 1 << (depth + 1);
+    const std::vector<quint64>& counts = levels[depth + 1];
+    const BuildNode parent = nodes[i];
+    nodes[i].node.firstChild = static_cast<quint32>(nodes.size());
+    for (int octant = 0; octant < 8; ++octant) {
+      BuildNode child;
+      for (int axis = 0; axis < 3; ++axis) {
+        child.cell[axis] = parent.cell[axis] * 2 + ((octant >> axis) & 1);
+        child.node.min[axis] = grid.min[axis] + grid.size * child.cell[axis] / childDim;
+      }
+      child.subtreeCount = counts[(size_t(child.cell[0]) * childDim + child.cell[1]) * childDim + child.cell[2]];
+      if (child.subtreeCount == 0) {
+        continue;
+      }
+      child.node.size = parent.node.size / 2;
+      child.node.first = child.node.count = 0;
+      child.node.firstChild = child.node.childMask = 0;
+      child.node.depth = depth + 1;
+      nodes[i].node.childMask |= 1 << octant;
+      nodes.push_back(child);
+    }
+  }
+  return nodes;
+}
+
+
+// node taking point: the first one on its way down where point's key falls
+// into node's share of subtree, so every node samples about NODE_POINTS points
+inline quint32 nodeOfPoint(const std::vector<BuildNode>& nodes, const Grid& grid, const float* p, quint64 row) {
+  const float key = sampleKey(row);
+  int cell[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    cell[axis] = grid.cell(p[axis], axis);
+  }
+
+  quint32 index = 0;
+  for (;;) {
+    const BuildNode& n = nodes[index];
+    if (n.node.childMask == 0 || key * n.subtreeCount < NODE_POINTS) {
+      return index;
+    }
+    const int shift = grid.level - n.node.depth - 1;
+    int octant = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      octant |= ((cell[axis] >> shift) & 1) << axis;
+    }
+    // children are stored in octants order, skip ones before point's octant
+    quint32 mask = n.node.childMask & ((1u << octant) - 1);
+    quint32 skipped = 0;
+    for (; mask; mask &= mask - 1) {
+      ++skipped;
+    }
+    index = n.node.firstChild + skipped;
+  }
+}
+
+} // namespace
+
+
+bool buildLodOctree(const QString& plyFilePath, const QString& lodFilePath,
+                    const std::function<bool(int)>& progress) {
+  PlyLoader loader(plyFilePath);
+  const size_t pointsCount = loader.pointsCount();
+  if (pointsCount == 0) {
+    throw std::runtime_error("ply file has no points");
+  }
+
+  int pass = 0;
+  bool canceled = false;
+  auto report = [&](size_t first, size_t count) {
+    canceled = !progress(static_cast<int>((100 * pass + 100 * (first + count) / pointsCount) / PASSES));
+    return !canceled;
+  };
+  auto checkScan = [&](bool ok) {
+    if (!ok && !canceled) {
+      throw std::runtime_error("broken ply file");
+    }
+    ++pass;
+    return ok;
+  };
+
+  //
+  // pass 1: bounds
+  //
+  float boundMin[3], boundMax[3];
+  std::fill(boundMin, boundMin + 3, std::numeric_limits<float>::max());
+  std::fill(boundMax, boundMax + 3, -std::numeric_limits<float>::max());
+  bool ok = loader.scan(SCAN_BATCH_POINTS, [&](const float* points, size_t first, size_t count) {
+    for (const float* p = points; p < points + count * POINT_STRIDE; p += POINT_STRIDE) {
+      for (int axis = 0; axis < 3; ++axis) {
+        boundMin[axis] = std::min(boundMin[axis], p[axis]);
+        boundMax[axis] = std::max(boundMax[axis], p[axis]);
+      }
+    }
+    return report(first, count);
+  });
+  if (!checkScan(ok)) {
+    return false;
+  }
+
+  // cube around points, grid fine enough for leaves on scanned surfaces to get near NODE_POINTS
+  Grid grid;
+  grid.level = 1;
+  while (grid.level < MAX_GRID_LEVEL && (size_t(1) << (2 * grid.level)) * NODE_POINTS / 2 < pointsCount) {
+    ++grid.level;
+  }
+  grid.dim = 1 << grid.level;
+  grid.size = 0;
+  for (int axis = 0; axis < 3; ++axis) {
+    grid.min[axis] = boundMin[axis];
+    grid.size = std::max(grid.size, boundMax[axis] - boundMin[axis]);
+  }
+  grid.size = std::max(grid.size * 1.0001f, std::numeric_limits<float>::min());
+
+  //
+  // pass 2: points of every grid cell, summed up into coarser levels
+  //
+  std::vector<std::vector<quint64> > levels(grid.level + 1);
+  std::vector<quint32> cellCounts(size_t(grid.dim) * grid.dim * grid.dim, 0);
+  ok = loader.scan(SCAN_BATCH_POINTS, [&](const float* points, size_t first, size_t count) {
+    for (const float* p = points; p < points + count * POINT_STRIDE; p += POINT_STRIDE) {
+      const size_t cell = (size_t(grid.cell(p[0], 0)) * grid.dim + grid.cell(p[1], 1)) * grid.dim + grid.cell(p[2], 2);
+      ++cellCounts[cell];
+    }
+    return report(first, count);
+  });
+  if (!checkScan(ok)) {
+    return false;
+  }
+
+  levels[grid.level].assign(cellCounts.begin(), cellCounts.end());
+  std::vector<quint32>().swap(cellCounts);
+  for (int level = grid.level - 1; level >= 0; --level) {
+    const size_t dim = size_t(1) << level;
+    const std::vector<quint64>& fine = levels[level + 1];
+    std::vector<quint64>& coarse = levels[level];
+    coarse.assign(dim * dim * dim, 0);
+    for (size_t x = 0; x < dim * 2; ++x) {
+      for (size_t y = 0; y < dim * 2; ++y) {
+        for (size_t z = 0; z < dim * 2; ++z) {
+          coarse[((x / 2) * dim + y / 2) * dim + z / 2] += fine[(x * dim * 2 + y) * dim * 2 + z];
+        }
+      }
+    }
+  }
+
+  std::vector<BuildNode> nodes = makeNodes(grid, levels);
+  std::vector<std::vector<quint64> >().swap(levels);
+
+  //
+  // pass 3: points taken by every node
+  //
+  std::vector<quint64> nodeCounts(nodes.size(), 0);
+  ok = loader.scan(SCAN_BATCH_POINTS, [&](const float* points, size_t first, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      ++nodeCounts[nodeOfPoint(nodes, grid, points + i * POINT_STRIDE, first + i)];
+    }
+    return report(first, count);
+  });
+  if (!checkScan(ok)) {
+    return false;
+  }
+
+  quint64 first = 0;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    if (nodeCounts[i] > std::numeric_limits<quint32>::max()) {
+      throw std::runtime_error("too many points in single LOD node");
+    }
+    nodes[i].node.first = first;
+    nodes[i].node.count = static_cast<quint32>(nodeCounts[i]);
+    first += nodeCounts[i];
+  }
+
+  //
+  // pass 4: write header, nodes and points of every node into their place
+  //
+  LodFileHeader header;
+  std::memcpy(header.magic, LOD_MAGIC, sizeof(header.magic));
+  header.nodesCount = static_cast<quint32>(nodes.size());
+  header.reserved = 0;
+  header.pointsCount = pointsCount;
+  std::copy(boundMin, boundMin + 3, header.boundMin);
+  std::copy(boundMax, boundMax + 3, header.boundMax);
+  std::copy(loader.origin(), loader.origin() + 3, header.origin);
+  const quint64 tableEnd = sizeof(LodFileHeader) + nodes.size() * sizeof(LodNode);
+  header.pointsOffset = (tableEnd + 15) / 16 * 16;
+  const quint64 pointsSize = quint64(pointsCount) * POINT_STRIDE * sizeof(float);
+
+  QFile file(lodFilePath);
+  if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate)) {
+    throw std::runtime_error("cannot create LOD file");
+  }
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (const auto& n : nodes) {
+    file.write(reinterpret_cast<const char*>(&n.node), sizeof(LodNode));
+  }
+  if (!file.resize(header.pointsOffset + pointsSize)) {
+    file.remove();
+    throw std::runtime_error("cannot write LOD file");
+  }
+  uchar* out = file.map(header.pointsOffset, pointsSize);
+  if (!out) {
+    file.remove();
+    throw std::runtime_error("cannot map LOD file");
+  }
+
+  std::vector<quint64> cursors(nodes.size());
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    cursors[i] = nodes[i].node.first;
+  }
+  const size_t pointSize = POINT_STRIDE * sizeof(float);
+  ok = loader.scan(SCAN_BATCH_POINTS, [&](const float* points, size_t first, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      const float* p = points + i * POINT_STRIDE;
+      const quint32 node = nodeOfPoint(nodes, grid, p, first + i);
+      std::memcpy(out + cursors[node]++ * pointSize, p, pointSize);
+    }
+    return report(first, count);
+  });
+  file.unmap(out);
+  try {
+    if (!checkScan(ok)) {
+      file.remove();
+      return false;
+    }
+  } catch (...) {
+    file.remove();
+    throw;
+  }
+  file.close();
+  return true;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <QString>
+
+#include <functional>
+
+
+// write LOD octree of PLY file for out-of-core viewing, see lodoctree.h.
+// Input is decoded in few sequential passes, output is written through memory mapping,
+// so neither has to fit into memory. Progress gets percents done and returns false
+// to cancel, then false is returned. Throws on broken files.
+bool buildLodOctree(const QString& plyFilePath, const QString& lodFilePath,
+                    const std::function<bool(int)>& progress);
@@ -0,0 +1,276 @@
+#include "lodoctree.h"
+#include "plydecoders.h"
+
+#include <QtConcurrent>
+#include <QSet>
+
+#include <cstring>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+
+
+namespace {
+
+// node is refined into children while its projection is larger, in pixels
+const float LOD_NODE_PIXELS = 256;
+// bytes of nodes read by single batch, small enough for view to fill in progressively
+const size_t READ_BATCH_BYTES = 32 << 20;
+const size_t DEFAULT_MEMORY_BUDGET = size_t(1) << 30;
+
+
+// projected size of node cube in pixels, 0 if cube is out of view frustum
+float projectedSize(const LodNode& node, const float* m, const QSize& viewport) {
+  float left = std::numeric_limits<float>::max();
+  float top = std::numeric_limits<float>::max();
+  float right = -std::numeric_limits<float>::max();
+  float bottom = -std::numeric_limits<float>::max();
+  int outside[6] = {0, 0, 0, 0, 0, 0};
+  bool crossesCamera = false;
+  for (int corner = 0; corner < 8; ++corner) {
+    const float x = node.min[0] + ((corner & 1) ? node.size : 0);
+    const float y = node.min[1] + ((corner & 2) ? node.size : 0);
+    const float z = node.min[2] + ((corner & 4) ? node.size : 0);
+    const float cx = m[0] * x + m[4] * y + m[8] * z + m[12];
+    const float cy = m[1] * x + m[5] * y + m[9] * z + m[13];
+    const float cz = m[2] * x + m[6] * y + m[10] * z + m[14];
+    const float cw = m[3] * x + m[7] * y + m[11] * z + m[15];
+    outside[0] += cx < -cw;
+    outside[1] += cx > cw;
+    outside[2] += cy < -cw;
+    outside[3] += cy > cw;
+    outside[4] += cz < -cw;
+    outside[5] += cz > cw;
+    if (cw <= 0) {
+      crossesCamera = true;
+      continue;
+    }
+    const float sx = (cx / cw + 1) * 0.5f * viewport.width();
+    const float sy = (1 - cy / cw) * 0.5f * viewport.height();
+    left = std::min(left, sx);
+    right = std::max(right, sx);
+    top = std::min(top, sy);
+    bottom = std::max(bottom, sy);
+  }
+
+  // all corners beyond single plane
+  for (int plane = 0; plane < 6; ++plane) {
+    if (outside[plane] == 8) {
+      return 0;
+    }
+  }
+  if (crossesCamera) {
+    return std::numeric_limits<float>::max();
+  }
+  return std::max(std::max(right - left, bottom - top), 1.f);
+}
+
+} // namespace
+
+
+LodOctree::LodOctree(const QString& lodFilePath, QObject* parent)
+  : QObject(parent),
+    _points(nullptr),
+    _memoryBudget(DEFAULT_MEMORY_BUDGET),
+    _cachedBytes(0)
+{
+  _file.setFileName(lodFilePath);
+  if (!_file.open(QIODevice::ReadOnly)) {
+    throw std::runtime_error("cannot open LOD file");
+  }
+  if (_file.read(reinterpret_cast<char*>(&_header), sizeof(_header)) != sizeof(_header) ||
+      std::memcmp(_header.magic, LOD_MAGIC, sizeof(LOD_MAGIC)) != 0) {
+    throw std::runtime_error("not a LOD file");
+  }
+
+  _nodes.resize(_header.nodesCount);
+  const qint64 tableSize = static_cast<qint64>(_nodes.size() * sizeof(LodNode));
+  const quint64 pointsSize = _header.pointsCount * POINT_STRIDE * sizeof(float);
+  if (_nodes.empty() || _file.read(reinterpret_cast<char*>(_nodes.data()), tableSize) != tableSize ||
+      static_cast<quint64>(_file.size()) < _header.pointsOffset + pointsSize) {
+    throw std::runtime_error("broken LOD file");
+  }
+  for (const auto& node : _nodes) {
+    if (node.first + node.count > _header.pointsCount || node.firstChild >= _nodes.size()) {
+      throw std::runtime_error("broken LOD file");
+    }
+  }
+
+  // nodes are read from mapping, the kernel pages them in and out
+  _points = _file.map(_header.pointsOffset, pointsSize);
+  if (!_points) {
+    throw std::runtime_error("cannot map LOD file");
+  }
+
+  connect(&_readWatcher, &QFutureWatcher<void>::finished, this, &LodOctree::_onNodesRead);
+}
+
+
+LodOctree::~LodOctree()
+{
+  cancel();
+}
+
+
+void LodOctree::cancel() {
+  _readWatcher.cancel();
+  _readWatcher.waitForFinished();
+  _reading.clear();
+  if (_points) {
+    _file.unmap(const_cast<uchar*>(_points));
+    _points = nullptr;
+  }
+  _file.close();
+}
+
+
+QVector3D LodOctree::boundMin() const {
+  return QVector3D(_header.boundMin[0], _header.boundMin[1], _header.boundMin[2]);
+}
+
+
+QVector3D LodOctree::boundMax() const {
+  return QVector3D(_header.boundMax[0], _header.boundMax[1], _header.boundMax[2]);
+}
+
+
+void LodOctree::setMemoryBudget(size_t bytes) {
+  _memoryBudget = bytes;
+  _evict();
+}
+
+
+size_t LodOctree::_nodeBytes(const LodNode& node) {
+  // points and their pick index
+  return node.count * (POINT_STRIDE * sizeof(float) + sizeof(quint32));
+}
+
+
+std::vector<quint32> LodOctree::select(const QMatrix4x4& viewMatrix, const QSize& viewport, size_t budget) {
+  if (!_points) {
+    return std::vector<quint32>();
+  }
+  budget = std::min(budget, _memoryBudget);
+  const float* m = viewMatrix.constData();
+
+  // largest on screen first, so budget goes to nodes closest to camera
+  std::priority_queue<std::pair<float, quint32> > candidates;
+  candidates.push(std::make_pair(projectedSize(_nodes[0], m, viewport), quint32(0)));
+  std::vector<quint32> selected;
+  size_t selectedBytes = 0;
+  while (!candidates.empty()) {
+    const auto top = candidates.top();
+    candidates.pop();
+    if (top.first <= 0) {
+      continue;
+    }
+
+    const LodNode& node = _nodes[top.second];
+    if (selectedBytes + _nodeBytes(node) > budget) {
+      break;
+    }
+    selected.push_back(top.second);
+    selectedBytes += _nodeBytes(node);
+
+    if (top.first > LOD_NODE_PIXELS) {
+      quint32 child = node.firstChild;
+      for (int octant = 0; octant < 8; ++octant) {
+        if (node.childMask & (1 << octant)) {
+          candidates.push(std::make_pair(projectedSize(_nodes[child], m, viewport), child));
+          ++child;
+        }
+      }
+    }
+  }
+
+  // keep selected in cache, read missing ones in background
+  std::vector<quint32> missing;
+  for (auto it = selected.rbegin(); it != selected.rend(); ++it) {
+    if (_cache.contains(*it)) {
+      _touch(*it);
+    }
+  }
+  for (quint32 node : selected) {
+    if (!_cache.contains(node)) {
+      missing.push_back(node);
+    }
+  }
+  _selected = selected;
+  if (!missing.empty() && _reading.empty()) {
+    _startReading(missing);
+  }
+  return selected;
+}
+
+
+std::shared_ptr<const LodNodeData> LodOctree::cached(quint32 node) const {
+  const auto it = _cache.find(node);
+  return it != _cache.end() ? it->data : std::shared_ptr<const LodNodeData>();
+}
+
+
+void LodOctree::_touch(quint32 node) {
+  CacheEntry& entry = _cache[node];
+  _lru.splice(_lru.begin(), _lru, entry.lru);
+}
+
+
+void LodOctree::_startReading(const std::vector<quint32>& missing) {
+  size_t bytes = 0;
+  for (quint32 node : missing) {
+    if (bytes >= READ_BATCH_BYTES) {
+      break;
+    }
+    ReadRequest request;
+    request.node = node;
+    _reading.push_back(request);
+    bytes += _nodeBytes(_nodes[node]);
+  }
+  _readWatcher.setFuture(QtConcurrent::map(_reading, [this](ReadRequest& request) {_readNode(request);}));
+}
+
+
+void LodOctree::_readNode(ReadRequest& request) const {
+  const LodNode& node = _nodes[request.node];
+  const float* points = reinterpret_cast<const float*>(_points) + node.first * POINT_STRIDE;
+  request.data = std::make_shared<LodNodeData>();
+  request.data->points.assign(points, node.count);
+  request.data->index.build(request.data->points);
+}
+
+
+void LodOctree::_onNodesRead() {
+  if (_readWatcher.isCanceled()) {
+    return;
+  }
+
+  for (const auto& request : _reading) {
+    if (!request.data || _cache.contains(request.node)) {
+      continue;
+    }
+    _lru.push_front(request.node);
+    CacheEntry entry;
+    entry.data = request.data;
+    entry.lru = _lru.begin();
+    _cache.insert(request.node, entry);
+    _cachedBytes += _nodeBytes(_nodes[request.node]);
+  }
+  _reading.clear();
+  _evict();
+  emit nodesLoaded();
+}
+
+
+void LodOctree::_evict() {
+  // least recently used go first, but never nodes of current view
+  QSet<quint32> keep;
+  for (quint32 node : _selected) {
+    keep.insert(node);
+  }
+  while (_cachedBytes > _memoryBudget && !_lru.empty() && !keep.contains(_lru.back())) {
+    const quint32 node = _lru.back();
+    _lru.pop_back();
+    _cache.remove(node);
+    _cachedBytes -= _nodeBytes(_nodes[node]);
+  }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <QObject>
+#include <QFile>
+#include <QHash>
+#include <QMatrix4x4>
+#include <QSize>
+#include <QVector3D>
+#include <QFutureWatcher>
+
+#include "pointindex.h"
+
+#include <list>
+#include <memory>
+#include <vector>
+
+
+//
+// On-disk level of detail octree, written by buildLodOctree() (lodbuilder.h).
+//
+// File is header, table of nodes in breadth first order and points of all nodes,
+// every node owns contiguous run of x, y, z, row index points in vertex buffer format.
+// Every node keeps random sample of points of its cube not taken by its ancestors,
+// so drawing node together with its ancestors gives evenly thinned cloud.
+//
+const char LOD_MAGIC[8] = {'p', 'c', 'v', 'l', 'o', 'd', '\0', '\2'};
+
+struct LodFileHeader {
+  char magic[8];
+  quint32 nodesCount;
+  quint32 reserved;
+  quint64 pointsCount;
+  float boundMin[3];
+  float boundMax[3];
+  quint64 pointsOffset;  // bytes preceding points data
+  double origin[3];      // points are relative to it, as PlyLoader stores them
+};
+
+struct LodNode {
+  float min[3];       // cube corner
+  float size;         // cube edge
+  quint64 first;      // first point of node
+  quint32 count;
+  quint32 firstChild; // children follow each other, 0 for leaf
+  quint32 childMask;  // octants which have child, bit (x | y << 1 | z << 2)
+  quint32 depth;
+};
+
+
+// what out-of-core view holds and draws
+struct LodStats {
+  int selectedNodes;
+  int drawnNodes;
+  quint64 drawnPoints;
+  quint64 cachedBytes;
+  quint64 gpuBytes;
+};
+
+
+// points of node read into memory
+struct LodNodeData {
+  PointStorage points;
+  PointIndex index;  // for measuring tool
+};
+
+
+//
+// Streams nodes of LOD octree file for current view within memory budget.
+//
+// select() walks hierarchy for camera, picks visible nodes refined until
+// their projection gets small enough, and queues missing ones for reading
+// in background. Read nodes are kept in LRU cache limited by memory budget.
+//
+class LodOctree : public QObject
+{
+  Q_OBJECT
+
+public:
+  // throws if file isn't LOD octree
+  LodOctree(const QString& lodFilePath, QObject* parent = 0);
+  ~LodOctree();
+
+  size_t pointsCount() const {return _header.pointsCount;}
+  QVector3D boundMin() const;
+  QVector3D boundMax() const;
+  const double* origin() const {return _header.origin;}
+  const std::vector<LodNode>& nodes() const {return _nodes;}
+
+  void setMemoryBudget(size_t bytes);
+  size_t memoryBudget() const {return _memoryBudget;}
+  size_t cachedBytes() const {return _cachedBytes;}
+
+  // nodes to draw for view, coarse first, total points size limited by budget bytes
+  std::vector<quint32> select(const QMatrix4x4& viewMatrix, const QSize& viewport, size_t budget);
+  // points of node if it's in cache, nullptr otherwise
+  std::shared_ptr<const LodNodeData> cached(quint32 node) const;
+
+  void cancel();
+
+
+signals:
+  // more nodes of last selection are in cache
+  void nodesLoaded();
+
+
+private slots:
+  void _onNodesRead();
+
+private:
+  struct ReadRequest {
+    quint32 node;
+    std::shared_ptr<LodNodeData> data;
+  };
+
+  struct CacheEntry {
+    std::shared_ptr<LodNodeData> data;
+    std::list<quint32>::iterator lru;
+  };
+
+  void _readNode(ReadRequest& request) const;
+  void _startReading(const std::vector<quint32>& missing);
+  void _touch(quint32 node);
+  void _evict();
+  static size_t _nodeBytes(const LodNode& node);
+
+  LodFileHeader _header;
+  std::vector<LodNode> _nodes;
+  QFile _file;
+  const uchar* _points;
+
+  size_t _memoryBudget;
+  size_t _cachedBytes;
+  QHash<quint32, CacheEntry> _cache;
+  std::list<quint32> _lru;  // most recently used first
+
+  std::vector<ReadRequest> _reading;
+  QFutureWatcher<void> _readWatcher;
+  std::vector<quint32> _selected;
+};
+
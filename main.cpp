@@ -1,9 +1,230 @@
 #include <QApplication>
+#include <QEventLoop>
+#include <QElapsedTimer>
+#include <QFileInfo>
 #include "mainwindow.h"
+#include "scene.h"
+#include "pointcache.h"
+#include "plywriter.h"
+#include "voxelgrid.h"
+#include "batchrenderer.h"
+
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+
+namespace {
+
+// parsed files are cached for quick reopen, --cache-dir=<dir> --cache-size=<MB> --no-cache
+void setCacheOptions(const QStringList& arguments) {
+  for (const auto& argument : arguments) {
+    if (argument.startsWith("--cache-dir=")) {
+      PointCache::setDirectory(argument.section('=', 1));
+    } else if (argument.startsWith("--cache-size=")) {
+      PointCache::setSizeLimit(argument.section('=', 1).toULongLong() << 20);
+    } else if (argument == "--no-cache") {
+      PointCache::setEnabled(false);
+    }
+  }
+}
+
+
+// GL 4.4 core profile renderer where driver has it, --renderer=compat keeps compatibility one
+void setRendererOption(const QStringList& arguments) {
+  Scene::setDefaultRenderer(arguments.contains("--renderer=compat") ? Scene::COMPATIBILITY_RENDERER
+                                                                     : Scene::CORE_RENDERER);
+}
+
+
+// --voxel-size=<size in file units> --voxel-mode=centroid|first, false for wrong value
+bool downsamplingOptions(const QStringList& arguments, float& voxelSize, VoxelGrid::Mode& mode) {
+  voxelSize = 0;
+  mode = VoxelGrid::CENTROID;
+  for (const auto& argument : arguments) {
+    bool valid = true;
+    if (argument.startsWith("--voxel-size=")) {
+      voxelSize = argument.section('=', 1).toFloat(&valid);
+      valid = valid && voxelSize >= 0;
+    } else if (argument.startsWith("--voxel-mode=")) {
+      valid = VoxelGrid::modeFromName(argument.section('=', 1), mode);
+    }
+    if (!valid) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// pcviewer --downsample --voxel-size=<size> [--voxel-mode=centroid|first] <input.ply> <output.ply>
+// writes reduced cloud without opening window
+int downsampleFile(const QStringList& arguments) {
+  float voxelSize;
+  VoxelGrid::Mode mode;
+  QStringList files;
+  for (const auto& argument : arguments.mid(1)) {
+    if (!argument.startsWith("--")) {
+      files << argument;
+    }
+  }
+  if (!downsamplingOptions(arguments, voxelSize, mode) || voxelSize <= 0 || files.size() != 2) {
+    std::cerr << "usage: pcviewer --downsample --voxel-size=<size> [--voxel-mode=centroid|first] "
+                 "<input.ply> <output.ply>" << std::endl;
+    return 2;
+  }
+
+  try {
+    PlyLoader loader(files[0], true);
+    QVector3D boundMin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                       std::numeric_limits<float>::max());
+    QVector3D boundMax = -boundMin;
+    QString error;
+    QEventLoop loop;
+    // pieces are announced by pool threads, loop's context queues them to this one,
+    // all of them ahead of finished
+    QObject::connect(&loader, &PlyLoader::pointsLoaded, &loop,
+                     [&](qulonglong, qulonglong, const QVector3D& min, const QVector3D& max) {
+      for (int axis = 0; axis < 3; ++axis) {
+        boundMin[axis] = std::min(boundMin[axis], min[axis]);
+        boundMax[axis] = std::max(boundMax[axis], max[axis]);
+      }
+    });
+    QObject::connect(&loader, &PlyLoader::finished, &loop, &QEventLoop::quit);
+    QObject::connect(&loader, &PlyLoader::failed, &loop, [&](const QString& e) {
+      error = e;
+      loop.quit();
+    });
+    loader.start();
+    if (!loader.isFinished() && error.isEmpty()) {
+      loop.exec();
+    }
+    if (!error.isEmpty()) {
+      throw std::runtime_error(error.toStdString());
+    }
+
+    QElapsedTimer downsampleTimer;
+    downsampleTimer.start();
+    PointStorage reduced;
+    VoxelGrid(voxelSize, mode).downsample(loader.points(), boundMin, boundMax, reduced);
+    const qint64 downsampleMsecs = downsampleTimer.elapsed();
+    // kept points are found in input by their rows, so they keep all its properties
+    PlyWriter writer(loader.origin());
+    writer.addPoints(reduced, files[0]);
+    writer.setComment(QString("reduced from %1 by voxel grid of %2").arg(QFileInfo(files[0]).fileName()).arg(voxelSize));
+    writer.write(files[1]);
+    std::cout << loader.pointsCount() << " points reduced to " << reduced.size()
+              << " in " << downsampleMsecs << " ms" << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << "pcviewer: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+
+// pcviewer --render --poses=<file> [--output-dir=<dir>] [--size=WxH] [--point-size=<pixels>]
+//          [--color=z|row] [--jobs=<files at once>] <file.ply|file.lod|directory>...
+// renders every file from every pose into PNG images without opening window
+int renderFiles(const QStringList& arguments) {
+  QString posesPath;
+  QString outputDirectory = ".";
+  int width = 1280;
+  int height = 720;
+  int pointSize = 1;
+  int jobs = 2;
+  Scene::colorAxisMode colorMode = Scene::COLOR_BY_Z;
+  QStringList files;
+  bool valid = true;
+  for (const auto& argument : arguments.mid(1)) {
+    const QString value = argument.section('=', 1);
+    if (argument.startsWith("--poses=")) {
+      posesPath = value;
+    } else if (argument.startsWith("--output-dir=")) {
+      outputDirectory = value;
+    } else if (argument.startsWith("--size=")) {
+      width = value.section('x', 0, 0).toInt();
+      height = value.section('x', 1).toInt();
+      valid = valid && width > 0 && height > 0;
+    } else if (argument.startsWith("--point-size=")) {
+      pointSize = value.toInt();
+      valid = valid && pointSize > 0;
+    } else if (argument.startsWith("--color=")) {
+      valid = valid && (value == "z" || value == "row");
+      colorMode = (value == "row") ? Scene::COLOR_BY_ROW : Scene::COLOR_BY_Z;
+    } else if (argument.startsWith("--jobs=")) {
+      jobs = value.toInt();
+      valid = valid && jobs > 0;
+    } else if (!argument.startsWith("--")) {
+      files << argument;
+    }
+  }
+  if (!valid || posesPath.isEmpty() || files.isEmpty()) {
+    std::cerr << "usage: pcviewer --render --poses=<file> [--output-dir=<dir>] [--size=WxH] "
+                 "[--point-size=<pixels>] [--color=z|row] [--jobs=<count>] <file>..." << std::endl;
+    return 2;
+  }
+
+  try {
+    BatchRenderer renderer(BatchRenderer::readPoses(posesPath), outputDirectory);
+    renderer.setImageSize(QSize(width, height));
+    renderer.setPointSize(pointSize);
+    renderer.setColorMode(colorMode);
+    renderer.setJobs(jobs);
+    return renderer.render(files) == 0 ? 0 : 1;
+  } catch (const std::exception& e) {
+    std::cerr << "pcviewer: " << e.what() << std::endl;
+    return 1;
+  }
+}
+
+} // namespace
+
 
 int main(int argc, char *argv[])
 {
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--downsample") == 0) {
+      QCoreApplication app(argc, argv);
+      setCacheOptions(app.arguments());
+      return downsampleFile(app.arguments());
+    }
+    if (std::strcmp(argv[i], "--render") == 0) {
+      // no display needed unless platform is chosen explicitly
+      if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+      }
+      QApplication app(argc, argv);
+      setRendererOption(app.arguments());
+      if (app.arguments().contains("--float-vertices")) {
+        Scene::setDefaultVertexFormat(Scene::FLOAT_VERTICES);
+      }
+      setCacheOptions(app.arguments());
+      float voxelSize;
+      VoxelGrid::Mode voxelMode;
+      if (downsamplingOptions(app.arguments(), voxelSize, voxelMode)) {
+        Scene::setDefaultDownsampling(voxelSize, voxelMode);
+      }
+      return renderFiles(app.arguments());
+    }
+  }
+
   QApplication app(argc, argv);
+  setRendererOption(app.arguments());
+  // 32-bit float vertices instead of compact ones, in case driver renders them wrong
+  if (app.arguments().contains("--float-vertices")) {
+    Scene::setDefaultVertexFormat(Scene::FLOAT_VERTICES);
+  }
+  setCacheOptions(app.arguments());
+  // oversampled clouds may be reduced on load, --voxel-size=<size> --voxel-mode=centroid|first
+  float voxelSize;
+  VoxelGrid::Mode voxelMode;
+  if (downsamplingOptions(app.arguments(), voxelSize, voxelMode)) {
+    Scene::setDefaultDownsampling(voxelSize, voxelMode);
+  } else {
+    std::cerr << "pcviewer: wrong --voxel-size or --voxel-mode, points are not downsampled" << std::endl;
+  }
   MainWindow mainWindow;
   mainWindow.show();
   return app.exec();
@@ -6,9 +6,15 @@
 #include <QLabel>
 #include <QApplication>
 #include <QDesktopWidget>
+#include <QProgressDialog>
+#include <QFutureWatcher>
+#include <QtConcurrent>
+#include <QAtomicInt>
+#include <QTimer>
 
 #include "mainwindow.h"
 #include "viewer.h"
+#include "lodbuilder.h"
 
 
 const QString TITLE = QObject::tr("Points Cloud Viewer");
@@ -31,13 +37,26 @@ MainWindow::MainWindow()
   QAction *openFile = new QAction(tr("&Open"), fileMenu);
   fileMenu->addAction(openFile);
   connect(openFile, &QAction::triggered, this, &MainWindow::_openFileDialog);
+  QAction *openTiles = new QAction(tr("Open &tiles directory..."), fileMenu);
+  fileMenu->addAction(openTiles);
+  connect(openTiles, &QAction::triggered, this, &MainWindow::_openTilesDialog);
+  QAction *buildLod = new QAction(tr("&Build LOD octree..."), fileMenu);
+  fileMenu->addAction(buildLod);
+  connect(buildLod, &QAction::triggered, this, &MainWindow::_buildLodDialog);
   QAction *closeView = new QAction(tr("&Close"), fileMenu);
   fileMenu->addAction(closeView);
   connect(closeView, &QAction::triggered, this, &MainWindow::_closeView);
 
-  // take first command line argument as a path to PLY files
-  if (QApplication::arguments().size() > 1) {
-    _openView(QApplication::arguments()[1]);
+  // take command line arguments which aren't options as paths to PLY files,
+  // several ones or directory are opened as tiles
+  QStringList filePaths;
+  for (const auto& argument : QApplication::arguments().mid(1)) {
+    if (!argument.startsWith("--")) {
+      filePaths << argument;
+    }
+  }
+  if (!filePaths.isEmpty()) {
+    _openView(filePaths);
   } else {
     // place some hints on a screen
     auto welcomeHint = new QLabel();
@@ -47,7 +66,9 @@ MainWindow::MainWindow()
     t += "<p />";
     t += "<ul>";
     t += "<li>Use menu <b>File</b> -> <b>Open</b> to load PLY file</li>";
-    t += "<li>Also first provided command line argument is treated as path to file</li>";
+    t += "<li>Also command line arguments are treated as paths to files</li>";
+    t += "<li>Select several PLY files or use menu <b>File</b> -> <b>Open tiles directory</b> to view tiles as one cloud</li>";
+    t += "<li>Use menu <b>File</b> -> <b>Build LOD octree</b> to convert PLY files larger than memory, then open resulting LOD file</li>";
     t += "<li><h2>Navigation hints</h2></li>";
     t += "<ul>";
     t += "<li>Use mouse to rotate camera</li>";
@@ -69,21 +90,84 @@ MainWindow::MainWindow()
 
 void MainWindow::_openFileDialog()
 {
-  const QString filePath = QFileDialog::getOpenFileName(this, tr("Open PLY file"), "", tr("PLY Files (*.ply)"));
-  if (!filePath.isEmpty()) {
-    _openView(filePath);
+  const QStringList filePaths = QFileDialog::getOpenFileNames(this, tr("Open PLY file"), "",
+                                                              tr("Points cloud files (*.ply *.ply.gz *.lod);;PLY Files (*.ply *.ply.gz);;LOD octree files (*.lod)"));
+  if (!filePaths.isEmpty()) {
+    _openView(filePaths);
   }
 }
 
 
-void MainWindow::_openView(const QString& filePath) {
+void MainWindow::_openTilesDialog()
+{
+  const QString directory = QFileDialog::getExistingDirectory(this, tr("Open directory of PLY tiles"));
+  if (!directory.isEmpty()) {
+    _openView(QStringList() << directory);
+  }
+}
+
+
+void MainWindow::_buildLodDialog()
+{
+  const QString plyPath = QFileDialog::getOpenFileName(this, tr("Build LOD octree of PLY file"), "", tr("PLY Files (*.ply *.ply.gz)"));
+  if (plyPath.isEmpty()) {
+    return;
+  }
+  const QString lodPath = QFileDialog::getSaveFileName(this, tr("Save LOD octree"), plyPath + ".lod", tr("LOD octree files (*.lod)"));
+  if (lodPath.isEmpty()) {
+    return;
+  }
+
+  // build in background, progress and cancel are passed through atomics
+  auto progressDialog = new QProgressDialog(tr("Building LOD octree..."), tr("Cancel"), 0, 100, this);
+  progressDialog->setWindowModality(Qt::WindowModal);
+  progressDialog->setMinimumDuration(0);
+  auto percent = QSharedPointer<QAtomicInt>(new QAtomicInt(0));
+  auto canceled = QSharedPointer<QAtomicInt>(new QAtomicInt(0));
+  connect(progressDialog, &QProgressDialog::canceled, [=]() {canceled->store(1);});
+  auto progressTimer = new QTimer(progressDialog);
+  connect(progressTimer, &QTimer::timeout, [=]() {progressDialog->setValue(percent->load());});
+  progressTimer->start(100);
+
+  auto watcher = new QFutureWatcher<QString>(this);
+  connect(watcher, &QFutureWatcher<QString>::finished, this, [=]() {
+    const QString error = watcher->result();
+    watcher->deleteLater();
+    progressDialog->deleteLater();
+    if (!error.isEmpty()) {
+      QMessageBox::warning(this, tr("Cannot build LOD octree"), error);
+    } else if (!canceled->load()) {
+      _openView(QStringList() << lodPath);
+    }
+  });
+  watcher->setFuture(QtConcurrent::run([=]() {
+    try {
+      buildLodOctree(plyPath, lodPath, [=](int done) {
+        percent->store(done);
+        return !canceled->load();
+      });
+    } catch (const std::exception& e) {
+      return QString(e.what());
+    }
+    return QString();
+  }));
+}
+
+
+void MainWindow::_openView(const QStringList& filePaths) {
   _closeView();
 
   try {
     // create new new
-    setCentralWidget(new Viewer(filePath));
+    auto viewer = new Viewer(filePaths);
+    connect(viewer, &Viewer::loadFailed, this, [=](const QString& error) {
+      _closeView();
+      QMessageBox::warning(this, tr("Cannot open view"), error);
+    });
+    setCentralWidget(viewer);
     // add source path into title
-    setWindowTitle(QString("%1 - %2").arg(filePath).arg(TITLE));
+    const QString source = filePaths.size() == 1 ? filePaths[0] : tr("%1 files").arg(filePaths.size());
+    setWindowTitle(QString("%1 - %2").arg(source).arg(TITLE));
   } catch (const std::exception& e) {
     QMessageBox::warning(this, tr("Cannot open view"), e.what());
   }
@@ -93,6 +177,10 @@ void MainWindow::_openView(const QString& filePath) {
 void MainWindow::_closeView()
 {
   if (centralWidget()) {
+    // stop loading right away, view is destroyed later
+    if (auto viewer = qobject_cast<Viewer*>(centralWidget())) {
+      viewer->cancelLoading();
+    }
     // destroy view
     centralWidget()->close();
     takeCentralWidget()->deleteLater();
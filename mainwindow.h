@@ -11,6 +11,8 @@ public:
 
 protected slots:
   void _openFileDialog();
-  void _openView(const QString& plyPath);
+  void _buildLodDialog();
+  void _openTilesDialog();
+  void _openView(const QStringList& filePaths);
   void _closeView();
 };
@@ -0,0 +1,278 @@
+#include "overlay.h"
+
+#include <QOpenGLContext>
+#include <QPainter>
+#include <QVector2D>
+#include <QVector4D>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+
+namespace {
+
+// half of marker square side, pixels
+const float MARKER_HALF_SIZE = 6;
+// vertex buffer grows by doubling from it
+const size_t MIN_CAPACITY = 1024;
+
+// attribute locations of overlay shaders
+const GLuint POSITION_ATTRIBUTE = 0;
+const GLuint OFFSET_ATTRIBUTE = 1;
+const GLuint COLOR_ATTRIBUTE = 2;
+
+} // namespace
+
+
+Overlay::Overlay()
+  : _nextId(1),
+    _labelsCount(0),
+    _dirtyBegin(0),
+    _dirtyEnd(0),
+    _capacity(0)
+{
+}
+
+
+Overlay::~Overlay()
+{
+}
+
+
+Overlay::Id Overlay::addMarker(const QVector3D& position, const QColor& color, const QString& label)
+{
+  // square of four lines around position, shader moves corners by their offsets
+  const float corners[4][2] = {
+    {-MARKER_HALF_SIZE, -MARKER_HALF_SIZE}, {MARKER_HALF_SIZE, -MARKER_HALF_SIZE},
+    {MARKER_HALF_SIZE, MARKER_HALF_SIZE}, {-MARKER_HALF_SIZE, MARKER_HALF_SIZE}
+  };
+  std::vector<Vertex> vertices;
+  for (int edge = 0; edge < 4; ++edge) {
+    for (int end = 0; end < 2; ++end) {
+      const float* corner = corners[(edge + end) % 4];
+      const Vertex v = {
+        {position.x(), position.y(), position.z()}, {corner[0], corner[1]},
+        {GLubyte(color.red()), GLubyte(color.green()), GLubyte(color.blue()), GLubyte(color.alpha())}
+      };
+      vertices.push_back(v);
+    }
+  }
+  Item item;
+  item.label = label;
+  item.labelPosition = position;
+  item.color = color;
+  return _add(item, vertices);
+}
+
+
+Overlay::Id Overlay::addPolyline(const QVector<QVector3D>& points, const QColor& color, const QString& label)
+{
+  std::vector<Vertex> vertices;
+  for (int i = 1; i < points.size(); ++i) {
+    for (const QVector3D& p : {points[i - 1], points[i]}) {
+      const Vertex v = {
+        {p.x(), p.y(), p.z()}, {0, 0},
+        {GLubyte(color.red()), GLubyte(color.green()), GLubyte(color.blue()), GLubyte(color.alpha())}
+      };
+      vertices.push_back(v);
+    }
+  }
+  Item item;
+  item.label = label;
+  item.labelPosition = points.isEmpty() ? QVector3D()
+                                        : (points[(points.size() - 1) / 2] + points[points.size() / 2]) / 2;
+  item.color = color;
+  return _add(item, vertices);
+}
+
+
+Overlay::Id Overlay::_add(Item item, const std::vector<Vertex>& vertices)
+{
+  item.first = _vertices.size();
+  item.count = vertices.size();
+  _vertices.insert(_vertices.end(), vertices.begin(), vertices.end());
+  _markDirty(item.first, item.count);
+  if (!item.label.isEmpty()) {
+    ++_labelsCount;
+  }
+  const Id id = _nextId++;
+  _items.insert(id, item);
+  return id;
+}
+
+
+void Overlay::moveMarker(Id id, const QVector3D& position)
+{
+  auto item = _items.find(id);
+  if (item == _items.end()) {
+    return;
+  }
+  item->labelPosition = position;
+  for (size_t i = item->first; i < item->first + item->count; ++i) {
+    _vertices[i].position[0] = position.x();
+    _vertices[i].position[1] = position.y();
+    _vertices[i].position[2] = position.z();
+  }
+  _markDirty(item->first, item->count);
+}
+
+
+void Overlay::remove(Id id)
+{
+  auto item = _items.find(id);
+  if (item == _items.end()) {
+    return;
+  }
+  // items behind removed one move down, their part of buffer is rewritten
+  const size_t first = item->first;
+  const size_t count = item->count;
+  _vertices.erase(_vertices.begin() + first, _vertices.begin() + first + count);
+  if (!item->label.isEmpty()) {
+    --_labelsCount;
+  }
+  _items.erase(item);
+  for (auto& other : _items) {
+    if (other.first > first) {
+      other.first -= count;
+    }
+  }
+  _markDirty(first, _vertices.size() - first);
+}
+
+
+void Overlay::clear()
+{
+  _vertices.clear();
+  _items.clear();
+  _labelsCount = 0;
+  _dirtyBegin = _dirtyEnd = 0;
+}
+
+
+void Overlay::_markDirty(size_t first, size_t count)
+{
+  if (count == 0) {
+    return;
+  }
+  if (_dirtyBegin == _dirtyEnd) {
+    _dirtyBegin = first;
+    _dirtyEnd = first + count;
+  } else {
+    _dirtyBegin = std::min(_dirtyBegin, first);
+    _dirtyEnd = std::max(_dirtyEnd, first + count);
+  }
+}
+
+
+bool Overlay::_initialize()
+{
+  initializeOpenGLFunctions();
+  // version 120 shaders don't compile in core profile context
+  const bool core = QOpenGLContext::currentContext()->format().profile() == QSurfaceFormat::CoreProfile;
+  const QString prefix = core ? ":/core_" : ":/";
+  _program.reset(new QOpenGLShaderProgram());
+  const bool built = _program->addShaderFromSourceFile(QOpenGLShader::Vertex, prefix + "overlay_vertex_shader.glsl")
+      && _program->addShaderFromSourceFile(QOpenGLShader::Fragment, prefix + "overlay_fragment_shader.glsl");
+  _program->bindAttributeLocation("position", POSITION_ATTRIBUTE);
+  _program->bindAttributeLocation("offset", OFFSET_ATTRIBUTE);
+  _program->bindAttributeLocation("color", COLOR_ATTRIBUTE);
+  if (!built || !_program->link()) {
+    _program.reset();
+    return false;
+  }
+
+  _vao.create();
+  QOpenGLVertexArrayObject::Binder vaoBinder(&_vao);
+  _buffer.create();
+  _buffer.setUsagePattern(QOpenGLBuffer::DynamicDraw);
+  _buffer.bind();
+  const GLsizei stride = sizeof(Vertex);
+  glEnableVertexAttribArray(POSITION_ATTRIBUTE);
+  glEnableVertexAttribArray(OFFSET_ATTRIBUTE);
+  glEnableVertexAttribArray(COLOR_ATTRIBUTE);
+  glVertexAttribPointer(POSITION_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, stride,
+                        reinterpret_cast<void *>(offsetof(Vertex, position)));
+  glVertexAttribPointer(OFFSET_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, stride,
+                        reinterpret_cast<void *>(offsetof(Vertex, offset)));
+  glVertexAttribPointer(COLOR_ATTRIBUTE, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                        reinterpret_cast<void *>(offsetof(Vertex, color)));
+  _buffer.release();
+  _capacity = 0;
+  return true;
+}
+
+
+void Overlay::_upload()
+{
+  // for buffer bound
+  if (_vertices.size() > _capacity) {
+    // doubling keeps one by one additions from reallocating every time
+    _capacity = std::max(std::max(_vertices.size(), 2 * _capacity), MIN_CAPACITY);
+    _buffer.allocate(static_cast<int>(_capacity * sizeof(Vertex)));
+    _dirtyBegin = 0;
+    _dirtyEnd = _vertices.size();
+  }
+  _dirtyEnd = std::min(_dirtyEnd, _vertices.size());
+  if (_dirtyBegin < _dirtyEnd) {
+    _buffer.write(static_cast<int>(_dirtyBegin * sizeof(Vertex)), &_vertices[_dirtyBegin],
+                  static_cast<int>((_dirtyEnd - _dirtyBegin) * sizeof(Vertex)));
+  }
+  _dirtyBegin = _dirtyEnd = 0;
+}
+
+
+void Overlay::draw(const QMatrix4x4& viewMatrix, const QSize& viewport)
+{
+  if (_vertices.empty() || viewport.isEmpty()) {
+    return;
+  }
+  if (!_program && !_initialize()) {
+    return;
+  }
+
+  QOpenGLVertexArrayObject::Binder vaoBinder(&_vao);
+  _buffer.bind();
+  _upload();
+  _program->bind();
+  _program->setUniformValue("viewMatrix", viewMatrix);
+  _program->setUniformValue("viewportSize", QVector2D(viewport.width(), viewport.height()));
+  // annotations stay visible through points
+  glDisable(GL_DEPTH_TEST);
+  glDrawArrays(GL_LINES, 0, static_cast<GLsizei>(_vertices.size()));
+  glEnable(GL_DEPTH_TEST);
+  _program->release();
+  _buffer.release();
+}
+
+
+void Overlay::drawLabels(QPainter& painter, const QMatrix4x4& viewMatrix, const QSize& viewport) const
+{
+  for (const auto& item : _items) {
+    if (item.label.isEmpty()) {
+      continue;
+    }
+    const QVector4D clip = viewMatrix * QVector4D(item.labelPosition, 1);
+    if (clip.w() <= 0) {
+      continue;
+    }
+    const QVector3D ndc = clip.toVector3D() / clip.w();
+    if (std::abs(ndc.x()) > 1 || std::abs(ndc.y()) > 1 || std::abs(ndc.z()) > 1) {
+      continue;
+    }
+    const QPointF anchor((ndc.x() + 1) / 2 * viewport.width(), (1 - ndc.y()) / 2 * viewport.height());
+    painter.setPen(item.color);
+    painter.drawText(anchor + QPointF(MARKER_HALF_SIZE + 2, -MARKER_HALF_SIZE - 2), item.label);
+  }
+}
+
+
+void Overlay::cleanup()
+{
+  _buffer.destroy();
+  _vao.destroy();
+  _program.reset();
+  _capacity = 0;
+  _dirtyBegin = 0;
+  _dirtyEnd = _vertices.size();
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <QOpenGLFunctions>
+#include <QOpenGLBuffer>
+#include <QOpenGLVertexArrayObject>
+#include <QOpenGLShaderProgram>
+#include <QMatrix4x4>
+#include <QScopedPointer>
+#include <QColor>
+#include <QHash>
+#include <QSize>
+#include <QString>
+#include <QVector>
+#include <QVector3D>
+
+#include <vector>
+
+class QPainter;
+
+
+//
+// Retained annotations drawn over points: markers (squares of fixed size on screen),
+// polylines and text labels attached to either.
+//
+// Lines of all items live in single vertex buffer drawn by one call, changed items
+// rewrite just their range of it on next draw. Markers are expanded to screen size
+// by overlay_vertex_shader.glsl, labels are drawn with QPainter on top.
+//
+class Overlay : protected QOpenGLFunctions
+{
+public:
+  typedef quint32 Id;
+
+  Overlay();
+  ~Overlay();
+
+  // items may be changed any time, GL resources are made on first draw
+  Id addMarker(const QVector3D& position, const QColor& color, const QString& label = QString());
+  // label goes to middle of polyline
+  Id addPolyline(const QVector<QVector3D>& points, const QColor& color, const QString& label = QString());
+  void moveMarker(Id id, const QVector3D& position);
+  void remove(Id id);
+  void clear();
+  bool contains(Id id) const {return _items.contains(id);}
+
+  // context of widget must be current
+  void draw(const QMatrix4x4& viewMatrix, const QSize& viewport);
+  void drawLabels(QPainter& painter, const QMatrix4x4& viewMatrix, const QSize& viewport) const;
+  bool hasLabels() const {return _labelsCount > 0;}
+  // releases GL resources, they're made again by next draw
+  void cleanup();
+
+
+private:
+  struct Vertex {
+    GLfloat position[3];
+    GLfloat offset[2];  // pixels from position on screen, markers only
+    GLubyte color[4];
+  };
+
+  struct Item {
+    size_t first;  // vertices of item
+    size_t count;
+    QString label;
+    QVector3D labelPosition;
+    QColor color;
+  };
+
+  Id _add(Item item, const std::vector<Vertex>& vertices);
+  void _markDirty(size_t first, size_t count);
+  bool _initialize();
+  void _upload();
+
+  std::vector<Vertex> _vertices;
+  QHash<Id, Item> _items;
+  Id _nextId;
+  int _labelsCount;
+
+  // vertices of [_dirtyBegin, _dirtyEnd) differ from ones in buffer
+  size_t _dirtyBegin;
+  size_t _dirtyEnd;
+  size_t _capacity;
+
+  QScopedPointer<QOpenGLShaderProgram> _program;
+  QOpenGLVertexArrayObject _vao;
+  QOpenGLBuffer _buffer;
+};
@@ -0,0 +1,7 @@
+#version 120
+
+varying vec4 lineColor;
+
+void main() {
+  gl_FragColor = lineColor;
+}
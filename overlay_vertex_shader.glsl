@@ -0,0 +1,18 @@
+#version 120
+
+uniform mat4 viewMatrix;
+uniform vec2 viewportSize;
+
+attribute vec3 position;
+// pixels on screen, keeps markers same size at any distance
+attribute vec2 offset;
+attribute vec4 color;
+
+varying vec4 lineColor;
+
+void main() {
+  vec4 projected = viewMatrix * vec4(position, 1.0);
+  projected.xy += offset * 2.0 / viewportSize * projected.w;
+  gl_Position = projected;
+  lineColor = color;
+}
@@ -1,17 +1,58 @@
 HEADERS  = scene.h \
+    plyloader.h \
+    plyheader.h \
+    gzipreader.h \
+    plydecoders.h \
+    pointstorage.h \
+    pointcache.h \
+    voxelgrid.h \
+    tileset.h \
+    plywriter.h \
+    batchrenderer.h \
+    pointindex.h \
+    pointselection.h \
+    zhistogram.h \
+    pointbudget.h \
+    lodoctree.h \
+    lodbuilder.h \
     viewer.h \
     mainwindow.h \
-    camera.h
+    camera.h \
+    framescheduler.h \
+    overlay.h \
+    indirectdraw.h
 SOURCES  = scene.cpp \
+    plyloader.cpp \
+    plyheader.cpp \
+    gzipreader.cpp \
+    plydecoders.cpp \
+    pointstorage.cpp \
+    pointcache.cpp \
+    voxelgrid.cpp \
+    tileset.cpp \
+    plywriter.cpp \
+    batchrenderer.cpp \
+    pointindex.cpp \
+    pointselection.cpp \
+    zhistogram.cpp \
+    pointbudget.cpp \
+    lodoctree.cpp \
+    lodbuilder.cpp \
     main.cpp \
     viewer.cpp \
     mainwindow.cpp \
-    camera.cpp
+    camera.cpp \
+    framescheduler.cpp \
+    overlay.cpp \
+    indirectdraw.cpp
 
-QT += widgets
+QT += widgets concurrent
 
 CONFIG += c++11
 
+# system zlib, one bundled with Qt has no public headers
+LIBS += -lz
+
 RESOURCES += \
     resources.qrc
 
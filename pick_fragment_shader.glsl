@@ -0,0 +1,9 @@
+#version 130
+
+flat in uint pointId;
+
+void main() {
+  // id bytes go into color channels exactly, read back as unsigned bytes
+  gl_FragColor = vec4(float(pointId & 255u), float((pointId >> 8) & 255u),
+                      float((pointId >> 16) & 255u), float(pointId >> 24)) / 255.0;
+}
@@ -0,0 +1,23 @@
+#version 130
+
+uniform float pointSize;
+uniform mat4 viewMatrix;
+// bounds of compact vertices, see vertex_shader.glsl
+uniform vec3 chunkMin;
+uniform vec3 chunkSize;
+// id of first vertex of draw call, 0 is left for background
+uniform uint idBase;
+// clipping planes, see vertex_shader.glsl
+uniform vec4 clippingPlanes[2];
+
+in vec4 vertex;
+
+flat out uint pointId;
+
+void main() {
+  gl_Position = viewMatrix * vec4(chunkMin + vertex.xyz * chunkSize, 1.0);
+  gl_PointSize  = pointSize;
+  gl_ClipDistance[0] = dot(clippingPlanes[0], gl_Position);
+  gl_ClipDistance[1] = dot(clippingPlanes[1], gl_Position);
+  pointId = idBase + uint(gl_VertexID) + 1u;
+}
@@ -0,0 +1,326 @@
+#include "plydecoders.h"
+
+#include <stdexcept>
+
+
+namespace {
+
+const int AXES = 3;
+
+
+template <typename T, bool Swap>
+inline T loadScalar(const uchar* src) {
+  T value;
+  if (Swap) {
+    uchar raw[sizeof(T)];
+    std::reverse_copy(src, src + sizeof(T), raw);
+    std::memcpy(&value, raw, sizeof(T));
+  } else {
+    std::memcpy(&value, src, sizeof(T));
+  }
+  return value;
+}
+
+
+//
+// binary decoders
+//
+
+// layout already matches vertex buffer, copy x, y, z as is
+const uchar* decodePackedFloats(const uchar* record, const uchar*, size_t firstRow, size_t rows,
+                                const PlyVertexLayout& layout, float* out) {
+  const size_t stride = layout.stride;
+  const size_t offset = layout.offsets[0];
+  const size_t lastRow = firstRow + rows;
+  for (size_t row = firstRow; row < lastRow; ++row, record += stride, out += POINT_STRIDE) {
+    std::memcpy(out, record + offset, 3 * sizeof(float));
+    out[3] = row;
+  }
+  return record;
+}
+
+
+// x, y, z of same scalar type at fixed offsets
+template <typename T, bool Swap>
+const uchar* decodeXYZ(const uchar* record, const uchar*, size_t firstRow, size_t rows,
+                       const PlyVertexLayout& layout, float* out) {
+  const size_t stride = layout.stride;
+  const size_t ox = layout.offsets[0];
+  const size_t oy = layout.offsets[1];
+  const size_t oz = layout.offsets[2];
+  const size_t lastRow = firstRow + rows;
+  for (size_t row = firstRow; row < lastRow; ++row, record += stride, out += POINT_STRIDE) {
+    out[0] = static_cast<float>(loadScalar<T, Swap>(record + ox) - layout.origin[0]);
+    out[1] = static_cast<float>(loadScalar<T, Swap>(record + oy) - layout.origin[1]);
+    out[2] = static_cast<float>(loadScalar<T, Swap>(record + oz) - layout.origin[2]);
+    out[3] = row;
+  }
+  return record;
+}
+
+
+// x, y, z of different scalar types at fixed offsets
+const uchar* decodeMixedXYZ(const uchar* record, const uchar*, size_t firstRow, size_t rows,
+                            const PlyVertexLayout& layout, float* out) {
+  const bool bigEndian = (layout.format == PLY_BINARY_BIG_ENDIAN);
+  PlyScalarType types[AXES];
+  for (int axis = 0; axis < AXES; ++axis) {
+    types[axis] = layout.element->properties[layout.indices[axis]].type;
+  }
+  const size_t lastRow = firstRow + rows;
+  for (size_t row = firstRow; row < lastRow; ++row, record += layout.stride, out += POINT_STRIDE) {
+    for (int axis = 0; axis < AXES; ++axis) {
+      out[axis] = static_cast<float>(plyReadScalar(record + layout.offsets[axis], types[axis], bigEndian) -
+                                     layout.origin[axis]);
+    }
+    out[3] = row;
+  }
+  return record;
+}
+
+
+// records with list properties, walked property by property
+const uchar* decodeVariableRecords(const uchar* record, const uchar* end, size_t firstRow, size_t rows,
+                                   const PlyVertexLayout& layout, float* out) {
+  const bool bigEndian = (layout.format == PLY_BINARY_BIG_ENDIAN);
+  const std::vector<PlyProperty>& properties = layout.element->properties;
+  const size_t lastRow = firstRow + rows;
+  for (size_t row = firstRow; row < lastRow; ++row, out += POINT_STRIDE) {
+    for (size_t i = 0; i < properties.size(); ++i) {
+      const PlyProperty& prop = properties[i];
+      size_t size = plyScalarSize(prop.type);
+      if (prop.isList) {
+        const size_t countSize = plyScalarSize(prop.countType);
+        if (end - record < static_cast<ptrdiff_t>(countSize)) {
+          return nullptr;
+        }
+        size *= static_cast<size_t>(plyReadScalar(record, prop.countType, bigEndian));
+        record += countSize;
+      }
+      if (end - record < static_cast<ptrdiff_t>(size)) {
+        return nullptr;
+      }
+      for (int axis = 0; axis < AXES; ++axis) {
+        if (layout.indices[axis] == static_cast<int>(i)) {
+          out[axis] = static_cast<float>(plyReadScalar(record, prop.type, bigEndian) - layout.origin[axis]);
+        }
+      }
+      record += size;
+    }
+    out[3] = row;
+  }
+  return record;
+}
+
+
+template <typename T>
+PlyBinaryDecoder xyzDecoder(bool swap) {
+  return swap ? &decodeXYZ<T, true> : &decodeXYZ<T, false>;
+}
+
+
+//
+// ascii decoders
+//
+
+// x, y, z are first three tokens in any order, rest of line is skipped unseen
+template <int X, int Y, int Z>
+bool decodeAsciiLeading(const char*& p, const char* end, size_t firstRow, size_t rows,
+                        const PlyVertexLayout& layout, float* out) {
+  const size_t lastRow = firstRow + rows;
+  for (size_t row = firstRow; row < lastRow; ++row, out += POINT_STRIDE) {
+    double tokens[AXES];
+    if (!parseFloat(p, end, tokens[0]) || !parseFloat(p, end, tokens[1]) || !parseFloat(p, end, tokens[2])) {
+      return false;
+    }
+    p = nextLine(p, end);
+    out[0] = static_cast<float>(tokens[X] - layout.origin[0]);
+    out[1] = static_cast<float>(tokens[Y] - layout.origin[1]);
+    out[2] = static_cast<float>(tokens[Z] - layout.origin[2]);
+    out[3] = row;
+  }
+  return true;
+}
+
+
+// x, y, z anywhere among scalar tokens, others are skipped without conversion
+bool decodeAsciiScalars(const char*& p, const char* end, size_t firstRow, size_t rows,
+                        const PlyVertexLayout& layout, float* out) {
+  const int lastToken = std::max(layout.indices[0], std::max(layout.indices[1], layout.indices[2]));
+  std::vector<int> tokenAxis(lastToken + 1, -1);
+  for (int axis = 0; axis < AXES; ++axis) {
+    tokenAxis[layout.indices[axis]] = axis;
+  }
+
+  const size_t lastRow = firstRow + rows;
+  for (size_t row = firstRow; row < lastRow; ++row, out += POINT_STRIDE) {
+    for (int token = 0; token <= lastToken; ++token) {
+      const int axis = tokenAxis[token];
+      double value;
+      if (axis >= 0 ? !parseFloat(p, end, value) : !skipToken(p, end)) {
+        return false;
+      }
+      if (axis >= 0) {
+        out[axis] = static_cast<float>(value - layout.origin[axis]);
+      }
+    }
+    p = nextLine(p, end);
+    out[3] = row;
+  }
+  return true;
+}
+
+
+// lines with list properties, walked property by property
+bool decodeAsciiVariable(const char*& p, const char* end, size_t firstRow, size_t rows,
+                         const PlyVertexLayout& layout, float* out) {
+  const int lastIndex = std::max(layout.indices[0], std::max(layout.indices[1], layout.indices[2]));
+  const std::vector<PlyProperty>& properties = layout.element->properties;
+
+  const size_t lastRow = firstRow + rows;
+  for (size_t row = firstRow; row < lastRow; ++row, out += POINT_STRIDE) {
+    for (int i = 0; i <= lastIndex; ++i) {
+      if (properties[i].isList) {
+        float count;
+        if (!parseFloat(p, end, count)) {
+          return false;
+        }
+        for (int item = 0; item < static_cast<int>(count); ++item) {
+          if (!skipToken(p, end)) {
+            return false;
+          }
+        }
+        continue;
+      }
+
+      int axis = -1;
+      for (int a = 0; a < AXES; ++a) {
+        if (layout.indices[a] == i) {
+          axis = a;
+        }
+      }
+      double value;
+      if (axis >= 0 ? !parseFloat(p, end, value) : !skipToken(p, end)) {
+        return false;
+      }
+      if (axis >= 0) {
+        out[axis] = static_cast<float>(value - layout.origin[axis]);
+      }
+    }
+    p = nextLine(p, end);
+    out[3] = row;
+  }
+  return true;
+}
+
+} // namespace
+
+
+PlyVertexLayout PlyVertexLayout::fromElement(PlyFormat format, const PlyElement& element) {
+  PlyVertexLayout layout;
+  layout.format = format;
+  layout.element = &element;
+  layout.stride = element.recordSize();
+  layout.fixedOffsets = true;
+  std::fill(layout.origin, layout.origin + AXES, 0.);
+
+  const char* names[AXES] = {"x", "y", "z"};
+  for (int axis = 0; axis < AXES; ++axis) {
+    layout.indices[axis] = element.propertyIndex(names[axis]);
+    if (layout.indices[axis] < 0) {
+      throw std::runtime_error("ply vertex has no x, y, z properties");
+    }
+    for (int i = 0; i < layout.indices[axis]; ++i) {
+      layout.fixedOffsets &= !element.properties[i].isList;
+    }
+    layout.offsets[axis] = element.propertyOffset(layout.indices[axis]);
+  }
+  return layout;
+}
+
+
+PlyBinaryDecoder selectBinaryDecoder(const PlyVertexLayout& layout) {
+  if (layout.stride == 0) {
+    return &decodeVariableRecords;
+  }
+
+  const std::vector<PlyProperty>& properties = layout.element->properties;
+  const PlyScalarType type = properties[layout.indices[0]].type;
+  if (properties[layout.indices[1]].type != type || properties[layout.indices[2]].type != type) {
+    return &decodeMixedXYZ;
+  }
+
+  const bool swap = (layout.format == PLY_BINARY_BIG_ENDIAN) != (Q_BYTE_ORDER == Q_BIG_ENDIAN);
+  const bool packed = layout.offsets[1] == layout.offsets[0] + 4 && layout.offsets[2] == layout.offsets[0] + 8 &&
+      layout.origin[0] == 0 && layout.origin[1] == 0 && layout.origin[2] == 0;
+  switch (type) {
+    case PLY_INT8: return xyzDecoder<qint8>(swap);
+    case PLY_UINT8: return xyzDecoder<quint8>(swap);
+    case PLY_INT16: return xyzDecoder<qint16>(swap);
+    case PLY_UINT16: return xyzDecoder<quint16>(swap);
+    case PLY_INT32: return xyzDecoder<qint32>(swap);
+    case PLY_UINT32: return xyzDecoder<quint32>(swap);
+    case PLY_FLOAT32: return (!swap && packed) ? &decodePackedFloats : xyzDecoder<float>(swap);
+    case PLY_FLOAT64: return xyzDecoder<double>(swap);
+  }
+  return &decodeMixedXYZ;
+}
+
+
+PlyAsciiDecoder selectAsciiDecoder(const PlyVertexLayout& layout) {
+  if (!layout.fixedOffsets) {
+    return &decodeAsciiVariable;
+  }
+
+  // x, y, z in first three tokens
+  static const struct {
+    int x, y, z;
+    PlyAsciiDecoder decoder;
+  } leading[] = {
+    {0, 1, 2, &decodeAsciiLeading<0, 1, 2>}, {0, 2, 1, &decodeAsciiLeading<0, 2, 1>},
+    {1, 0, 2, &decodeAsciiLeading<1, 0, 2>}, {1, 2, 0, &decodeAsciiLeading<1, 2, 0>},
+    {2, 0, 1, &decodeAsciiLeading<2, 0, 1>}, {2, 1, 0, &decodeAsciiLeading<2, 1, 0>}
+  };
+  for (const auto& l : leading) {
+    if (layout.indices[0] == l.x && layout.indices[1] == l.y && layout.indices[2] == l.z) {
+      return l.decoder;
+    }
+  }
+  return &decodeAsciiScalars;
+}
+
+
+const uchar* skipBinaryRecord(const uchar* record, const uchar* end, const PlyElement& element, bool bigEndian) {
+  for (const auto& prop : element.properties) {
+    size_t size = plyScalarSize(prop.type);
+    if (prop.isList) {
+      const size_t countSize = plyScalarSize(prop.countType);
+      if (end - record < static_cast<ptrdiff_t>(countSize)) {
+        return nullptr;
+      }
+      size *= static_cast<size_t>(plyReadScalar(record, prop.countType, bigEndian));
+      record += countSize;
+    }
+    if (end - record < static_cast<ptrdiff_t>(size)) {
+      return nullptr;
+    }
+    record += size;
+  }
+  return record;
+}
+
+
+double plyReadScalar(const uchar* src, PlyScalarType type, bool bigEndian) {
+  const bool swap = bigEndian != (Q_BYTE_ORDER == Q_BIG_ENDIAN);
+  switch (type) {
+    case PLY_INT8: return loadScalar<qint8, false>(src);
+    case PLY_UINT8: return loadScalar<quint8, false>(src);
+    case PLY_INT16: return swap ? loadScalar<qint16, true>(src) : loadScalar<qint16, false>(src);
+    case PLY_UINT16: return swap ? loadScalar<quint16, true>(src) : loadScalar<quint16, false>(src);
+    case PLY_INT32: return swap ? loadScalar<qint32, true>(src) : loadScalar<qint32, false>(src);
+    case PLY_UINT32: return swap ? loadScalar<quint32, true>(src) : loadScalar<quint32, false>(src);
+    case PLY_FLOAT32: return swap ? loadScalar<float, true>(src) : loadScalar<float, false>(src);
+    case PLY_FLOAT64: return swap ? loadScalar<double, true>(src) : loadScalar<double, false>(src);
+  }
+  return 0;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "plyheader.h"
+
+#include <QtGlobal>
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+const size_t POINT_STRIDE = 4; // x, y, z, index
+
+
+//
+// Where x, y, z live in vertex record.
+// Decoders are picked once per file from this layout, so inner loops
+// don't branch on property types, their order or byte order.
+//
+struct PlyVertexLayout {
+  PlyFormat format;
+  const PlyElement* element;
+  size_t stride;            // bytes of binary record, 0 if record has lists
+  int indices[3];           // x, y, z property index
+  size_t offsets[3];        // x, y, z bytes offset in binary record
+  bool fixedOffsets;        // no list precedes x, y, z
+  // subtracted from x, y, z in double precision before they're stored as floats,
+  // so georeferenced coordinates keep their fractions
+  double origin[3];
+
+  // throws if vertex has no x, y, z
+  static PlyVertexLayout fromElement(PlyFormat format, const PlyElement& element);
+};
+
+
+// decode binary vertex records into x, y, z, row index points,
+// return pointer past last decoded record or nullptr for truncated data
+typedef const uchar* (*PlyBinaryDecoder)(const uchar* record, const uchar* end, size_t firstRow, size_t rows,
+                                         const PlyVertexLayout& layout, float* out);
+
+// decode ascii vertex lines into x, y, z, row index points,
+// return false for malformed line, p is moved past decoded lines
+typedef bool (*PlyAsciiDecoder)(const char*& p, const char* end, size_t firstRow, size_t rows,
+                                const PlyVertexLayout& layout, float* out);
+
+PlyBinaryDecoder selectBinaryDecoder(const PlyVertexLayout& layout);
+PlyAsciiDecoder selectAsciiDecoder(const PlyVertexLayout& layout);
+
+// move past binary record with list properties, nullptr for truncated data
+const uchar* skipBinaryRecord(const uchar* record, const uchar* end, const PlyElement& element, bool bigEndian);
+
+// read single scalar of binary PLY
+double plyReadScalar(const uchar* src, PlyScalarType type, bool bigEndian);
+
+
+// locale independent decimal float parser, moves p past parsed token
+template <typename T>
+inline bool parseFloat(const char*& p, const char* end, T& value) {
+  static const double powersOf10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    ++p;
+  }
+
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    ++p;
+  }
+
+  // accumulate up to 19 significant digits, count the rest as exponent
+  quint64 mantissa = 0;
+  int exponent = 0;
+  int digits = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+    if (mantissa < 1000000000000000000ULL) {
+      mantissa = mantissa * 10 + (*p - '0');
+    } else {
+      ++exponent;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+      if (mantissa < 1000000000000000000ULL) {
+        mantissa = mantissa * 10 + (*p - '0');
+        --exponent;
+      }
+    }
+  }
+  if (digits == 0) {
+    return false;
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    bool negativeExponent = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+      negativeExponent = (*p == '-');
+      ++p;
+    }
+    int e = 0;
+    if (p == end || *p < '0' || *p > '9') {
+      return false;
+    }
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+      e = std::min(e * 10 + (*p - '0'), 1000);
+    }
+    exponent += negativeExponent ? -e : e;
+  }
+
+  // token must end with separator
+  if (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+    return false;
+  }
+
+  double v = static_cast<double>(mantissa);
+  if (exponent >= -22 && exponent <= 22) {
+    v = exponent < 0 ? v / powersOf10[-exponent] : v * powersOf10[exponent];
+  } else {
+    v *= std::pow(10.0, exponent);
+  }
+  value = static_cast<T>(negative ? -v : v);
+  return true;
+}
+
+
+// move p past next token without converting it, false if line has no more tokens
+inline bool skipToken(const char*& p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    ++p;
+  }
+  const char* token = p;
+  while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+    ++p;
+  }
+  return p != token;
+}
+
+
+inline const char* nextLine(const char* p, const char* end) {
+  const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+  return eol ? eol + 1 : end;
+}
@@ -0,0 +1,258 @@
+//
+// Synthetic PLY generator for loader benchmarks.
+//
+// Writes reproducible clouds of any size: planar (flat plane with little noise),
+// terrain (height field of few waves) or noise (uniform cube) distribution,
+// x, y, z as float or double, optionally with color and normal properties,
+// in ascii or binary format of either byte order:
+//
+//   plygen --points 10000000 --format binary --color --normals terrain.ply
+//
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFile>
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+
+namespace {
+
+// points generated and written at once
+const size_t BATCH_POINTS = 1 << 16;
+
+
+struct Options {
+  quint64 points;
+  QString format;        // ascii, binary, binary_big_endian
+  bool doubles;
+  bool color;
+  bool normals;
+  QString distribution;  // planar, terrain, noise
+  double scale;
+  double offset[3];
+  quint32 seed;
+};
+
+
+struct Point {
+  double position[3];
+  float normal[3];
+  uchar color[3];
+};
+
+
+float terrainHeight(double x, double y) {
+  return static_cast<float>(0.1 * std::sin(3 * x) * std::cos(2 * y) + 0.03 * std::sin(11 * x + 7 * y));
+}
+
+
+class Generator {
+public:
+  explicit Generator(const Options& options)
+    : _options(options),
+      _random(options.seed),
+      _unit(-1, 1),
+      _noise(0, 0.002)
+  {}
+
+  Point next() {
+    Point p;
+    const double x = _unit(_random);
+    const double y = _unit(_random);
+    double z;
+    if (_options.distribution == "planar") {
+      z = _noise(_random);
+      p.normal[0] = 0;
+      p.normal[1] = 0;
+      p.normal[2] = 1;
+    } else if (_options.distribution == "terrain") {
+      z = terrainHeight(x, y) + _noise(_random);
+      // normal of height field from its finite differences
+      const double d = 1e-3;
+      const double dx = (terrainHeight(x + d, y) - terrainHeight(x - d, y)) / (2 * d);
+      const double dy = (terrainHeight(x, y + d) - terrainHeight(x, y - d)) / (2 * d);
+      const double length = std::sqrt(dx * dx + dy * dy + 1);
+      p.normal[0] = static_cast<float>(-dx / length);
+      p.normal[1] = static_cast<float>(-dy / length);
+      p.normal[2] = static_cast<float>(1 / length);
+    } else {
+      z = _unit(_random);
+      double n[3] = {_unit(_random), _unit(_random), _unit(_random)};
+      const double length = std::max(std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]), 1e-9);
+      for (int axis = 0; axis < 3; ++axis) {
+        p.normal[axis] = static_cast<float>(n[axis] / length);
+      }
+    }
+
+    const double unit[3] = {x, y, z};
+    for (int axis = 0; axis < 3; ++axis) {
+      p.position[axis] = unit[axis] * _options.scale + _options.offset[axis];
+    }
+    // color ramp by height
+    const double t = std::max(0., std::min(1., (z + 1) / 2));
+    p.color[0] = static_cast<uchar>(255 * t);
+    p.color[1] = static_cast<uchar>(255 * (1 - std::abs(2 * t - 1)));
+    p.color[2] = static_cast<uchar>(255 * (1 - t));
+    return p;
+  }
+
+private:
+  const Options& _options;
+  std::mt19937_64 _random;
+  std::uniform_real_distribution<double> _unit;
+  std::normal_distribution<double> _noise;
+};
+
+
+QByteArray header(const Options& options) {
+  const char* type = options.doubles ? "double" : "float";
+  QByteArray h = "ply\n";
+  h += "format " + options.format.toLatin1() + " 1.0\n";
+  h += "comment generated by plygen, " + options.distribution.toLatin1() + " distribution\n";
+  h += "element vertex " + QByteArray::number(options.points) + "\n";
+  h += QByteArray("property ") + type + " x\n";
+  h += QByteArray("property ") + type + " y\n";
+  h += QByteArray("property ") + type + " z\n";
+  if (options.normals) {
+    h += "property float nx\nproperty float ny\nproperty float nz\n";
+  }
+  if (options.color) {
+    h += "property uchar red\nproperty uchar green\nproperty uchar blue\n";
+  }
+  h += "end_header\n";
+  return h;
+}
+
+
+template <typename T>
+void putScalar(std::vector<char>& out, T value, bool swap) {
+  char raw[sizeof(T)];
+  std::memcpy(raw, &value, sizeof(T));
+  if (swap) {
+    std::reverse(raw, raw + sizeof(T));
+  }
+  out.insert(out.end(), raw, raw + sizeof(T));
+}
+
+
+void appendPoint(std::vector<char>& out, const Point& p, const Options& options) {
+  if (options.format == "ascii") {
+    char line[256];
+    int n = std::snprintf(line, sizeof(line), options.doubles ? "%.17g %.17g %.17g" : "%.9g %.9g %.9g",
+                          p.position[0], p.position[1], p.position[2]);
+    if (options.normals) {
+      n += std::snprintf(line + n, sizeof(line) - n, " %.6g %.6g %.6g", p.normal[0], p.normal[1], p.normal[2]);
+    }
+    if (options.color) {
+      n += std::snprintf(line + n, sizeof(line) - n, " %d %d %d", p.color[0], p.color[1], p.color[2]);
+    }
+    line[n++] = '\n';
+    out.insert(out.end(), line, line + n);
+    return;
+  }
+
+  const bool swap = (options.format == "binary_big_endian") != (Q_BYTE_ORDER == Q_BIG_ENDIAN);
+  for (int axis = 0; axis < 3; ++axis) {
+    if (options.doubles) {
+      putScalar(out, p.position[axis], swap);
+    } else {
+      putScalar(out, static_cast<float>(p.position[axis]), swap);
+    }
+  }
+  if (options.normals) {
+    for (int axis = 0; axis < 3; ++axis) {
+      putScalar(out, p.normal[axis], swap);
+    }
+  }
+  if (options.color) {
+    out.insert(out.end(), p.color, p.color + 3);
+  }
+}
+
+
+void generate(const QString& path, const Options& options) {
+  QFile file(path);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    throw std::runtime_error("cannot create output file");
+  }
+  file.write(header(options));
+
+  Generator generator(options);
+  std::vector<char> batch;
+  for (quint64 written = 0; written < options.points; ) {
+    const quint64 count = std::min<quint64>(BATCH_POINTS, options.points - written);
+    batch.clear();
+    for (quint64 i = 0; i < count; ++i) {
+      appendPoint(batch, generator.next(), options);
+    }
+    if (file.write(batch.data(), batch.size()) != static_cast<qint64>(batch.size())) {
+      throw std::runtime_error("cannot write output file");
+    }
+    written += count;
+  }
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Generates synthetic PLY points cloud.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("output", "PLY file to write.");
+  QCommandLineOption pointsOption("points", "Points count.", "count", "1000000");
+  QCommandLineOption formatOption("format", "ascii, binary or binary_big_endian.", "format", "binary");
+  QCommandLineOption doubleOption("double", "Write x, y, z as double instead of float.");
+  QCommandLineOption colorOption("color", "Add red, green, blue properties.");
+  QCommandLineOption normalsOption("normals", "Add nx, ny, nz properties.");
+  QCommandLineOption distributionOption("distribution", "planar, terrain or noise.", "name", "terrain");
+  QCommandLineOption scaleOption("scale", "Half size of cloud.", "size", "1");
+  QCommandLineOption offsetOption("offset", "Center of cloud, georeferenced-like with large values.", "x,y,z", "0,0,0");
+  QCommandLineOption seedOption("seed", "Random seed, same seed gives same file.", "seed", "1");
+  parser.addOptions({pointsOption, formatOption, doubleOption, colorOption, normalsOption,
+                     distributionOption, scaleOption, offsetOption, seedOption});
+  parser.process(app);
+
+  Options options;
+  bool pointsOk = false;
+  options.points = parser.value(pointsOption).toULongLong(&pointsOk);
+  options.format = parser.value(formatOption);
+  if (options.format == "binary") {
+    options.format = "binary_little_endian";
+  }
+  options.doubles = parser.isSet(doubleOption);
+  options.color = parser.isSet(colorOption);
+  options.normals = parser.isSet(normalsOption);
+  options.distribution = parser.value(distributionOption);
+  options.scale = parser.value(scaleOption).toDouble();
+  options.seed = parser.value(seedOption).toUInt();
+  const QStringList offset = parser.value(offsetOption).split(',');
+  for (int axis = 0; axis < 3; ++axis) {
+    options.offset[axis] = offset.size() == 3 ? offset[axis].toDouble() : 0;
+  }
+
+  const QStringList formats = {"ascii", "binary_little_endian", "binary_big_endian"};
+  const QStringList distributions = {"planar", "terrain", "noise"};
+  if (parser.positionalArguments().size() != 1 || !pointsOk || offset.size() != 3 ||
+      !formats.contains(options.format) || !distributions.contains(options.distribution)) {
+    parser.showHelp(1);
+  }
+
+  try {
+    generate(parser.positionalArguments()[0], options);
+  } catch (const std::exception& e) {
+    std::cerr << "plygen: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,9 @@
+# synthetic PLY generator for loader benchmarks, see plygen.cpp
+TARGET = plygen
+
+SOURCES  = plygen.cpp
+
+QT -= gui
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
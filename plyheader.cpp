@@ -0,0 +1,198 @@
+#include "plyheader.h"
+#include "gzipreader.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+
+
+namespace {
+
+const struct {
+  const char* name;
+  PlyScalarType type;
+} SCALAR_NAMES[] = {
+  {"char", PLY_INT8}, {"int8", PLY_INT8}, {"uchar", PLY_UINT8}, {"uint8", PLY_UINT8},
+  {"short", PLY_INT16}, {"int16", PLY_INT16}, {"ushort", PLY_UINT16}, {"uint16", PLY_UINT16},
+  {"int", PLY_INT32}, {"int32", PLY_INT32}, {"uint", PLY_UINT32}, {"uint32", PLY_UINT32},
+  {"float", PLY_FLOAT32}, {"float32", PLY_FLOAT32}, {"double", PLY_FLOAT64}, {"float64", PLY_FLOAT64}
+};
+
+
+PlyScalarType scalarFromName(const std::string& name) {
+  for (const auto& t : SCALAR_NAMES) {
+    if (name == t.name) {
+      return t.type;
+    }
+  }
+  throw std::runtime_error("unknown ply property type");
+}
+
+
+
+// inflated header text of gzip compressed file is longer than that only when broken
+const size_t MAX_COMPRESSED_HEADER_SIZE = 1 << 20;
+const size_t COMPRESSED_HEADER_STEP = 1 << 12;
+
+
+std::string inflateHeader(const QString& plyFilePath) {
+  GzipReader reader(plyFilePath);
+  std::string text;
+  while (text.size() < MAX_COMPRESSED_HEADER_SIZE && !reader.atEnd()) {
+    const size_t size = text.size();
+    text.resize(size + COMPRESSED_HEADER_STEP);
+    text.resize(size + reader.read(&text[size], COMPRESSED_HEADER_STEP));
+    // whole end_header line is needed
+    const size_t end = text.find("\nend_header", size >= 11 ? size - 11 : 0);
+    if (end != std::string::npos && text.find('\n', end) != std::string::npos) {
+      break;
+    }
+  }
+  return text;
+}
+
+} // namespace
+
+
+size_t plyScalarSize(PlyScalarType type) {
+  static const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+  return sizes[type];
+}
+
+
+const char* plyScalarName(PlyScalarType type) {
+  static const char* names[] = {"char", "uchar", "short", "ushort", "int", "uint", "float", "double"};
+  return names[type];
+}
+
+
+size_t PlyElement::recordSize() const {
+  size_t size = 0;
+  for (const auto& prop : properties) {
+    if (prop.isList) {
+      return 0;
+    }
+    size += plyScalarSize(prop.type);
+  }
+  return size;
+}
+
+
+int PlyElement::propertyIndex(const std::string& propertyName) const {
+  for (size_t i = 0; i < properties.size(); ++i) {
+    if (properties[i].name == propertyName) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+
+size_t PlyElement::propertyOffset(int index) const {
+  size_t offset = 0;
+  for (int i = 0; i < index; ++i) {
+    offset += plyScalarSize(properties[i].type);
+  }
+  return offset;
+}
+
+
+bool PlyElement::hasLists() const {
+  for (const auto& prop : properties) {
+    if (prop.isList) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+PlyHeader PlyHeader::read(const QString& plyFilePath) {
+
+  // open stream, header of compressed file is inflated first
+  const bool compressed = GzipReader::isGzip(plyFilePath);
+  std::fstream file;
+  std::istringstream inflated;
+  if (compressed) {
+    inflated.str(inflateHeader(plyFilePath));
+  } else {
+    file.open(plyFilePath.toStdString().c_str(), std::fstream::in | std::fstream::binary);
+  }
+  std::istream& is = compressed ? static_cast<std::istream&>(inflated) : file;
+
+  // ensure format with magic header
+  std::string line;
+  std::getline(is, line);
+  if (line != "ply" && line != "ply\r") {
+    throw std::runtime_error("not a ply file");
+  }
+
+  // parse header collecting body format and elements layout
+  PlyHeader header;
+  header.format = PLY_ASCII;
+  header.compressed = compressed;
+  while (is.good()) {
+    std::getline(is, line);
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line == "end_header") {
+      break;
+    } else {
+      std::stringstream ss(line);
+      std::string tag1, tag2, tag3;
+      ss >> tag1 >> tag2 >> tag3;
+      if (tag1 == "format") {
+        if (tag2 == "ascii") {
+          header.format = PLY_ASCII;
+        } else if (tag2 == "binary_little_endian") {
+          header.format = PLY_BINARY_LITTLE_ENDIAN;
+        } else if (tag2 == "binary_big_endian") {
+          header.format = PLY_BINARY_BIG_ENDIAN;
+        } else {
+          throw std::runtime_error("unknown ply format");
+        }
+      } else if (tag1 == "element") {
+        PlyElement element;
+        element.name = tag2;
+        element.count = std::strtoull(tag3.c_str(), nullptr, 10);
+        header.elements.push_back(element);
+      } else if (tag1 == "property") {
+        if (header.elements.empty()) {
+          throw std::runtime_error("ply property out of element");
+        }
+        PlyProperty prop;
+        prop.isList = (tag2 == "list");
+        if (prop.isList) {
+          // property list <count type> <item type> <name>
+          std::string itemType, name;
+          ss >> itemType >> name;
+          prop.countType = scalarFromName(tag3);
+          prop.type = scalarFromName(itemType);
+          prop.name = name;
+        } else {
+          prop.type = scalarFromName(tag2);
+          prop.countType = PLY_UINT8;
+          prop.name = tag3;
+        }
+        header.elements.back().properties.push_back(prop);
+      }
+    }
+  }
+  if (!is.good()) {
+    throw std::runtime_error("broken ply file");
+  }
+  header.bodyOffset = is.tellg();
+  return header;
+}
+
+
+int PlyHeader::elementIndex(const std::string& name) const {
+  for (size_t i = 0; i < elements.size(); ++i) {
+    if (elements[i].name == name) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
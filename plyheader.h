@@ -0,0 +1,57 @@
+#pragma once
+
+#include <QString>
+
+#include <string>
+#include <vector>
+
+
+enum PlyFormat {PLY_ASCII, PLY_BINARY_LITTLE_ENDIAN, PLY_BINARY_BIG_ENDIAN};
+
+enum PlyScalarType {
+  PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16,
+  PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64
+};
+
+size_t plyScalarSize(PlyScalarType type);
+const char* plyScalarName(PlyScalarType type);
+
+
+struct PlyProperty {
+  std::string name;
+  PlyScalarType type;       // type of items for list property
+  bool isList;
+  PlyScalarType countType;  // type of items count, list property only
+};
+
+
+struct PlyElement {
+  std::string name;
+  size_t count;
+  std::vector<PlyProperty> properties;
+
+  // bytes of binary record, 0 if record has variable length lists
+  size_t recordSize() const;
+  // -1 if there's no such property
+  int propertyIndex(const std::string& name) const;
+  // bytes preceding property in binary record, valid until first list property
+  size_t propertyOffset(int index) const;
+  bool hasLists() const;
+};
+
+
+//
+// Schema of PLY file: body format and layout of every element.
+//
+struct PlyHeader {
+  PlyFormat format;
+  std::vector<PlyElement> elements;
+  size_t bodyOffset;  // bytes of header text
+  bool compressed;    // whole file is gzip stream, bodyOffset is offset of inflated body
+
+  // throws on files which aren't PLY or have malformed header
+  static PlyHeader read(const QString& plyFilePath);
+
+  // -1 if there's no such element
+  int elementIndex(const std::string& name) const;
+};
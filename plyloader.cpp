@@ -0,0 +1,625 @@
+#include "plyloader.h"
+
+#include <QThread>
+#include <QThreadPool>
+#include <QSemaphore>
+#include <QtConcurrent>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+#include "gzipreader.h"
+
+
+namespace {
+
+// points decoded by single binary worker, small enough to show up early
+const size_t BINARY_CHUNK_POINTS = 1 << 20;
+// bytes of ascii body parsed by single worker
+const size_t MIN_ASCII_CHUNK_SIZE = 1 << 20;
+const size_t MAX_ASCII_CHUNK_SIZE = 64 << 20;
+// inflated bytes of compressed body parsed by single worker, and pieces in flight per core
+const size_t STREAM_PIECE_SIZE = 4 << 20;
+const int STREAM_PIECES_PER_CORE = 2;
+// coordinates beyond that are shifted to origin near the cloud,
+// floats lose millimeters there already
+const float ORIGIN_SHIFT_DISTANCE = 1e4f;
+
+
+void updateBounds(const float* p, size_t count, QVector3D& boundMin, QVector3D& boundMax) {
+  for (size_t i = 0; i < count; ++i, p += POINT_STRIDE) {
+    boundMax[0] = std::max(p[0], boundMax[0]);
+    boundMax[1] = std::max(p[1], boundMax[1]);
+    boundMax[2] = std::max(p[2], boundMax[2]);
+    boundMin[0] = std::min(p[0], boundMin[0]);
+    boundMin[1] = std::min(p[1], boundMin[1]);
+    boundMin[2] = std::min(p[2], boundMin[2]);
+  }
+}
+
+
+//
+// Vertex records of gzip compressed body, inflated piece by piece.
+//
+// Every piece ends at record boundary, incomplete record at its end starts next piece.
+// Pieces are shared, so they may be parsed while next ones are inflated.
+//
+class RecordStream
+{
+public:
+  typedef std::shared_ptr<const std::vector<char> > Piece;
+
+  // throws if body can't be reached
+  RecordStream(const QString& plyFilePath, const PlyHeader& header, size_t stride, size_t vertexOffset, size_t skipRows)
+    : _reader(plyFilePath),
+      _ascii(header.format == PLY_ASCII),
+      _stride(stride),
+      _piece(std::make_shared<std::vector<char> >()),
+      _offset(0)
+  {
+    if (!_reader.skip(header.bodyOffset + (_ascii ? 0 : vertexOffset))) {
+      throw std::runtime_error("broken ply file");
+    }
+    // lines of ascii elements preceding vertices are read through
+    const char* begin;
+    const char* end;
+    for (size_t rows = 0; _ascii && skipRows > 0; skipRows -= rows) {
+      next(skipRows, begin, end, rows);
+      if (rows == 0) {
+        throw std::runtime_error("broken ply file");
+      }
+    }
+  }
+
+  // up to maxRows whole records which follow, no rows at end of body
+  Piece next(size_t maxRows, const char*& begin, const char*& end, size_t& rows) {
+    for (;;) {
+      const char* p = _piece->data() + _offset;
+      const char* pieceEnd = _piece->data() + _piece->size();
+      // last line of body may go without newline
+      const char* complete = pieceEnd;
+      if (_ascii && !_reader.atEnd()) {
+        while (complete > p && complete[-1] != '\n') {
+          --complete;
+        }
+      }
+
+      begin = p;
+      rows = 0;
+      if (_ascii) {
+        while (p < complete && rows < maxRows) {
+          p = nextLine(p, complete);
+          ++rows;
+        }
+      } else {
+        rows = std::min(maxRows, static_cast<size_t>(complete - p) / _stride);
+        p += rows * _stride;
+      }
+      if (rows > 0 || _reader.atEnd()) {
+        end = p;
+        _offset = p - _piece->data();
+        return _piece;
+      }
+
+      // rest of current piece starts next one
+      auto piece = std::make_shared<std::vector<char> >(begin, pieceEnd);
+      const size_t rest = piece->size();
+      piece->resize(rest + std::max(STREAM_PIECE_SIZE, _stride));
+      piece->resize(rest + _reader.read(piece->data() + rest, piece->size() - rest));
+      _piece = piece;
+      _offset = 0;
+    }
+  }
+
+private:
+  GzipReader _reader;
+  bool _ascii;
+  size_t _stride;
+  Piece _piece;
+  size_t _offset;
+};
+
+} // namespace
+
+
+PlyLoader::PlyLoader(const QString& plyFilePath, bool useCache, QObject* parent)
+  : QObject(parent),
+    _vertexOffset(0),
+    _skipRows(0),
+    _binaryDecoder(nullptr),
+    _asciiDecoder(nullptr),
+    _filePath(plyFilePath),
+    _body(nullptr),
+    _bodyEnd(nullptr),
+    _pointsCount(0),
+    _canceled(0),
+    _streamBroken(0),
+    _finished(false),
+    _boundsNsecs(0)
+{
+  _timings.header = _timings.parse = _timings.bounds = _timings.upload = _timings.downsample = 0;
+  _timings.cacheHit = false;
+
+  QElapsedTimer headerTimer;
+  headerTimer.start();
+  _header = PlyHeader::read(plyFilePath);
+
+  std::fill(_layout.origin, _layout.origin + 3, 0.);
+
+  // locate 'element vertex' section
+  const int vertexIndex = _header.elementIndex("vertex");
+  if (vertexIndex >= 0) {
+    _pointsCount = _header.elements[vertexIndex].count;
+  }
+  if (_pointsCount > 0) {
+    _layout = PlyVertexLayout::fromElement(_header.format, _header.elements[vertexIndex]);
+    _binaryDecoder = selectBinaryDecoder(_layout);
+    _asciiDecoder = selectAsciiDecoder(_layout);
+    if (useCache && _cache.open(plyFilePath) && _cache.pointsCount() == _pointsCount && !_cache.chunks().empty()) {
+      std::copy(_cache.origin(), _cache.origin() + 3, _layout.origin);
+    } else {
+      _cache.close();
+      if (_header.compressed) {
+        _openStream();
+      } else {
+        _mapBody(plyFilePath);
+      }
+      _chooseOrigin();
+    }
+  }
+  _timings.header = headerTimer.elapsed();
+
+  connect(&_countWatcher, &QFutureWatcher<void>::finished, this, &PlyLoader::_onRowsCounted);
+  connect(&_parseWatcher, &QFutureWatcher<void>::finished, this, &PlyLoader::_onVerticesParsed);
+}
+
+
+PlyLoader::~PlyLoader()
+{
+  cancel();
+}
+
+
+void PlyLoader::_mapBody(const QString& plyFilePath) {
+  // map file body instead of reading it through a stream,
+  // the kernel pages it in as workers walk over records
+  _file.setFileName(plyFilePath);
+  if (!_file.open(QIODevice::ReadOnly)) {
+    throw std::runtime_error("cannot open ply file");
+  }
+
+  // count what precedes vertices, fixed size binary records are just skipped over
+  _vertexOffset = 0;
+  _skipRows = 0;
+  bool fixedOffset = true;
+  for (const auto& element : _header.elements) {
+    if (&element == _layout.element) {
+      break;
+    }
+    _vertexOffset += element.recordSize() * element.count;
+    _skipRows += element.count;
+    fixedOffset &= (element.count == 0 || !element.hasLists());
+  }
+
+  qint64 bodySize = _file.size() - static_cast<qint64>(_header.bodyOffset);
+  if (_header.format != PLY_ASCII && fixedOffset && _layout.stride > 0) {
+    const qint64 vertexSize = static_cast<qint64>(_layout.stride * _pointsCount);
+    if (bodySize < static_cast<qint64>(_vertexOffset) + vertexSize) {
+      throw std::runtime_error("broken ply file");
+    }
+    bodySize = _vertexOffset + vertexSize;
+  }
+  if (bodySize <= 0) {
+    throw std::runtime_error("broken ply file");
+  }
+
+  _body = reinterpret_cast<const char*>(_file.map(_header.bodyOffset, bodySize));
+  if (!_body) {
+    throw std::runtime_error("cannot map ply file");
+  }
+  _bodyEnd = _body + bodySize;
+
+  if (_header.format != PLY_ASCII && !fixedOffset) {
+    // walk records of preceding elements
+    const bool bigEndian = (_header.format == PLY_BINARY_BIG_ENDIAN);
+    const uchar* record = reinterpret_cast<const uchar*>(_body);
+    const uchar* end = reinterpret_cast<const uchar*>(_bodyEnd);
+    for (const auto& element : _header.elements) {
+      if (&element == _layout.element) {
+        break;
+      }
+      for (size_t i = 0; i < element.count && record; ++i) {
+        record = skipBinaryRecord(record, end, element, bigEndian);
+      }
+    }
+    if (!record) {
+      throw std::runtime_error("broken ply file");
+    }
+    _vertexOffset = record - reinterpret_cast<const uchar*>(_body);
+  }
+}
+
+
+void PlyLoader::_openStream() {
+  // compressed body is inflated piece by piece instead of mapped, so whatever precedes
+  // vertices has to be skipped without looking at it
+  _vertexOffset = 0;
+  _skipRows = 0;
+  for (const auto& element : _header.elements) {
+    if (&element == _layout.element) {
+      break;
+    }
+    if (_header.format != PLY_ASCII && element.count > 0 && element.hasLists()) {
+      throw std::runtime_error("compressed binary ply file with lists before vertices is not supported");
+    }
+    _vertexOffset += element.recordSize() * element.count;
+    _skipRows += element.count;
+  }
+  if (_header.format != PLY_ASCII && _layout.stride == 0) {
+    throw std::runtime_error("compressed binary ply file with vertex lists is not supported");
+  }
+}
+
+
+void PlyLoader::_chooseOrigin() {
+  // first vertex tells where cloud is, whole meters keep origin readable
+  float first[POINT_STRIDE] = {0, 0, 0, 0};
+  scan(1, [&first](const float* points, size_t, size_t) {
+    std::copy(points, points + POINT_STRIDE, first);
+    return false;
+  });
+  bool shifted = false;
+  for (int axis = 0; axis < 3; ++axis) {
+    if (std::isfinite(first[axis]) && std::abs(first[axis]) >= ORIGIN_SHIFT_DISTANCE) {
+      _layout.origin[axis] = std::floor(first[axis]);
+      shifted = true;
+    }
+  }
+  if (shifted) {
+    _binaryDecoder = selectBinaryDecoder(_layout);
+  }
+}
+
+
+void PlyLoader::start() {
+  _parseTimer.start();
+  if (_pointsCount == 0) {
+    _finished = true;
+    emit finished();
+    return;
+  }
+
+  if (_cache.isOpen()) {
+    _startFromCache();
+    return;
+  }
+
+  _points.allocate(_pointsCount);
+
+  if (_header.compressed) {
+    _parseWatcher.setFuture(QtConcurrent::run([this]() {_streamBody();}));
+  } else if (_header.format == PLY_ASCII) {
+    // row of every ascii chunk is known only after rows are counted
+    _splitAsciiBody();
+    _countWatcher.setFuture(QtConcurrent::map(_chunks, [this](Chunk& chunk) {_countAsciiRows(chunk);}));
+  } else {
+    _splitBinaryBody();
+    _parseWatcher.setFuture(QtConcurrent::map(_chunks, [this](Chunk& chunk) {_parseChunk(chunk);}));
+  }
+}
+
+
+void PlyLoader::_startFromCache() {
+  // points are used in place, chunks of index stand for decoded pieces
+  _points.attach(_cache.points(), _pointsCount);
+  for (const auto& chunk : _cache.chunks()) {
+    emit pointsLoaded(chunk.first, chunk.count, QVector3D(chunk.min[0], chunk.min[1], chunk.min[2]),
+                      QVector3D(chunk.max[0], chunk.max[1], chunk.max[2]));
+  }
+  _timings.parse = _parseTimer.elapsed();
+  _finished = true;
+  emit finished();
+}
+
+
+bool PlyLoader::scan(size_t batchPoints, const BatchConsumer& consumer) const {
+  if (_header.compressed && _pointsCount > 0) {
+    return _scanStream(batchPoints, consumer);
+  }
+  if (_pointsCount > 0 && !_body) {
+    return false;
+  }
+
+  std::vector<float> batch(std::min(batchPoints, _pointsCount) * POINT_STRIDE);
+  const char* p = _body;
+  if (_header.format == PLY_ASCII) {
+    for (size_t i = 0; i < _skipRows && p < _bodyEnd; ++i) {
+      p = nextLine(p, _bodyEnd);
+    }
+  } else {
+    p += _vertexOffset;
+  }
+
+  for (size_t row = 0; row < _pointsCount; row += batchPoints) {
+    const size_t rows = std::min(batchPoints, _pointsCount - row);
+    if (_header.format == PLY_ASCII) {
+      if (!_asciiDecoder(p, _bodyEnd, row, rows, _layout, batch.data())) {
+        return false;
+      }
+    } else {
+      const uchar* end = reinterpret_cast<const uchar*>(_bodyEnd);
+      const uchar* record = _binaryDecoder(reinterpret_cast<const uchar*>(p), end, row, rows, _layout, batch.data());
+      if (!record || record > end) {
+        return false;
+      }
+      p = reinterpret_cast<const char*>(record);
+    }
+    if (!consumer(batch.data(), row, rows)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool PlyLoader::_scanStream(size_t batchPoints, const BatchConsumer& consumer) const {
+  std::vector<float> batch(std::min(batchPoints, _pointsCount) * POINT_STRIDE);
+  try {
+    RecordStream stream(_filePath, _header, _layout.stride, _vertexOffset, _skipRows);
+    for (size_t row = 0; row < _pointsCount; ) {
+      const char* begin;
+      const char* end;
+      size_t rows;
+      const auto piece = stream.next(std::min(batchPoints, _pointsCount - row), begin, end, rows);
+      if (rows == 0) {
+        return false;
+      }
+      if (_header.format == PLY_ASCII) {
+        if (!_asciiDecoder(begin, end, row, rows, _layout, batch.data())) {
+          return false;
+        }
+      } else if (!_binaryDecoder(reinterpret_cast<const uchar*>(begin), reinterpret_cast<const uchar*>(end),
+                                 row, rows, _layout, batch.data())) {
+        return false;
+      }
+      if (!consumer(batch.data(), row, rows)) {
+        return false;
+      }
+      row += rows;
+    }
+  } catch (const std::exception&) {
+    return false;
+  }
+  return true;
+}
+
+
+void PlyLoader::setOrigin(const double* origin) {
+  if (!_cache.isOpen()) {
+    std::copy(origin, origin + 3, _layout.origin);
+  }
+}
+
+
+void PlyLoader::cancel() {
+  _canceled.store(1);
+  _countWatcher.cancel();
+  _parseWatcher.cancel();
+  _countWatcher.waitForFinished();
+  _parseWatcher.waitForFinished();
+  _release();
+}
+
+
+void PlyLoader::_release() {
+  if (_body) {
+    _file.unmap(reinterpret_cast<uchar*>(const_cast<char*>(_body)));
+    _body = _bodyEnd = nullptr;
+  }
+  _file.close();
+}
+
+
+LoadTimings PlyLoader::timings() const {
+  LoadTimings t = _timings;
+  t.bounds = _boundsNsecs.load() / 1000000;
+  t.cacheHit = _cache.isOpen();
+  return t;
+}
+
+
+void PlyLoader::_splitAsciiBody() {
+  const char* begin = _body;
+  const char* end = _bodyEnd;
+
+  // step over lines of elements preceding vertices
+  for (size_t i = 0; i < _skipRows && begin < end; ++i) {
+    begin = nextLine(begin, end);
+  }
+
+  // split body into newline aligned chunks, few per core to balance load
+  const size_t bodySize = end - begin;
+  const size_t chunksCount = std::max<size_t>(
+        std::min<size_t>(QThread::idealThreadCount() * 4, bodySize / MIN_ASCII_CHUNK_SIZE),
+        bodySize / MAX_ASCII_CHUNK_SIZE);
+  const size_t chunkSize = bodySize / std::max<size_t>(chunksCount, 1) + 1;
+  for (const char* p = begin; p < end; ) {
+    const char* chunkEnd = nextLine(std::min(p + chunkSize, end) - 1, end);
+
+    Chunk chunk;
+    chunk.begin = p;
+    chunk.end = chunkEnd;
+    chunk.firstRow = 0;
+    chunk.rows = 0;
+    chunk.broken = false;
+    _chunks << chunk;
+    p = chunkEnd;
+  }
+}
+
+
+void PlyLoader::_splitBinaryBody() {
+  const char* vertices = _body + _vertexOffset;
+  if (_layout.stride == 0) {
+    // records of variable length are walked by single worker
+    Chunk chunk;
+    chunk.firstRow = 0;
+    chunk.rows = _pointsCount;
+    chunk.begin = vertices;
+    chunk.end = _bodyEnd;
+    chunk.broken = false;
+    _chunks << chunk;
+    return;
+  }
+
+  for (size_t row = 0; row < _pointsCount; row += BINARY_CHUNK_POINTS) {
+    Chunk chunk;
+    chunk.firstRow = row;
+    chunk.rows = std::min(BINARY_CHUNK_POINTS, _pointsCount - row);
+    chunk.begin = vertices + row * _layout.stride;
+    chunk.end = chunk.begin + chunk.rows * _layout.stride;
+    chunk.broken = false;
+    _chunks << chunk;
+  }
+}
+
+
+void PlyLoader::_streamBody() {
+  // this task mostly inflates, pieces are parsed by other workers meanwhile;
+  // pool gets its thread back, and pieces in flight bound memory taken by inflated data
+  QThreadPool::globalInstance()->releaseThread();
+  const int piecesLimit = QThread::idealThreadCount() * STREAM_PIECES_PER_CORE;
+  QSemaphore pieces(piecesLimit);
+  size_t row = 0;
+  try {
+    RecordStream stream(_filePath, _header, _layout.stride, _vertexOffset, _skipRows);
+    while (row < _pointsCount && !_canceled.load() && !_streamBroken.load()) {
+      Chunk chunk;
+      size_t rows;
+      const auto piece = stream.next(_pointsCount - row, chunk.begin, chunk.end, rows);
+      if (rows == 0) {
+        break;
+      }
+      chunk.firstRow = row;
+      chunk.rows = rows;
+      chunk.broken = false;
+      row += rows;
+
+      // piece is kept alive by the task parsing it
+      pieces.acquire();
+      QtConcurrent::run([this, piece, chunk, &pieces]() {
+        Chunk parsed = chunk;
+        _parseChunk(parsed);
+        if (parsed.broken) {
+          _streamBroken.store(1);
+        }
+        pieces.release();
+      });
+    }
+  } catch (const std::exception&) {
+    _streamBroken.store(1);
+  }
+  pieces.acquire(piecesLimit);
+  QThreadPool::globalInstance()->reserveThread();
+
+  // check if we've got exact number of points mentioned in header
+  if (row < _pointsCount) {
+    _streamBroken.store(1);
+  }
+}
+
+
+void PlyLoader::_countAsciiRows(Chunk& chunk) {
+  chunk.rows = 0;
+  for (const char* p = chunk.begin; p < chunk.end && !_canceled.load(); p = nextLine(p, chunk.end)) {
+    ++chunk.rows;
+  }
+}
+
+
+void PlyLoader::_onRowsCounted() {
+  if (_canceled.load()) {
+    return;
+  }
+
+  size_t rows = 0;
+  for (auto& chunk : _chunks) {
+    chunk.firstRow = rows;
+    rows += chunk.rows;
+  }
+  // check if we've got exact number of points mentioned in header
+  if (rows < _pointsCount) {
+    _release();
+    emit failed(tr("broken ply file"));
+    return;
+  }
+  _parseWatcher.setFuture(QtConcurrent::map(_chunks, [this](Chunk& chunk) {_parseChunk(chunk);}));
+}
+
+
+void PlyLoader::_parseChunk(Chunk& chunk) {
+  if (_canceled.load() || chunk.firstRow >= _pointsCount) {
+    return;
+  }
+
+  // decoders write contiguous points, so chunk is decoded block by block
+  if (_header.format == PLY_ASCII) {
+    chunk.rows = std::min(chunk.rows, _pointsCount - chunk.firstRow);
+    const char* p = chunk.begin;
+    chunk.broken = !_points.forEachRun(chunk.firstRow, chunk.rows, [&](float* out, size_t first, size_t rows) {
+      return _asciiDecoder(p, chunk.end, first, rows, _layout, out);
+    });
+  } else {
+    const uchar* record = reinterpret_cast<const uchar*>(chunk.begin);
+    const uchar* end = reinterpret_cast<const uchar*>(chunk.end);
+    chunk.broken = !_points.forEachRun(chunk.firstRow, chunk.rows, [&](float* out, size_t first, size_t rows) {
+      record = _binaryDecoder(record, end, first, rows, _layout, out);
+      return record != nullptr;
+    });
+  }
+
+  if (!chunk.broken) {
+    _announce(chunk);
+  }
+}
+
+
+void PlyLoader::_announce(const Chunk& chunk) {
+  QElapsedTimer boundsTimer;
+  boundsTimer.start();
+  // bounds grow from empty box, points may be anywhere relative to zero
+  QVector3D boundMin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                     std::numeric_limits<float>::max());
+  QVector3D boundMax = -boundMin;
+  _points.forEachRun(chunk.firstRow, chunk.rows, [&](const float* points, size_t, size_t rows) {
+    updateBounds(points, rows, boundMin, boundMax);
+    return true;
+  });
+  _boundsNsecs.fetchAndAddRelaxed(boundsTimer.nsecsElapsed());
+
+  emit pointsLoaded(chunk.firstRow, chunk.rows, boundMin, boundMax);
+}
+
+
+void PlyLoader::_onVerticesParsed() {
+  if (_canceled.load()) {
+    return;
+  }
+  _timings.parse = _parseTimer.elapsed();
+  _release();
+
+  bool broken = _streamBroken.load() != 0;
+  for (const auto& chunk : _chunks) {
+    broken |= chunk.broken;
+  }
+  if (broken) {
+    emit failed(tr("broken ply file"));
+    return;
+  }
+  _finished = true;
+  emit finished();
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <QObject>
+#include <QVector>
+#include <QVector3D>
+#include <QFile>
+#include <QFutureWatcher>
+#include <QElapsedTimer>
+#include <QAtomicInteger>
+
+#include <functional>
+
+#include "plyheader.h"
+#include "plydecoders.h"
+#include "pointstorage.h"
+#include "pointcache.h"
+
+// milliseconds spent in each loading stage
+struct LoadTimings {
+  qint64 header;
+  qint64 parse;   // wall time of vertex section decoding
+  qint64 bounds;  // summed over workers
+  qint64 upload;  // filled by scene when data reaches vertex buffer
+  qint64 downsample;  // voxel grid before upload, filled by scene
+  bool cacheHit;  // points were mapped from sidecar cache instead of parsed
+};
+
+
+//
+// Loads 'element vertex' section of PLY file in background.
+//
+// Header is parsed in constructor, so wrong files fail early with exception.
+// Vertex section is decoded by pool of workers after start(), every decoded
+// piece is announced with pointsLoaded() and may be used right away.
+// With cache allowed, valid sidecar cache (pointcache.h) is mapped instead,
+// its points come in tree order and are announced by chunks of the tree.
+// Gzip compressed files are inflated by one worker while others parse what's
+// inflated so far, piece by piece, without inflating whole body up front.
+//
+class PlyLoader : public QObject
+{
+  Q_OBJECT
+
+public:
+  PlyLoader(const QString& plyFilePath, bool useCache = false, QObject* parent = 0);
+  ~PlyLoader();
+
+  void start();
+  void cancel();
+
+  size_t pointsCount() const {return _pointsCount;}
+  const PointStorage& points() const {return _points;}
+  PointStorage& points() {return _points;}
+  bool isFinished() const {return _finished;}
+  const QString& filePath() const {return _filePath;}
+  // open cache if points come from it
+  bool isCacheHit() const {return _cache.isOpen();}
+  const PointCache& cache() const {return _cache;}
+  // points are stored relative to this origin, it's zero unless coordinates are far from it
+  const double* origin() const {return _layout.origin;}
+  // store points relative to given origin instead, so clouds of several files line up;
+  // call before start() or scan(), cached points keep own origin
+  void setOrigin(const double* origin);
+  LoadTimings timings() const;
+
+  // decode vertices batch by batch on calling thread without keeping them,
+  // for passes over files which don't fit into memory; consumer gets
+  // points, first row and points count and returns false to stop.
+  // Returns false for broken file or stopped scan.
+  typedef std::function<bool(const float*, size_t, size_t)> BatchConsumer;
+  bool scan(size_t batchPoints, const BatchConsumer& consumer) const;
+
+
+signals:
+  // points [first, first + count) are ready, bounds cover just these points
+  void pointsLoaded(qulonglong first, qulonglong count, const QVector3D& boundMin, const QVector3D& boundMax);
+  void finished();
+  void failed(const QString& error);
+
+
+private slots:
+  void _onRowsCounted();
+  void _onVerticesParsed();
+
+
+private:
+  // piece of vertex section decoded by single worker
+  struct Chunk {
+    const char* begin;
+    const char* end;
+    size_t firstRow;
+    size_t rows;
+    bool broken;
+  };
+
+  void _mapBody(const QString& plyFilePath);
+  void _openStream();
+  void _chooseOrigin();
+  void _startFromCache();
+  void _splitAsciiBody();
+  void _splitBinaryBody();
+  void _streamBody();
+  bool _scanStream(size_t batchPoints, const BatchConsumer& consumer) const;
+  void _countAsciiRows(Chunk& chunk);
+  void _parseChunk(Chunk& chunk);
+  void _announce(const Chunk& chunk);
+  void _release();
+
+  PlyHeader _header;
+  size_t _vertexOffset;  // bytes of binary elements preceding vertices
+  size_t _skipRows;      // lines of ascii elements preceding vertices
+
+  // decoders specialized for vertex record layout
+  PlyVertexLayout _layout;
+  PlyBinaryDecoder _binaryDecoder;
+  PlyAsciiDecoder _asciiDecoder;
+
+  QString _filePath;
+  PointCache _cache;
+  QFile _file;
+  const char* _body;
+  const char* _bodyEnd;
+
+  size_t _pointsCount;
+  PointStorage _points;  // workers write disjoint rows of allocated blocks
+
+  QVector<Chunk> _chunks;
+  QFutureWatcher<void> _countWatcher;
+  QFutureWatcher<void> _parseWatcher;
+  QAtomicInt _canceled;
+  QAtomicInt _streamBroken;  // piece of compressed body failed to inflate or parse
+  bool _finished;
+
+  QElapsedTimer _parseTimer;
+  LoadTimings _timings;
+  QAtomicInteger<qint64> _boundsNsecs;
+};
@@ -0,0 +1,360 @@
+#include "plywriter.h"
+#include "plydecoders.h"
+
+#include <QByteArray>
+#include <QFile>
+#include <QSaveFile>
+#include <QThread>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+
+namespace {
+
+// points encoded by single task
+const size_t BATCH_POINTS = 1 << 16;
+// batches encoded per thread while previous ones are written
+const int WINDOW_BATCHES_PER_THREAD = 2;
+// rows of points are floats, exact below that
+const double EXACT_ROWS = 1 << 24;
+const size_t NO_ROW = std::numeric_limits<size_t>::max();
+
+const bool HOST_BIG_ENDIAN = Q_BYTE_ORDER == Q_BIG_ENDIAN;
+
+
+// copy scalar into little endian output, reversing its bytes when they're the other way
+inline char* putScalar(char* out, const void* value, size_t size, bool reversed) {
+  if (reversed) {
+    std::reverse_copy(static_cast<const char*>(value), static_cast<const char*>(value) + size, out);
+  } else {
+    std::memcpy(out, value, size);
+  }
+  return out + size;
+}
+
+
+template <typename T>
+inline char* putPoint(char* out, const float* point, const double* origin) {
+  for (int axis = 0; axis < 3; ++axis) {
+    const T value = static_cast<T>(origin[axis] + point[axis]);
+    out = putScalar(out, &value, sizeof(T), HOST_BIG_ENDIAN);
+  }
+  return out;
+}
+
+} // namespace
+
+
+struct PlyWriter::Batch {
+  int part;
+  size_t first;
+  size_t count;
+  quint64 kept;  // points inside region
+  std::vector<char> bytes;
+  bool broken;   // point has no record in its source
+};
+
+
+PlyWriter::PlyWriter(const double* origin)
+{
+  std::copy(origin, origin + 3, _origin);
+  // float relative coordinates keep their precision only near zero
+  _doubles = origin[0] != 0 || origin[1] != 0 || origin[2] != 0;
+}
+
+
+PlyWriter::~PlyWriter()
+{
+}
+
+
+void PlyWriter::addPoints(const PointStorage& points, const QString& sourcePlyPath, size_t firstRow)
+{
+  Part part;
+  part.points = &points;
+  part.sourcePath = sourcePlyPath;
+  part.firstRow = firstRow;
+  part.source = -1;
+  _parts.push_back(part);
+}
+
+
+void PlyWriter::_openSources()
+{
+  // all sources or none, so every written vertex has the same properties
+  _sources.clear();
+  for (auto& part : _parts) {
+    part.source = -1;
+  }
+  std::vector<Source> sources;
+  for (const auto& part : _parts) {
+    if (part.sourcePath.isEmpty()) {
+      return;
+    }
+    PlyHeader header;
+    try {
+      header = PlyHeader::read(part.sourcePath);
+    } catch (const std::exception&) {
+      return;
+    }
+    const int vertex = header.elementIndex("vertex");
+    if (header.format == PLY_ASCII || header.compressed || vertex < 0) {
+      return;
+    }
+    // records of elements preceding vertices are skipped by their size
+    qint64 offset = header.bodyOffset;
+    for (int e = 0; e < vertex; ++e) {
+      const size_t recordSize = header.elements[e].recordSize();
+      if (recordSize == 0) {
+        return;
+      }
+      offset += recordSize * header.elements[e].count;
+    }
+
+    const PlyElement& element = header.elements[vertex];
+    Source source;
+    source.filePath = part.sourcePath;
+    source.recordSize = element.recordSize();
+    source.count = element.count;
+    source.bigEndian = header.format == PLY_BINARY_BIG_ENDIAN;
+    if (source.recordSize == 0 || element.propertyIndex("x") < 0 || element.propertyIndex("y") < 0 ||
+        element.propertyIndex("z") < 0) {
+      return;
+    }
+    for (int index = 0; index < static_cast<int>(element.properties.size()); ++index) {
+      const PlyProperty& property = element.properties[index];
+      const int axis = property.name == "x" ? 0 : property.name == "y" ? 1 : property.name == "z" ? 2 : -1;
+      if (axis >= 0) {
+        source.xyzTypes[axis] = property.type;
+        source.xyzOffsets[axis] = element.propertyOffset(index);
+      } else {
+        source.properties.push_back(property);
+        source.offsets.push_back(element.propertyOffset(index));
+      }
+    }
+    if (!sources.empty()) {
+      const std::vector<PlyProperty>& properties = sources.front().properties;
+      if (properties.size() != source.properties.size() ||
+          !std::equal(properties.begin(), properties.end(), source.properties.begin(),
+                      [](const PlyProperty& a, const PlyProperty& b) {return a.name == b.name && a.type == b.type;})) {
+        return;
+      }
+    }
+
+    // records are read in place, pages of ones not written are never touched
+    const qint64 bytes = static_cast<qint64>(source.recordSize * source.count);
+    source.file.reset(new QFile(part.sourcePath));
+    if (!source.file->open(QIODevice::ReadOnly) || source.file->size() < offset + bytes) {
+      return;
+    }
+    source.records = bytes > 0 ? source.file->map(offset, bytes) : nullptr;
+    if (bytes > 0 && !source.records) {
+      return;
+    }
+    sources.push_back(std::move(source));
+  }
+
+  _sources.swap(sources);
+  for (size_t i = 0; i < _parts.size(); ++i) {
+    _parts[i].source = static_cast<int>(i);
+  }
+}
+
+
+bool PlyWriter::_inside(const float* p) const
+{
+  // same test as scalar one of PointSelection, so export has selected points
+  for (const auto& plane : _planes) {
+    if (!(plane.x() * p[0] + plane.y() * p[1] + plane.z() * p[2] + plane.w() >= 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+size_t PlyWriter::_sourceRow(const Source& source, const float* p, size_t firstRow) const
+{
+  // row lane is exact below 2^24, beyond that all records rounding to the same float
+  // are candidates told apart by coordinates as loader stored them; centroids of voxel
+  // grid match none exactly, so nearest one is taken
+  const double row = p[3];
+  const double halfSpacing = row >= EXACT_ROWS ? std::ldexp(1., std::ilogb(p[3]) - 24) : 0;
+  const double low = std::max(std::ceil(row - halfSpacing) - firstRow, 0.);
+  const double high = std::min(std::floor(row + halfSpacing) - firstRow, source.count - 1.);
+  if (!(low <= high)) {
+    return NO_ROW;
+  }
+  if (low == high) {
+    return static_cast<size_t>(low);
+  }
+
+  size_t nearest = NO_ROW;
+  double nearestDistance = std::numeric_limits<double>::infinity();
+  for (size_t candidate = static_cast<size_t>(low); candidate <= static_cast<size_t>(high); ++candidate) {
+    const uchar* record = source.records + candidate * source.recordSize;
+    double distance = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      const double value = plyReadScalar(record + source.xyzOffsets[axis], source.xyzTypes[axis], source.bigEndian);
+      const double difference = static_cast<float>(value - _origin[axis]) - p[axis];
+      distance += difference * difference;
+    }
+    if (distance < nearestDistance) {
+      nearest = candidate;
+      nearestDistance = distance;
+      if (distance == 0) {
+        break;
+      }
+    }
+  }
+  return nearest;
+}
+
+
+QByteArray PlyWriter::_header(quint64 count) const
+{
+  const char* type = _doubles ? "double" : "float";
+  QByteArray h = "ply\n";
+  h += "format binary_little_endian 1.0\n";
+  if (!_comment.isEmpty()) {
+    h += "comment " + _comment.toUtf8() + "\n";
+  }
+  h += "element vertex " + QByteArray::number(count) + "\n";
+  h += QByteArray("property ") + type + " x\n";
+  h += QByteArray("property ") + type + " y\n";
+  h += QByteArray("property ") + type + " z\n";
+  if (!_sources.empty()) {
+    for (const auto& property : _sources.front().properties) {
+      h += QByteArray("property ") + plyScalarName(property.type) + " " + property.name.c_str() + "\n";
+    }
+  }
+  h += "end_header\n";
+  return h;
+}
+
+
+void PlyWriter::_encode(Batch& batch) const
+{
+  const Part& part = _parts[batch.part];
+  const Source* source = part.source >= 0 ? &_sources[part.source] : nullptr;
+  size_t recordSize = 3 * (_doubles ? sizeof(double) : sizeof(float));
+  if (source) {
+    for (const auto& property : source->properties) {
+      recordSize += plyScalarSize(property.type);
+    }
+  }
+  batch.bytes.resize(batch.kept * recordSize);
+  char* out = batch.bytes.data();
+  char* const end = out + batch.bytes.size();
+
+  part.points->forEachRun(batch.first, batch.count, [&](const float* run, size_t, size_t count) {
+    for (size_t i = 0; i < count; ++i, run += POINT_STRIDE) {
+      if (!_inside(run)) {
+        continue;
+      }
+      if (out == end) {
+        batch.broken = true;
+        return false;
+      }
+      out = _doubles ? putPoint<double>(out, run, _origin) : putPoint<float>(out, run, _origin);
+      if (!source) {
+        continue;
+      }
+      const size_t row = _sourceRow(*source, run, part.firstRow);
+      if (row == NO_ROW) {
+        batch.broken = true;
+        return false;
+      }
+      const uchar* record = source->records + row * source->recordSize;
+      for (size_t k = 0; k < source->properties.size(); ++k) {
+        out = putScalar(out, record + source->offsets[k], plyScalarSize(source->properties[k].type),
+                        source->bigEndian);
+      }
+    }
+    return true;
+  });
+  batch.broken |= out != end;
+}
+
+
+quint64 PlyWriter::write(const QString& plyFilePath)
+{
+  _openSources();
+
+  std::vector<Batch> batches;
+  for (size_t part = 0; part < _parts.size(); ++part) {
+    const size_t size = _parts[part].points->size();
+    for (size_t first = 0; first < size; first += BATCH_POINTS) {
+      Batch batch;
+      batch.part = static_cast<int>(part);
+      batch.first = first;
+      batch.count = std::min(BATCH_POINTS, size - first);
+      batch.kept = batch.count;
+      batch.broken = false;
+      batches.push_back(batch);
+    }
+  }
+
+  // header needs count of points inside region before any of them is written
+  if (!_planes.empty()) {
+    QtConcurrent::blockingMap(batches, [this](Batch& batch) {
+      batch.kept = 0;
+      _parts[batch.part].points->forEachRun(batch.first, batch.count, [&](const float* run, size_t, size_t count) {
+        for (size_t i = 0; i < count; ++i, run += POINT_STRIDE) {
+          batch.kept += _inside(run);
+        }
+        return true;
+      });
+    });
+  }
+  quint64 count = 0;
+  for (const auto& batch : batches) {
+    count += batch.kept;
+  }
+
+  // file appears only once complete
+  QSaveFile file(plyFilePath);
+  if (!file.open(QIODevice::WriteOnly)) {
+    throw std::runtime_error("cannot create output file");
+  }
+  const QByteArray header = _header(count);
+  bool written = file.write(header) == header.size();
+  bool matching = true;
+  auto writeBatches = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      Batch& batch = batches[i];
+      matching &= !batch.broken;
+      const qint64 bytes = static_cast<qint64>(batch.bytes.size());
+      written = written && matching && file.write(batch.bytes.data(), bytes) == bytes;
+      std::vector<char>().swap(batch.bytes);
+    }
+  };
+
+  // window is encoded by thread pool while previous one is written
+  const size_t window = std::max(QThread::idealThreadCount(), 1) * WINDOW_BATCHES_PER_THREAD;
+  size_t previous = 0;
+  for (size_t begin = 0; begin < batches.size() && written; begin += window) {
+    const size_t end = std::min(begin + window, batches.size());
+    QFuture<void> encoding = QtConcurrent::map(batches.begin() + begin, batches.begin() + end,
+                                               [this](Batch& batch) {_encode(batch);});
+    writeBatches(previous, begin);
+    encoding.waitForFinished();
+    previous = begin;
+  }
+  if (written) {
+    writeBatches(previous, batches.size());
+  }
+
+  if (!matching) {
+    throw std::runtime_error("points don't match their source file");
+  }
+  if (!written || !file.commit()) {
+    throw std::runtime_error("cannot write output file");
+  }
+  return count;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <QString>
+#include <QVector4D>
+
+#include "pointstorage.h"
+#include "plyheader.h"
+
+#include <memory>
+#include <vector>
+
+class QFile;
+
+
+//
+// Writes points into binary little endian PLY file.
+//
+// Points are relative to origin (see PlyLoader::origin()), it's added back
+// in double precision; coordinates are written as doubles unless origin is zero.
+// Vertex properties other than x, y, z are copied from source PLY files of points
+// (found by row of point) when every source is uncompressed binary PLY with fixed
+// size vertex records and all of them have the same properties, x, y, z only otherwise.
+//
+// Points are encoded into batches by thread pool, window of batches is encoded
+// while previous one is written in large sequential writes, so output never takes
+// more memory than two windows and writing is limited by disk rather than encoding.
+//
+class PlyWriter
+{
+public:
+  explicit PlyWriter(const double* origin);
+  ~PlyWriter();
+
+  // points must outlive writer, they're written in order of registration;
+  // rows of points in source start at firstRow (see Tile::firstRow)
+  void addPoints(const PointStorage& points, const QString& sourcePlyPath = QString(), size_t firstRow = 0);
+  // only points inside region are written, point is inside when a*x + b*y + c*z + d >= 0
+  // for every plane (a, b, c, d) as in PointSelection; empty region keeps all points
+  void setRegion(const std::vector<QVector4D>& planes) {_planes = planes;}
+  void setComment(const QString& comment) {_comment = comment;}
+
+  // returns count of written points, throws std::runtime_error when file can't be written
+  // or sources don't match their points; file appears only once complete
+  quint64 write(const QString& plyFilePath);
+
+
+private:
+  // vertex records of source file mapped into memory
+  struct Source {
+    QString filePath;
+    std::unique_ptr<QFile> file;
+    const uchar* records;
+    size_t recordSize;
+    size_t count;
+    bool bigEndian;
+    PlyScalarType xyzTypes[3];
+    size_t xyzOffsets[3];
+    std::vector<PlyProperty> properties;  // other than x, y, z
+    std::vector<size_t> offsets;          // of properties in record
+  };
+
+  struct Part {
+    const PointStorage* points;
+    QString sourcePath;
+    size_t firstRow;
+    int source;  // -1 without properties of sources
+  };
+
+  struct Batch;
+
+  void _openSources();
+  bool _inside(const float* point) const;
+  size_t _sourceRow(const Source& source, const float* point, size_t firstRow) const;
+  QByteArray _header(quint64 count) const;
+  void _encode(Batch& batch) const;
+
+  double _origin[3];
+  bool _doubles;
+  std::vector<Part> _parts;
+  std::vector<Source> _sources;
+  std::vector<QVector4D> _planes;
+  QString _comment;
+};
@@ -0,0 +1,90 @@
+#include "pointbudget.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace {
+
+// budget before first measured frame and its limits
+const quint64 DEFAULT_BUDGET = 2000000;
+const quint64 MIN_BUDGET = 100000;
+const quint64 MAX_BUDGET = quint64(1) << 40;
+// part of frame left to points, rest is overlay, labels and compositing
+const double POINTS_FRAME_SHARE = 0.7;
+// frames with fewer points don't tell cost per point
+const quint64 MIN_MEASURED_POINTS = 10000;
+// weight of latest frame in cost per point, and budget change per frame at most
+const double COST_SMOOTHING = 0.3;
+const double MAX_BUDGET_STEP = 2;
+
+const double GOLDEN_RATIO_FRACTION = 0.6180339887498949;
+// strides around golden ratio of count tried for the most even one
+const size_t STRIDE_CANDIDATES = 64;
+
+
+// largest partial quotient of continued fraction of stride / count, zero unless they're coprime;
+// prefixes of stride walk are the more even the smaller it is (golden ratio has all ones)
+size_t unevenness(size_t stride, size_t count) {
+  size_t largest = 0;
+  size_t a = count;
+  size_t b = stride;
+  while (b != 0) {
+    largest = std::max(largest, a / b);
+    const size_t r = a % b;
+    a = b;
+    b = r;
+  }
+  return a == 1 ? largest : 0;
+}
+
+} // namespace
+
+
+size_t PointBudget::shuffleStride(size_t count)
+{
+  if (count < 3) {
+    return 1;
+  }
+  const size_t center = static_cast<size_t>(count * GOLDEN_RATIO_FRACTION + 0.5);
+  size_t best = 1;
+  size_t bestUnevenness = count;
+  for (size_t stride = center > STRIDE_CANDIDATES / 2 ? center - STRIDE_CANDIDATES / 2 : 1;
+       stride < std::min(count, center + STRIDE_CANDIDATES / 2); ++stride) {
+    const size_t candidate = unevenness(stride, count);
+    if (candidate > 0 && candidate < bestUnevenness) {
+      best = stride;
+      bestUnevenness = candidate;
+    }
+  }
+  return best;
+}
+
+
+PointBudget::PointBudget()
+  : _targetFps(0),
+    _budget(DEFAULT_BUDGET),
+    _usecsPerPoint(0)
+{
+}
+
+
+void PointBudget::setTargetFps(double fps)
+{
+  _targetFps = std::max(fps, 0.);
+}
+
+
+void PointBudget::addFrame(quint64 points, qint64 usecs)
+{
+  if (!isEnabled() || points < MIN_MEASURED_POINTS || usecs <= 0) {
+    return;
+  }
+  const double cost = static_cast<double>(usecs) / points;
+  _usecsPerPoint = _usecsPerPoint > 0 ? _usecsPerPoint + COST_SMOOTHING * (cost - _usecsPerPoint) : cost;
+
+  const double targetUsecs = 1e6 / _targetFps * POINTS_FRAME_SHARE;
+  const double budget = std::max(_budget / MAX_BUDGET_STEP,
+                                 std::min(_budget * MAX_BUDGET_STEP, targetUsecs / _usecsPerPoint));
+  _budget = std::max(MIN_BUDGET, std::min(MAX_BUDGET, static_cast<quint64>(budget)));
+}
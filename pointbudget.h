@@ -0,0 +1,44 @@
+#pragma once
+
+#include <QtGlobal>
+
+#include <cstddef>
+
+
+//
+// Points drawn per frame to hold target frame rate.
+//
+// Vertex buffers hold every chunk in shuffled order, so any prefix of chunk is an even
+// subsample of it: chunk points are in tree order (spatially coherent) and are walked
+// with stride close to golden ratio of chunk size, so each prefix spreads over whole chunk.
+// While view changes only budget of points is drawn, same fraction of every drawn
+// chunk; once it's still next fractions are added over following frames until all
+// points are there. Budget follows measured time of drawing points.
+//
+class PointBudget
+{
+public:
+  // stride of shuffled order of chunk of count points, coprime with count
+  static size_t shuffleStride(size_t count);
+  // point of chunk drawn at given position of shuffled order
+  static size_t shuffledIndex(size_t position, size_t count) {
+    return count > 0 ? static_cast<size_t>((quint64(position) * shuffleStride(count)) % count) : 0;
+  }
+
+  PointBudget();
+
+  // zero frame rate turns budget off, all points are drawn every frame
+  void setTargetFps(double fps);
+  double targetFps() const {return _targetFps;}
+  bool isEnabled() const {return _targetFps > 0;}
+
+  quint64 budget() const {return _budget;}
+  // points drawn by a frame and time it took GPU to draw them
+  void addFrame(quint64 points, qint64 usecs);
+
+
+private:
+  double _targetFps;
+  quint64 _budget;
+  double _usecsPerPoint;  // smoothed over frames, zero until measured
+};
@@ -0,0 +1,291 @@
+#include "pointcache.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <cstring>
+#include <algorithm>
+
+
+namespace {
+
+const quint64 PAGE_SIZE = 4096;
+const quint64 DEFAULT_SIZE_LIMIT = quint64(16) << 30;
+const char CACHE_SUFFIX[] = ".pcvcache";
+
+// source is hashed by its first and last bytes and pages spread between,
+// whole file would take as long as parsing it
+const qint64 HASH_EDGE_BYTES = 1 << 20;
+const int HASH_SAMPLES = 64;
+const qint64 HASH_SAMPLE_BYTES = 4096;
+
+struct CachedChunk {
+  quint64 first;
+  quint64 count;
+  float min[3];
+  float max[3];
+};
+
+QString cacheDirectory;
+quint64 cacheSizeLimit = DEFAULT_SIZE_LIMIT;
+bool cacheEnabled = true;
+
+
+QString directory() {
+  return cacheDirectory.isEmpty()
+      ? QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/points"
+      : cacheDirectory;
+}
+
+
+void hashRange(QFile& file, qint64 offset, qint64 bytes, QCryptographicHash& hash) {
+  if (file.seek(offset)) {
+    hash.addData(file.read(bytes));
+  }
+}
+
+} // namespace
+
+
+void PointCache::setDirectory(const QString& directory)
+{
+  cacheDirectory = directory;
+}
+
+
+void PointCache::setSizeLimit(quint64 bytes)
+{
+  cacheSizeLimit = bytes;
+}
+
+
+void PointCache::setEnabled(bool enabled)
+{
+  cacheEnabled = enabled;
+}
+
+
+bool PointCache::isEnabled()
+{
+  return cacheEnabled;
+}
+
+
+PointCache::PointCache()
+  : _data(nullptr),
+    _points(nullptr)
+{
+  std::memset(&_header, 0, sizeof(_header));
+}
+
+
+PointCache::~PointCache()
+{
+  close();
+}
+
+
+QString PointCache::_cachePath(const QString& plyFilePath)
+{
+  const QFileInfo source(plyFilePath);
+  const QByteArray key = QCryptographicHash::hash(source.absoluteFilePath().toUtf8(), QCryptographicHash::Sha1);
+  return directory() + "/" + source.completeBaseName() + "-" + key.toHex().left(16) + CACHE_SUFFIX;
+}
+
+
+bool PointCache::_describeSource(const QString& plyFilePath, PointCacheHeader& header)
+{
+  QFile source(plyFilePath);
+  if (!source.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  const qint64 size = source.size();
+  header.sourceSize = static_cast<quint64>(size);
+  header.sourceModified = QFileInfo(source).lastModified().toMSecsSinceEpoch();
+
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  hashRange(source, 0, HASH_EDGE_BYTES, hash);
+  for (int i = 1; i <= HASH_SAMPLES; ++i) {
+    hashRange(source, size / (HASH_SAMPLES + 1) * i, HASH_SAMPLE_BYTES, hash);
+  }
+  hashRange(source, std::max<qint64>(0, size - HASH_EDGE_BYTES), HASH_EDGE_BYTES, hash);
+  const QByteArray digest = hash.result();
+  std::memcpy(header.sourceHash, digest.constData(), std::min<size_t>(digest.size(), sizeof(header.sourceHash)));
+  return true;
+}
+
+
+bool PointCache::open(const QString& plyFilePath)
+{
+  close();
+  if (!cacheEnabled) {
+    return false;
+  }
+
+  // cheap checks go first, hash reads few megabytes of source
+  _file.setFileName(_cachePath(plyFilePath));
+  const QFileInfo source(plyFilePath);
+  PointCacheHeader header;
+  if (!_file.open(QIODevice::ReadOnly) ||
+      _file.read(reinterpret_cast<char*>(&header), sizeof(header)) != sizeof(header) ||
+      std::memcmp(header.magic, POINT_CACHE_MAGIC, sizeof(POINT_CACHE_MAGIC)) != 0 ||
+      header.sourceSize != static_cast<quint64>(source.size()) ||
+      header.sourceModified != source.lastModified().toMSecsSinceEpoch()) {
+    _file.close();
+    return false;
+  }
+  PointCacheHeader current;
+  if (!_describeSource(plyFilePath, current) ||
+      std::memcmp(current.sourceHash, header.sourceHash, sizeof(header.sourceHash)) != 0) {
+    _file.close();
+    return false;
+  }
+
+  const quint64 fileSize = static_cast<quint64>(_file.size());
+  const quint64 pointsBytes = header.pointsCount * POINT_STRIDE * sizeof(float);
+  if (header.chunksOffset + header.chunksCount * sizeof(CachedChunk) > fileSize ||
+      header.indexOffset + header.indexBytes > fileSize ||
+      header.pointsOffset + pointsBytes > fileSize || header.pointsOffset % PAGE_SIZE != 0) {
+    _file.close();
+    return false;
+  }
+
+  // private mapping lets points be changed in memory without touching cache
+  _data = _file.map(0, fileSize, QFileDevice::MapPrivateOption);
+  if (!_data) {
+    _file.close();
+    return false;
+  }
+  _header = header;
+  _points = reinterpret_cast<float*>(_data + header.pointsOffset);
+  return true;
+}
+
+
+void PointCache::close()
+{
+  if (_data) {
+    _file.unmap(_data);
+  }
+  _file.close();
+  _data = nullptr;
+  _points = nullptr;
+}
+
+
+QVector3D PointCache::boundMin() const
+{
+  return QVector3D(_header.boundMin[0], _header.boundMin[1], _header.boundMin[2]);
+}
+
+
+QVector3D PointCache::boundMax() const
+{
+  return QVector3D(_header.boundMax[0], _header.boundMax[1], _header.boundMax[2]);
+}
+
+
+std::vector<PointChunk> PointCache::chunks() const
+{
+  std::vector<PointChunk> result;
+  if (!_data) {
+    return result;
+  }
+  const CachedChunk* cached = reinterpret_cast<const CachedChunk*>(_data + _header.chunksOffset);
+  for (quint64 i = 0; i < _header.chunksCount; ++i) {
+    if (cached[i].first + cached[i].count > _header.pointsCount) {
+      return std::vector<PointChunk>();
+    }
+    PointChunk chunk;
+    chunk.first = cached[i].first;
+    chunk.count = cached[i].count;
+    std::copy(cached[i].min, cached[i].min + 3, chunk.min);
+    std::copy(cached[i].max, cached[i].max + 3, chunk.max);
+    result.push_back(chunk);
+  }
+  return result;
+}
+
+
+bool PointCache::write(const QString& plyFilePath, const PointStorage& points, const double* origin,
+                       const QVector3D& boundMin, const QVector3D& boundMax,
+                       const std::vector<PointChunk>& chunks, const PointIndex& index,
+                       const QAtomicInt* canceled)
+{
+  if (!cacheEnabled) {
+    return false;
+  }
+
+  PointCacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, POINT_CACHE_MAGIC, sizeof(POINT_CACHE_MAGIC));
+  if (!_describeSource(plyFilePath, header)) {
+    return false;
+  }
+  header.pointsCount = points.size();
+  for (int axis = 0; axis < 3; ++axis) {
+    header.boundMin[axis] = boundMin[axis];
+    header.boundMax[axis] = boundMax[axis];
+    header.origin[axis] = origin[axis];
+  }
+  header.chunksCount = chunks.size();
+  header.chunksOffset = sizeof(header);
+  header.indexBytes = index.serializedBytes();
+  header.indexOffset = header.chunksOffset + chunks.size() * sizeof(CachedChunk);
+  header.pointsOffset = (header.indexOffset + header.indexBytes + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+  // written aside and renamed over previous cache, so readers never see half of it
+  const QString path = _cachePath(plyFilePath);
+  if (!QDir().mkpath(QFileInfo(path).absolutePath())) {
+    return false;
+  }
+  QSaveFile file(path);
+  if (!file.open(QIODevice::WriteOnly)) {
+    return false;
+  }
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (const auto& chunk : chunks) {
+    CachedChunk cached;
+    cached.first = chunk.first;
+    cached.count = chunk.count;
+    std::copy(chunk.min, chunk.min + 3, cached.min);
+    std::copy(chunk.max, chunk.max + 3, cached.max);
+    file.write(reinterpret_cast<const char*>(&cached), sizeof(cached));
+  }
+  // padding to page is less than a page
+  bool written = index.serialize(file) &&
+      file.write(QByteArray(static_cast<int>(header.pointsOffset - header.indexOffset - header.indexBytes), '\0')) >= 0;
+  written = written && points.forEachRun(0, points.size(), [&file, canceled](const float* run, size_t, size_t count) {
+    const qint64 bytes = static_cast<qint64>(count * POINT_STRIDE * sizeof(float));
+    return !(canceled && canceled->load()) && file.write(reinterpret_cast<const char*>(run), bytes) == bytes;
+  });
+  if (!written || !file.commit()) {
+    return false;
+  }
+
+  _trim(path);
+  return true;
+}
+
+
+void PointCache::_trim(const QString& keptPath)
+{
+  // oldest caches go first
+  QDir dir(directory());
+  const QFileInfoList caches = dir.entryInfoList(QStringList() << QString("*") + CACHE_SUFFIX,
+                                                 QDir::Files, QDir::Time);
+  quint64 total = 0;
+  for (const auto& cache : caches) {
+    total += cache.size();
+  }
+  for (int i = caches.size() - 1; i >= 0 && total > cacheSizeLimit; --i) {
+    if (caches[i].absoluteFilePath() != QFileInfo(keptPath).absoluteFilePath() &&
+        QFile::remove(caches[i].absoluteFilePath())) {
+      total -= caches[i].size();
+    }
+  }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <QVector3D>
+
+#include "pointindex.h"
+
+#include <vector>
+
+
+//
+// Sidecar cache of parsed PLY file, so large ascii files open at cost of mapping.
+//
+// Cache is written once points are indexed: points in tree order at page aligned
+// offset, their chunks and kd-tree nodes, bounds and origin. It's keyed by absolute
+// path of source and valid while source size, modification time and hash of its
+// sampled pages are same. Layout is native, cache is local to machine.
+// Caches live in one directory, oldest ones are removed when it grows over limit.
+//
+const char POINT_CACHE_MAGIC[8] = {'p', 'c', 'v', 'c', 'a', 'c', 'h', '\1'};
+
+struct PointCacheHeader {
+  char magic[8];
+  quint64 sourceSize;
+  qint64 sourceModified;   // msecs since epoch
+  char sourceHash[20];     // sha1 of sampled pages
+  quint32 reserved;
+  quint64 pointsCount;
+  float boundMin[3];
+  float boundMax[3];
+  double origin[3];
+  quint64 chunksCount;
+  quint64 chunksOffset;    // CachedChunk records
+  quint64 indexBytes;
+  quint64 indexOffset;     // PointIndex::serialize() data
+  quint64 pointsOffset;    // x, y, z, row points, page aligned
+};
+
+
+class PointCache
+{
+public:
+  // where caches go, empty for default one under user cache location
+  static void setDirectory(const QString& directory);
+  static void setSizeLimit(quint64 bytes);
+  static void setEnabled(bool enabled);
+  static bool isEnabled();
+
+  PointCache();
+  ~PointCache();
+
+  // maps valid cache of source, false on miss
+  bool open(const QString& plyFilePath);
+  void close();
+  bool isOpen() const {return _points != nullptr;}
+
+  // valid while open, points are mapped copy-on-write, so they may be modified
+  size_t pointsCount() const {return _header.pointsCount;}
+  float* points() const {return _points;}
+  const double* origin() const {return _header.origin;}
+  QVector3D boundMin() const;
+  QVector3D boundMax() const;
+  std::vector<PointChunk> chunks() const;
+  // PointIndex::restore() data, no copy, valid while open
+  const uchar* indexData() const {return _data ? _data + _header.indexOffset : nullptr;}
+  size_t indexBytes() const {return _data ? static_cast<size_t>(_header.indexBytes) : 0;}
+
+  // writes cache of source replacing previous one, then trims directory to size limit;
+  // points must be reordered by index which chunks come from; nothing is written once
+  // canceled is set
+  static bool write(const QString& plyFilePath, const PointStorage& points, const double* origin,
+                    const QVector3D& boundMin, const QVector3D& boundMax,
+                    const std::vector<PointChunk>& chunks, const PointIndex& index,
+                    const QAtomicInt* canceled = nullptr);
+
+
+private:
+  Q_DISABLE_COPY(PointCache)
+
+  static QString _cachePath(const QString& plyFilePath);
+  static bool _describeSource(const QString& plyFilePath, PointCacheHeader& header);
+  static void _trim(const QString& keptPath);
+
+  QFile _file;
+  uchar* _data;
+  PointCacheHeader _header;
+  float* _points;
+};
@@ -0,0 +1,307 @@
+#include "pointindex.h"
+#include "plydecoders.h"
+
+#include <QtConcurrent>
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+
+namespace {
+
+const size_t LEAF_POINTS = 32;
+// subtrees below this depth are built by single worker
+const int PARALLEL_DEPTH = 4;
+const size_t MIN_PARALLEL_POINTS = 1 << 16;
+// tree of billions of points is written in slices, single write may be capped by OS
+const size_t SERIALIZE_SLICE_BYTES = size_t(1) << 26;
+
+
+// nodes of subtree over n points, median split makes it depend on n only
+size_t nodesCount(size_t n) {
+  if (n <= LEAF_POINTS) {
+    return 1;
+  }
+  return 1 + nodesCount(n / 2) + nodesCount(n - n / 2);
+}
+
+
+struct ScreenPoint {
+  float x, y;
+  bool visible;
+};
+
+
+// project world point with column-major matrix into viewport pixels
+inline ScreenPoint project(const float* m, float x, float y, float z, const QSize& viewport) {
+  ScreenPoint s;
+  const float cx = m[0] * x + m[4] * y + m[8] * z + m[12];
+  const float cy = m[1] * x + m[5] * y + m[9] * z + m[13];
+  const float cz = m[2] * x + m[6] * y + m[10] * z + m[14];
+  const float cw = m[3] * x + m[7] * y + m[11] * z + m[15];
+  s.visible = cw > 0 && cz >= -cw && cz <= cw;
+  if (cw > 0) {
+    s.x = (cx / cw + 1) * 0.5f * viewport.width();
+    s.y = (1 - cy / cw) * 0.5f * viewport.height();
+  } else {
+    s.x = s.y = 0;
+  }
+  return s;
+}
+
+} // namespace
+
+
+PointIndex::PointIndex()
+  : _points(nullptr)
+{
+}
+
+
+void PointIndex::build(const PointStorage& points) {
+  const size_t count = points.size();
+  _points = &points;
+  _order.clear();
+  _nodes.clear();
+  if (count == 0) {
+    return;
+  }
+
+  _order.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    _order[i] = static_cast<quint32>(i);
+  }
+  _nodes.resize(nodesCount(count));
+  _build(0, 0, count, 0);
+}
+
+
+void PointIndex::_build(size_t nodeIndex, size_t begin, size_t end, int depth) {
+  Node& node = _nodes[nodeIndex];
+  node.begin = begin;
+  node.end = end;
+  node.right = 0;
+
+  // bounding box of node points
+  std::fill(node.min, node.min + 3, std::numeric_limits<float>::max());
+  std::fill(node.max, node.max + 3, -std::numeric_limits<float>::max());
+  for (size_t i = begin; i < end; ++i) {
+    const float* p = _points->point(_order[i]);
+    for (int axis = 0; axis < 3; ++axis) {
+      node.min[axis] = std::min(node.min[axis], p[axis]);
+      node.max[axis] = std::max(node.max[axis], p[axis]);
+    }
+  }
+  if (end - begin <= LEAF_POINTS) {
+    return;
+  }
+
+  // split at median of the longest side
+  int axis = 0;
+  for (int a = 1; a < 3; ++a) {
+    if (node.max[a] - node.min[a] > node.max[axis] - node.min[axis]) {
+      axis = a;
+    }
+  }
+  const size_t middle = begin + (end - begin) / 2;
+  const PointStorage& points = *_points;
+  std::nth_element(_order.begin() + begin, _order.begin() + middle, _order.begin() + end,
+                   [&points, axis](quint32 a, quint32 b) {
+    return points.point(a)[axis] < points.point(b)[axis];
+  });
+
+  node.right = nodeIndex + 1 + nodesCount(middle - begin);
+  const size_t rightIndex = node.right;
+
+  // subtrees own disjoint ranges of nodes and order, so they're built in parallel
+  if (depth < PARALLEL_DEPTH && end - begin >= MIN_PARALLEL_POINTS) {
+    QFuture<void> left = QtConcurrent::run([=]() {_build(nodeIndex + 1, begin, middle, depth + 1);});
+    _build(rightIndex, middle, end, depth + 1);
+    left.waitForFinished();
+  } else {
+    _build(nodeIndex + 1, begin, middle, depth + 1);
+    _build(rightIndex, middle, end, depth + 1);
+  }
+}
+
+
+void PointIndex::reorder(PointStorage& points) {
+  // follow cycles of permutation, point at position i moves to position of i in order
+  const size_t count = _order.size();
+  std::vector<bool> placed(count, false);
+  float saved[POINT_STRIDE];
+  for (size_t start = 0; start < count; ++start) {
+    if (placed[start]) {
+      continue;
+    }
+    std::copy(points.point(start), points.point(start) + POINT_STRIDE, saved);
+    size_t position = start;
+    for (;;) {
+      placed[position] = true;
+      const size_t source = _order[position];
+      if (source == start) {
+        std::copy(saved, saved + POINT_STRIDE, points.point(position));
+        break;
+      }
+      std::copy(points.point(source), points.point(source) + POINT_STRIDE, points.point(position));
+      position = source;
+    }
+  }
+
+  // order is identity now, nodes address points directly
+  std::vector<quint32>().swap(_order);
+  _points = &points;
+}
+
+
+bool PointIndex::serialize(QIODevice& device) const {
+  // nodes go straight to device, tree of 2^29 points and more is over 2 GB
+  const char* data = reinterpret_cast<const char*>(_nodes.data());
+  const size_t bytes = serializedBytes();
+  for (size_t offset = 0; offset < bytes; offset += SERIALIZE_SLICE_BYTES) {
+    const qint64 slice = static_cast<qint64>(std::min(SERIALIZE_SLICE_BYTES, bytes - offset));
+    if (device.write(data + offset, slice) != slice) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool PointIndex::restore(const PointStorage& points, const uchar* data, size_t bytes) {
+  const size_t count = points.size();
+  if (count == 0 || !data || bytes != nodesCount(count) * sizeof(Node)) {
+    return false;
+  }
+  std::vector<Node> nodes(nodesCount(count));
+  std::memcpy(nodes.data(), data, bytes);
+  // tree is walked without checks later, so broken one is refused here
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const Node& node = nodes[i];
+    if (node.begin > node.end || node.end > count || (node.right != 0 && (node.right <= i + 1 || node.right >= nodes.size()))) {
+      return false;
+    }
+  }
+  _nodes.swap(nodes);
+  std::vector<quint32>().swap(_order);
+  _points = &points;
+  return true;
+}
+
+
+std::vector<PointChunk> PointIndex::chunks(size_t maxPoints) const {
+  std::vector<PointChunk> result;
+  if (_nodes.empty()) {
+    return result;
+  }
+
+  // preorder walk keeps chunks sorted by first point
+  std::vector<size_t> stack(1, 0);
+  while (!stack.empty()) {
+    const Node& node = _nodes[stack.back()];
+    const size_t index = stack.back();
+    stack.pop_back();
+    if (node.right == 0 || node.end - node.begin <= maxPoints) {
+      PointChunk chunk;
+      chunk.first = node.begin;
+      chunk.count = node.end - node.begin;
+      std::copy(node.min, node.min + 3, chunk.min);
+      std::copy(node.max, node.max + 3, chunk.max);
+      result.push_back(chunk);
+      continue;
+    }
+    stack.push_back(node.right);
+    stack.push_back(index + 1);
+  }
+  return result;
+}
+
+
+const float* PointIndex::point(size_t index) const {
+  return _points->point(index);
+}
+
+
+float PointIndex::_screenDistance2(const Node& node, const float* m, const QSize& viewport, const QPointF& pos) const {
+  float left = std::numeric_limits<float>::max();
+  float top = std::numeric_limits<float>::max();
+  float right = -std::numeric_limits<float>::max();
+  float bottom = -std::numeric_limits<float>::max();
+  for (int corner = 0; corner < 8; ++corner) {
+    const float x = (corner & 1) ? node.max[0] : node.min[0];
+    const float y = (corner & 2) ? node.max[1] : node.min[1];
+    const float z = (corner & 4) ? node.max[2] : node.min[2];
+    if (m[3] * x + m[7] * y + m[11] * z + m[15] <= 0) {
+      // box crosses camera plane, its projection is unbounded
+      return 0;
+    }
+    const ScreenPoint s = project(m, x, y, z, viewport);
+    left = std::min(left, s.x);
+    right = std::max(right, s.x);
+    top = std::min(top, s.y);
+    bottom = std::max(bottom, s.y);
+  }
+
+  const float dx = std::max(0.f, std::max(left - float(pos.x()), float(pos.x()) - right));
+  const float dy = std::max(0.f, std::max(top - float(pos.y()), float(pos.y()) - bottom));
+  return dx * dx + dy * dy;
+}
+
+
+qint64 PointIndex::pick(const QMatrix4x4& viewMatrix, const QSize& viewport, const QPointF& pos, float tolerance,
+                        float* pixelDistance) const {
+  if (_nodes.empty()) {
+    return -1;
+  }
+
+  const float* m = viewMatrix.constData();
+  float bestDistance2 = tolerance * tolerance;
+  qint64 best = -1;
+
+  // depth first, nearer child first, skipping nodes which can't beat best match
+  std::vector<std::pair<float, size_t> > stack;
+  stack.push_back(std::make_pair(_screenDistance2(_nodes[0], m, viewport, pos), size_t(0)));
+  while (!stack.empty()) {
+    const auto top = stack.back();
+    stack.pop_back();
+    if (top.first >= bestDistance2) {
+      continue;
+    }
+
+    const Node& node = _nodes[top.second];
+    if (node.right == 0) {
+      for (size_t i = node.begin; i < node.end; ++i) {
+        const float* p = _points->point(_pointIndex(i));
+        const ScreenPoint s = project(m, p[0], p[1], p[2], viewport);
+        if (!s.visible) {
+          continue;
+        }
+        const float dx = s.x - pos.x();
+        const float dy = s.y - pos.y();
+        const float distance2 = dx * dx + dy * dy;
+        if (distance2 < bestDistance2) {
+          bestDistance2 = distance2;
+          best = _pointIndex(i);
+        }
+      }
+      continue;
+    }
+
+    const size_t leftIndex = top.second + 1;
+    const float leftDistance2 = _screenDistance2(_nodes[leftIndex], m, viewport, pos);
+    const float rightDistance2 = _screenDistance2(_nodes[node.right], m, viewport, pos);
+    if (leftDistance2 < rightDistance2) {
+      stack.push_back(std::make_pair(rightDistance2, node.right));
+      stack.push_back(std::make_pair(leftDistance2, leftIndex));
+    } else {
+      stack.push_back(std::make_pair(leftDistance2, leftIndex));
+      stack.push_back(std::make_pair(rightDistance2, node.right));
+    }
+  }
+  if (pixelDistance && best >= 0) {
+    *pixelDistance = std::sqrt(bestDistance2);
+  }
+  return best;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <QIODevice>
+#include <QMatrix4x4>
+#include <QPointF>
+#include <QSize>
+
+#include "pointstorage.h"
+
+#include <vector>
+
+
+// contiguous run of points with their bounds, spatially coherent after PointIndex::reorder()
+struct PointChunk {
+  size_t first;
+  size_t count;
+  float min[3];
+  float max[3];
+};
+
+
+//
+// Kd-tree over points cloud for measuring tool picking.
+//
+// Tree is built once points are loaded, every node keeps bounding box
+// of its points, so pick query visits only nodes whose projection on
+// screen is close to cursor instead of scanning all points.
+//
+class PointIndex
+{
+public:
+  PointIndex();
+
+  // points must outlive the index
+  void build(const PointStorage& points);
+  bool isEmpty() const {return _nodes.empty();}
+
+  // move points into tree order, so every subtree owns contiguous run of points;
+  // points must be the ones index is built for
+  void reorder(PointStorage& points);
+  // tree of reordered points as raw bytes in native layout, for caching;
+  // restore() takes them back for the same points, false if they don't fit
+  size_t serializedBytes() const {return _nodes.size() * sizeof(Node);}
+  bool serialize(QIODevice& device) const;
+  bool restore(const PointStorage& points, const uchar* data, size_t bytes);
+  // spatially coherent runs of at most maxPoints points in tree order, valid after reorder()
+  std::vector<PointChunk> chunks(size_t maxPoints) const;
+
+  // index of point projected closest to screen position within tolerance pixels, -1 if none
+  qint64 pick(const QMatrix4x4& viewMatrix, const QSize& viewport, const QPointF& pos, float tolerance,
+              float* pixelDistance = nullptr) const;
+
+  const float* point(size_t index) const;
+
+
+private:
+  struct Node {
+    float min[3];
+    float max[3];
+    size_t begin;   // range in _order
+    size_t end;
+    size_t right;   // right child node, left one follows parent, 0 for leaf
+  };
+
+  void _build(size_t node, size_t begin, size_t end, int depth);
+  float _screenDistance2(const Node& node, const float* m, const QSize& viewport, const QPointF& pos) const;
+
+  size_t _pointIndex(size_t position) const {return _order.empty() ? position : _order[position];}
+
+  const PointStorage* _points;
+  // point indices, each node owns contiguous range; empty once points are in tree order
+  std::vector<quint32> _order;
+  std::vector<Node> _nodes;     // preorder
+};
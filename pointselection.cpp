@@ -0,0 +1,296 @@
+#include "pointselection.h"
+
+#include <QElapsedTimer>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#define POINT_SELECTION_SSE
+#endif
+
+
+namespace {
+
+// registered points are split into chunks of that many rows unless chunks are given
+const size_t CHUNK_POINTS = 1 << 16;
+// points of crossing chunks tested by single task
+const size_t TASK_POINTS = 1 << 16;
+// points summed in floats before sums go to doubles
+const size_t SUM_BATCH_POINTS = 1 << 10;
+// planes of region kept in registers by scan
+const int MAX_PLANES = 16;
+
+const float HUGE_COORDINATE = std::numeric_limits<float>::max();
+
+#ifdef POINT_SELECTION_SSE
+// set bits of 4-bit lane mask
+const int MASK_BITS[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+#endif
+
+
+enum Placement {OUTSIDE, CROSSING, INSIDE};
+
+
+// where box is relative to region, by its corners
+Placement placeBox(const float* min, const float* max, const std::vector<QVector4D>& planes) {
+  Placement placement = INSIDE;
+  for (const auto& plane : planes) {
+    int inside = 0;
+    for (int corner = 0; corner < 8; ++corner) {
+      const float x = (corner & 1) ? max[0] : min[0];
+      const float y = (corner & 2) ? max[1] : min[1];
+      const float z = (corner & 4) ? max[2] : min[2];
+      inside += (plane.x() * x + plane.y() * y + plane.z() * z + plane.w() >= 0);
+    }
+    if (inside == 0) {
+      return OUTSIDE;
+    }
+    if (inside < 8) {
+      placement = CROSSING;
+    }
+  }
+  return placement;
+}
+
+} // namespace
+
+
+std::vector<QVector4D> PointSelection::screenBoxPlanes(const QMatrix4x4& viewMatrix, const QRectF& ndcRect,
+                                                       double frontDistance, double rearDistance)
+{
+  // planes on clip coordinates, same as for culling of chunks in scene
+  const float front = static_cast<float>(frontDistance);
+  const float rear = static_cast<float>(rearDistance);
+  const QVector4D clipPlanes[SCREEN_BOX_PLANES] = {
+    QVector4D(1, 0, 0, -ndcRect.left()), QVector4D(-1, 0, 0, ndcRect.right()),
+    QVector4D(0, 1, 0, -ndcRect.top()), QVector4D(0, -1, 0, ndcRect.bottom()),
+    QVector4D(0, 0, 1, 1), QVector4D(0, 0, -1, 1),
+    QVector4D(0, 0, -1, rear), QVector4D(0, 0, 1, front)
+  };
+  // plane p of clip coordinates v * p is plane p * v of points
+  std::vector<QVector4D> planes;
+  for (const auto& plane : clipPlanes) {
+    planes.push_back(plane * viewMatrix);
+  }
+  return planes;
+}
+
+
+PointSelection::PointSelection()
+  : _measuredChunks(0)
+{
+}
+
+
+void PointSelection::addPoints(const PointStorage& points, const std::vector<PointChunk>& chunks)
+{
+  for (const auto& pointChunk : chunks) {
+    Chunk chunk;
+    chunk.points = &points;
+    chunk.first = pointChunk.first;
+    chunk.count = pointChunk.count;
+    _chunks.push_back(chunk);
+  }
+}
+
+
+void PointSelection::addPoints(const PointStorage& points)
+{
+  for (size_t first = 0; first < points.size(); first += CHUNK_POINTS) {
+    Chunk chunk;
+    chunk.points = &points;
+    chunk.first = first;
+    chunk.count = std::min(CHUNK_POINTS, points.size() - first);
+    _chunks.push_back(chunk);
+  }
+}
+
+
+void PointSelection::clear()
+{
+  _chunks.clear();
+  _measuredChunks = 0;
+}
+
+
+void PointSelection::_scan(const float* p, size_t count, const QVector4D* planes, int planesCount, Partial& partial)
+{
+  size_t i = 0;
+
+#ifdef POINT_SELECTION_SSE
+  // 4 points are transposed into x, y, z and row lanes, every plane masks lanes outside
+  __m128 a[MAX_PLANES], b[MAX_PLANES], c[MAX_PLANES], d[MAX_PLANES];
+  for (int k = 0; k < planesCount; ++k) {
+    a[k] = _mm_set1_ps(planes[k].x());
+    b[k] = _mm_set1_ps(planes[k].y());
+    c[k] = _mm_set1_ps(planes[k].z());
+    d[k] = _mm_set1_ps(planes[k].w());
+  }
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 huge = _mm_set1_ps(HUGE_COORDINATE);
+  const __m128 negativeHuge = _mm_set1_ps(-HUGE_COORDINATE);
+  __m128 min[3] = {huge, huge, huge};
+  __m128 max[3] = {negativeHuge, negativeHuge, negativeHuge};
+
+  while (count - i >= 4) {
+    const size_t batchEnd = i + std::min(SUM_BATCH_POINTS, (count - i) & ~size_t(3));
+    __m128 sum[3] = {zero, zero, zero};
+    for (; i < batchEnd; i += 4, p += 4 * POINT_STRIDE) {
+      __m128 x = _mm_loadu_ps(p);
+      __m128 y = _mm_loadu_ps(p + POINT_STRIDE);
+      __m128 z = _mm_loadu_ps(p + 2 * POINT_STRIDE);
+      __m128 row = _mm_loadu_ps(p + 3 * POINT_STRIDE);
+      _MM_TRANSPOSE4_PS(x, y, z, row);
+
+      __m128 inside = _mm_cmpeq_ps(zero, zero);
+      for (int k = 0; k < planesCount; ++k) {
+        const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[k], x), _mm_mul_ps(b[k], y)),
+                                           _mm_add_ps(_mm_mul_ps(c[k], z), d[k]));
+        inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, zero));
+      }
+      const int mask = _mm_movemask_ps(inside);
+      if (mask == 0) {
+        continue;
+      }
+      partial.count += MASK_BITS[mask];
+      const __m128 coordinates[3] = {x, y, z};
+      for (int axis = 0; axis < 3; ++axis) {
+        const __m128 selected = _mm_and_ps(inside, coordinates[axis]);
+        sum[axis] = _mm_add_ps(sum[axis], selected);
+        min[axis] = _mm_min_ps(min[axis], _mm_or_ps(selected, _mm_andnot_ps(inside, huge)));
+        max[axis] = _mm_max_ps(max[axis], _mm_or_ps(selected, _mm_andnot_ps(inside, negativeHuge)));
+      }
+    }
+    for (int axis = 0; axis < 3; ++axis) {
+      float lanes[4];
+      _mm_storeu_ps(lanes, sum[axis]);
+      partial.sum[axis] += static_cast<double>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    }
+  }
+  for (int axis = 0; axis < 3; ++axis) {
+    float lanes[4];
+    _mm_storeu_ps(lanes, min[axis]);
+    partial.min[axis] = std::min(partial.min[axis], *std::min_element(lanes, lanes + 4));
+    _mm_storeu_ps(lanes, max[axis]);
+    partial.max[axis] = std::max(partial.max[axis], *std::max_element(lanes, lanes + 4));
+  }
+#endif
+
+  // points left over by SSE loop or all of them without it
+  for (; i < count; ++i, p += POINT_STRIDE) {
+    bool inside = true;
+    for (int k = 0; k < planesCount && inside; ++k) {
+      inside = planes[k].x() * p[0] + planes[k].y() * p[1] + planes[k].z() * p[2] + planes[k].w() >= 0;
+    }
+    if (!inside) {
+      continue;
+    }
+    ++partial.count;
+    for (int axis = 0; axis < 3; ++axis) {
+      partial.sum[axis] += p[axis];
+      partial.min[axis] = std::min(partial.min[axis], p[axis]);
+      partial.max[axis] = std::max(partial.max[axis], p[axis]);
+    }
+  }
+}
+
+
+void PointSelection::_measure()
+{
+  if (_measuredChunks == _chunks.size()) {
+    return;
+  }
+  QtConcurrent::blockingMap(_chunks.begin() + _measuredChunks, _chunks.end(), [](Chunk& chunk) {
+    Partial& whole = chunk.whole;
+    whole.count = 0;
+    std::fill(whole.sum, whole.sum + 3, 0.);
+    std::fill(whole.min, whole.min + 3, HUGE_COORDINATE);
+    std::fill(whole.max, whole.max + 3, -HUGE_COORDINATE);
+    chunk.points->forEachRun(chunk.first, chunk.count, [&](const float* run, size_t, size_t runCount) {
+      _scan(run, runCount, nullptr, 0, whole);
+      return true;
+    });
+  });
+  _measuredChunks = _chunks.size();
+}
+
+
+SelectionStats PointSelection::query(const std::vector<QVector4D>& planes)
+{
+  QElapsedTimer queryTimer;
+  queryTimer.start();
+  if (planes.size() > static_cast<size_t>(MAX_PLANES)) {
+    throw std::runtime_error("too many selection planes");
+  }
+  _measure();
+
+  Partial total;
+  total.count = 0;
+  std::fill(total.sum, total.sum + 3, 0.);
+  std::fill(total.min, total.min + 3, HUGE_COORDINATE);
+  std::fill(total.max, total.max + 3, -HUGE_COORDINATE);
+  auto merge = [&total](const Partial& partial) {
+    total.count += partial.count;
+    for (int axis = 0; axis < 3; ++axis) {
+      total.sum[axis] += partial.sum[axis];
+      total.min[axis] = std::min(total.min[axis], partial.min[axis]);
+      total.max[axis] = std::max(total.max[axis], partial.max[axis]);
+    }
+  };
+
+  // chunks inside count as a whole, points of crossing ones are tested by tasks
+  struct Task {
+    const PointStorage* points;
+    size_t first;
+    size_t count;
+    Partial partial;
+  };
+  std::vector<Task> tasks;
+  for (const auto& chunk : _chunks) {
+    if (chunk.whole.count == 0) {
+      continue;
+    }
+    const Placement placement = placeBox(chunk.whole.min, chunk.whole.max, planes);
+    if (placement == INSIDE) {
+      merge(chunk.whole);
+    } else if (placement == CROSSING) {
+      for (size_t first = 0; first < chunk.count; first += TASK_POINTS) {
+        Task task;
+        task.points = chunk.points;
+        task.first = chunk.first + first;
+        task.count = std::min(TASK_POINTS, chunk.count - first);
+        task.partial.count = 0;
+        std::fill(task.partial.sum, task.partial.sum + 3, 0.);
+        std::fill(task.partial.min, task.partial.min + 3, HUGE_COORDINATE);
+        std::fill(task.partial.max, task.partial.max + 3, -HUGE_COORDINATE);
+        tasks.push_back(task);
+      }
+    }
+  }
+  const int planesCount = static_cast<int>(planes.size());
+  QtConcurrent::blockingMap(tasks, [&planes, planesCount](Task& task) {
+    task.points->forEachRun(task.first, task.count, [&](const float* run, size_t, size_t runCount) {
+      _scan(run, runCount, planes.data(), planesCount, task.partial);
+      return true;
+    });
+  });
+  for (const auto& task : tasks) {
+    merge(task.partial);
+  }
+
+  SelectionStats stats;
+  stats.count = total.count;
+  for (int axis = 0; axis < 3; ++axis) {
+    stats.centroid[axis] = total.count > 0 ? total.sum[axis] / total.count : 0;
+    stats.min[axis] = total.count > 0 ? total.min[axis] : 0;
+    stats.max[axis] = total.count > 0 ? total.max[axis] : 0;
+  }
+  stats.usecs = queryTimer.nsecsElapsed() / 1000;
+  return stats;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <QMatrix4x4>
+#include <QRectF>
+#include <QVector4D>
+
+#include "pointstorage.h"
+#include "pointindex.h"
+
+#include <vector>
+
+
+// what's inside of selected region, coordinates are relative to points origin
+struct SelectionStats {
+  quint64 count;
+  double centroid[3];  // mean z is centroid[2]
+  float min[3];        // bounding box of selected points, min and max z among them
+  float max[3];
+  qint64 usecs;        // query wall time
+};
+
+
+//
+// Region statistics of loaded points for box selection.
+//
+// Region is convex: point is inside when a*x + b*y + c*z + d >= 0 for every
+// plane (a, b, c, d). Points are registered by chunks, every chunk is measured
+// once on first query (count, sums and bounds), so chunks entirely inside region
+// are taken as they are and ones entirely outside are skipped; points of chunks
+// crossing its border are tested 4 at a time with SSE by thread pool.
+//
+class PointSelection
+{
+public:
+  // planes of region dragged on screen as rectangle in normalized device coordinates
+  // (top is its lower y), cut by camera clipping planes at front and rear distances as drawn
+  static const int SCREEN_BOX_PLANES = 8;
+  static std::vector<QVector4D> screenBoxPlanes(const QMatrix4x4& viewMatrix, const QRectF& ndcRect,
+                                                double frontDistance, double rearDistance);
+
+  PointSelection();
+
+  // points must outlive selection or clear(); chunks partition points,
+  // spatially coherent ones (PointIndex::chunks()) let query skip more of them
+  void addPoints(const PointStorage& points, const std::vector<PointChunk>& chunks);
+  // points are split into chunks by rows
+  void addPoints(const PointStorage& points);
+  void clear();
+
+  // not thread safe against addPoints() and clear()
+  SelectionStats query(const std::vector<QVector4D>& planes);
+
+
+private:
+  // count, sums and bounds of points inside, summed in double precision
+  struct Partial {
+    quint64 count;
+    double sum[3];
+    float min[3];
+    float max[3];
+  };
+
+  struct Chunk {
+    const PointStorage* points;
+    size_t first;
+    size_t count;
+    Partial whole;  // valid once measured
+  };
+
+  static void _scan(const float* points, size_t count, const QVector4D* planes, int planesCount, Partial& partial);
+  void _measure();
+
+  std::vector<Chunk> _chunks;
+  size_t _measuredChunks;  // leading chunks with whole stats
+};
@@ -0,0 +1,141 @@
+#include "pointstorage.h"
+
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#ifdef Q_OS_WIN
+#include <malloc.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/mman.h>
+#endif
+
+
+namespace {
+
+// huge page of x86-64 and arm64 kernels, full block takes exactly one
+const size_t HUGE_PAGE = 2 << 20;
+const size_t BLOCK_BYTES = PointStorage::BLOCK_POINTS * POINT_STRIDE * sizeof(float);
+const size_t CACHE_LINE = 64;
+
+
+size_t blockBytes(size_t count, size_t block) {
+  return std::min(PointStorage::BLOCK_POINTS, count - (block << PointStorage::BLOCK_SHIFT)) *
+      POINT_STRIDE * sizeof(float);
+}
+
+
+// full blocks are aligned by system allocator, qMallocAligned() reallocates
+// size + alignment bytes, so 2MB block would reserve 4MB; null on failure
+void* allocateFullBlock() {
+#ifdef Q_OS_WIN
+  return _aligned_malloc(BLOCK_BYTES, HUGE_PAGE);
+#else
+  void* data = nullptr;
+  return posix_memalign(&data, HUGE_PAGE, BLOCK_BYTES) == 0 ? data : nullptr;
+#endif
+}
+
+
+void freeFullBlock(void* data) {
+#ifdef Q_OS_WIN
+  _aligned_free(data);
+#else
+  std::free(data);
+#endif
+}
+
+} // namespace
+
+
+// std::min() takes them by reference
+const size_t PointStorage::BLOCK_SHIFT;
+const size_t PointStorage::BLOCK_POINTS;
+
+
+PointStorage::PointStorage()
+  : _count(0),
+    _attached(false)
+{
+}
+
+
+PointStorage::~PointStorage()
+{
+  clear();
+}
+
+
+void PointStorage::allocate(size_t count) {
+  clear();
+  const size_t blocks = (count + BLOCK_POINTS - 1) >> BLOCK_SHIFT;
+  _blocks.reserve(blocks);
+  for (size_t block = 0; block < blocks; ++block) {
+    // last block takes just what's left, small clouds don't pay for whole block
+    const size_t bytes = blockBytes(count, block);
+    void* data = bytes == BLOCK_BYTES ? allocateFullBlock() : qMallocAligned(bytes, CACHE_LINE);
+    if (!data) {
+      // clear() tells full blocks by count
+      _count = count;
+      _blocks.resize(blocks, nullptr);
+      clear();
+      throw std::bad_alloc();
+    }
+#ifdef Q_OS_LINUX
+    if (bytes == BLOCK_BYTES) {
+      madvise(data, bytes, MADV_HUGEPAGE);
+    }
+#endif
+    _blocks.push_back(static_cast<float*>(data));
+  }
+  _count = count;
+}
+
+
+void PointStorage::assign(const float* points, size_t count) {
+  allocate(count);
+  forEachRun(0, count, [points](float* run, size_t first, size_t runCount) {
+    std::memcpy(run, points + first * POINT_STRIDE, runCount * POINT_STRIDE * sizeof(float));
+    return true;
+  });
+}
+
+
+void PointStorage::attach(float* points, size_t count) {
+  clear();
+  // blocks just point into memory given
+  for (size_t first = 0; first < count; first += BLOCK_POINTS) {
+    _blocks.push_back(points + first * POINT_STRIDE);
+  }
+  _count = count;
+  _attached = true;
+}
+
+
+void PointStorage::clear() {
+  if (!_attached) {
+    // tail block is the only one not full
+    for (size_t block = 0; block < _blocks.size(); ++block) {
+      if (!_blocks[block]) {
+        continue;
+      }
+      if (blockBytes(_count, block) == BLOCK_BYTES) {
+        freeFullBlock(_blocks[block]);
+      } else {
+        qFreeAligned(_blocks[block]);
+      }
+    }
+  }
+  _blocks.clear();
+  _count = 0;
+  _attached = false;
+}
+
+
+void PointStorage::swap(PointStorage& other) {
+  _blocks.swap(other._blocks);
+  std::swap(_count, other._count);
+  std::swap(_attached, other._attached);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "plydecoders.h"
+
+#include <vector>
+
+
+//
+// x, y, z, row index points of any count in blocks of BLOCK_POINTS.
+//
+// Every block is own allocation of 2MB aligned to 2MB, so large clouds need
+// no contiguous gigabytes of address space and blocks may go into huge pages.
+// Points are addressed by 64-bit index, they're contiguous within block only,
+// so ranges are walked run by run with forEachRun().
+//
+class PointStorage
+{
+public:
+  static const size_t BLOCK_SHIFT = 17;
+  static const size_t BLOCK_POINTS = size_t(1) << BLOCK_SHIFT;
+
+  PointStorage();
+  ~PointStorage();
+
+  // room for count points, previous ones are dropped; throws std::bad_alloc
+  void allocate(size_t count);
+  void assign(const float* points, size_t count);
+  // use count contiguous points of memory owned elsewhere (mapped file) without copying,
+  // it must outlive storage or next allocate()
+  void attach(float* points, size_t count);
+  void clear();
+  // exchanges points with other storage without copying them
+  void swap(PointStorage& other);
+
+  size_t size() const {return _count;}
+  bool empty() const {return _count == 0;}
+
+  float* point(size_t index) {
+    return _blocks[index >> BLOCK_SHIFT] + (index & (BLOCK_POINTS - 1)) * POINT_STRIDE;
+  }
+  const float* point(size_t index) const {
+    return _blocks[index >> BLOCK_SHIFT] + (index & (BLOCK_POINTS - 1)) * POINT_STRIDE;
+  }
+
+  // call f(points, first, count) for every run of [first, first + count) within single block,
+  // f returns false to stop; false if stopped
+  template <typename F>
+  bool forEachRun(size_t first, size_t count, F f) {
+    while (count > 0) {
+      const size_t run = std::min(count, BLOCK_POINTS - (first & (BLOCK_POINTS - 1)));
+      if (!f(point(first), first, run)) {
+        return false;
+      }
+      first += run;
+      count -= run;
+    }
+    return true;
+  }
+
+  template <typename F>
+  bool forEachRun(size_t first, size_t count, F f) const {
+    while (count > 0) {
+      const size_t run = std::min(count, BLOCK_POINTS - (first & (BLOCK_POINTS - 1)));
+      if (!f(point(first), first, run)) {
+        return false;
+      }
+      first += run;
+      count -= run;
+    }
+    return true;
+  }
+
+
+private:
+  Q_DISABLE_COPY(PointStorage)
+
+  std::vector<float*> _blocks;
+  size_t _count;
+  bool _attached;
+};
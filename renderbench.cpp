@@ -0,0 +1,287 @@
+//
+// Headless rendering benchmark.
+//
+// Loads PLY (or LOD) file into Scene widget shown offscreen, replays camera path
+// and prints frame time percentiles, loading timings and peak memory as JSON.
+// Runs without GPU on offscreen platform plugin with Mesa software rasterizer:
+//
+//   renderbench --point-size 2 --frames 300 cloud.ply > result.json
+//
+// Camera path file has one step per line, "<frames> <command> [args]", command is
+// one of forward, backward, left, right, up, down or "rotate dx dy dz" and applies
+// once per frame, '#' starts comment. Without file camera orbits the cloud and
+// flies through it.
+//
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QTextStream>
+#include <QTimer>
+
+#include "scene.h"
+#include "camera.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+
+namespace {
+
+typedef std::function<void(Camera&)> CameraStep;
+
+// scene is painted while loading so points get uploaded like in viewer
+const int LOAD_PAINT_INTERVAL = 10;
+
+
+CameraStep parseStep(const QStringList& tokens) {
+  const QString command = tokens[1];
+  if (command == "rotate" && tokens.size() == 5) {
+    const int dx = tokens[2].toInt();
+    const int dy = tokens[3].toInt();
+    const int dz = tokens[4].toInt();
+    return [=](Camera& camera) {camera.rotate(dx, dy, dz);};
+  }
+  const std::pair<const char*, void (Camera::*)()> moves[] = {
+    {"forward", &Camera::forward}, {"backward", &Camera::backward}, {"left", &Camera::left},
+    {"right", &Camera::right}, {"up", &Camera::up}, {"down", &Camera::down}
+  };
+  for (const auto& move : moves) {
+    if (command == move.first && tokens.size() == 2) {
+      auto method = move.second;
+      return [=](Camera& camera) {(camera.*method)();};
+    }
+  }
+  throw std::runtime_error("unknown camera step: " + tokens.join(" ").toStdString());
+}
+
+
+// every frame gets own step
+std::vector<CameraStep> readCameraPath(const QString& path) {
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+    throw std::runtime_error("cannot open camera path file");
+  }
+  std::vector<CameraStep> steps;
+  QTextStream stream(&file);
+  while (!stream.atEnd()) {
+    const QString line = stream.readLine().section('#', 0, 0).trimmed();
+    if (line.isEmpty()) {
+      continue;
+    }
+    const QStringList tokens = line.split(' ', QString::SkipEmptyParts);
+    bool ok = false;
+    const int frames = tokens.size() > 1 ? tokens[0].toInt(&ok) : 0;
+    if (!ok || frames < 0) {
+      throw std::runtime_error("malformed camera path line: " + line.toStdString());
+    }
+    steps.insert(steps.end(), frames, parseStep(tokens));
+  }
+  return steps;
+}
+
+
+std::vector<CameraStep> defaultCameraPath() {
+  std::vector<CameraStep> steps;
+  steps.insert(steps.end(), 360, [](Camera& camera) {camera.rotate(0, 1, 0);});
+  steps.insert(steps.end(), 60, [](Camera& camera) {camera.forward();});
+  steps.insert(steps.end(), 60, [](Camera& camera) {camera.backward();});
+  return steps;
+}
+
+
+double percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  const size_t rank = static_cast<size_t>(p / 100 * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+
+double peakRssMb() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.;  // kilobytes on Linux
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+  // no display needed unless platform is chosen explicitly
+  if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+  }
+  QApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Renders points cloud offscreen along camera path and reports timings as JSON.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("file", "PLY or LOD file or directory of PLY tiles to render.");
+  QCommandLineOption pointSizeOption("point-size", "Point size in pixels.", "pixels", "1");
+  QCommandLineOption framesOption("frames", "Frames to render, camera path is repeated or cut to it.", "count", "0");
+  QCommandLineOption sizeOption("size", "Viewport size.", "WxH", "1280x720");
+  QCommandLineOption pathOption("camera-path", "Camera path file.", "file");
+  QCommandLineOption floatOption("float-vertices", "Use 32-bit float vertices instead of compact ones.");
+  QCommandLineOption voxelOption("voxel-size", "Downsample PLY points by voxel grid of that size.", "size", "0");
+  QCommandLineOption rendererOption("renderer", "GL backend, core (falls back to compat without GL 4.4) or compat.",
+                                    "core|compat", "core");
+  parser.addOptions({pointSizeOption, framesOption, sizeOption, pathOption, floatOption, voxelOption, rendererOption});
+  parser.process(app);
+  if (parser.positionalArguments().size() != 1) {
+    parser.showHelp(1);
+  }
+  const QString filePath = parser.positionalArguments()[0];
+  const QStringList size = parser.value(sizeOption).split('x');
+  const int width = size.size() == 2 ? size[0].toInt() : 0;
+  const int height = size.size() == 2 ? size[1].toInt() : 0;
+  const int pointSize = parser.value(pointSizeOption).toInt();
+  const QString backend = parser.value(rendererOption);
+  if (width <= 0 || height <= 0 || pointSize <= 0 || (backend != "core" && backend != "compat")) {
+    parser.showHelp(1);
+  }
+
+  try {
+    std::vector<CameraStep> path = parser.isSet(pathOption) ? readCameraPath(parser.value(pathOption))
+                                                            : defaultCameraPath();
+    const int frames = parser.value(framesOption).toInt();
+    if (frames > 0 && !path.empty()) {
+      std::vector<CameraStep> repeated;
+      for (int i = 0; i < frames; ++i) {
+        repeated.push_back(path[i % path.size()]);
+      }
+      path.swap(repeated);
+    }
+
+    if (parser.isSet(floatOption)) {
+      Scene::setDefaultVertexFormat(Scene::FLOAT_VERTICES);
+    }
+    Scene::setDefaultDownsampling(parser.value(voxelOption).toFloat());
+    Scene::setDefaultRenderer(backend == "compat" ? Scene::COMPATIBILITY_RENDERER : Scene::CORE_RENDERER);
+
+    //
+    // load like viewer does, measuring wall time until points are drawable and indexed
+    //
+    QElapsedTimer loadTimer;
+    loadTimer.start();
+    Scene scene(filePath);
+    QSharedPointer<Camera> camera(new Camera());
+    scene.attachCamera(camera);
+    camera->setFrontCPDistance(-0.0005);
+    camera->setRearCPDistance(1);
+    camera->setPosition(QVector3D(0, -0.1, -0.2));
+    camera->rotate(0, 50, 0);
+    scene.setColorAxisMode(Scene::COLOR_BY_Z);
+    scene.setPointSize(pointSize);
+    scene.resize(width, height);
+    scene.show();
+
+    LoadTimings timings = {0, 0, 0, 0, 0, false};
+    qint64 loadMsecs = 0;
+    qint64 indexMsecs = 0;
+    QString error;
+    QEventLoop loading;
+    QObject::connect(&scene, &Scene::loadFinished, [&](const LoadTimings& t) {
+      timings = t;
+      loadMsecs = loadTimer.elapsed();
+    });
+    QObject::connect(&scene, &Scene::pickIndexBuilt, [&](qint64 msecs) {
+      indexMsecs = msecs;
+      loading.quit();
+    });
+    QObject::connect(&scene, &Scene::loadFailed, [&](const QString& e) {
+      error = e;
+      loading.quit();
+    });
+    QTimer painter;
+    QObject::connect(&painter, &QTimer::timeout, [&scene]() {scene.grabFramebuffer();});
+    painter.start(LOAD_PAINT_INTERVAL);
+    loading.exec();
+    painter.stop();
+    if (!error.isEmpty()) {
+      throw std::runtime_error(error.toStdString());
+    }
+
+    quint64 drawnPoints = 0;
+    QObject::connect(&scene, &Scene::drawStatsChanged, [&](const DrawStats& stats) {
+      drawnPoints += stats.drawnPoints;
+    });
+    QObject::connect(&scene, &Scene::lodStatsChanged, [&](const LodStats& stats) {
+      drawnPoints += stats.drawnPoints;
+    });
+
+    // first frame after indexing uploads points in chunks order
+    scene.grabFramebuffer();
+    drawnPoints = 0;
+
+    //
+    // replay camera path, frame is finished once its pixels are read back
+    //
+    std::vector<double> frameMsecs;
+    for (const auto& step : path) {
+      step(*camera);
+      QElapsedTimer frameTimer;
+      frameTimer.start();
+      scene.grabFramebuffer();
+      frameMsecs.push_back(frameTimer.nsecsElapsed() / 1e6);
+      app.processEvents();
+    }
+
+    scene.makeCurrent();
+    const QString renderer = reinterpret_cast<const char*>(
+          QOpenGLContext::currentContext()->functions()->glGetString(GL_RENDERER));
+    scene.doneCurrent();
+
+    std::vector<double> sorted = frameMsecs;
+    std::sort(sorted.begin(), sorted.end());
+    double total = 0;
+    for (double msecs : frameMsecs) {
+      total += msecs;
+    }
+
+    QJsonObject frameTimes;
+    frameTimes["p50"] = percentile(sorted, 50);
+    frameTimes["p95"] = percentile(sorted, 95);
+    frameTimes["p99"] = percentile(sorted, 99);
+    frameTimes["mean"] = frameMsecs.empty() ? 0 : total / frameMsecs.size();
+    frameTimes["max"] = sorted.empty() ? 0 : sorted.back();
+
+    QJsonObject result;
+    result["file"] = filePath;
+    result["points"] = static_cast<double>(scene.pointsCount());
+    result["keptPoints"] = static_cast<double>(scene.keptPointsCount());
+    result["pointSize"] = pointSize;
+    result["viewport"] = QString("%1x%2").arg(width).arg(height);
+    result["renderer"] = renderer;
+    result["backend"] = scene.renderer() == Scene::CORE_RENDERER ? "core" : "compat";
+    result["vertexFormat"] = parser.isSet(floatOption) ? "float" : "compact";
+    result["frames"] = static_cast<int>(frameMsecs.size());
+    result["frameMs"] = frameTimes;
+    result["drawnPointsPerFrame"] = frameMsecs.empty() ? 0. : double(drawnPoints) / frameMsecs.size();
+    result["loadMs"] = static_cast<double>(loadMsecs);
+    result["headerMs"] = static_cast<double>(timings.header);
+    result["parseMs"] = static_cast<double>(timings.parse);
+    result["uploadMs"] = static_cast<double>(timings.upload);
+    result["downsampleMs"] = static_cast<double>(timings.downsample);
+    result["indexMs"] = static_cast<double>(indexMsecs);
+    result["cacheHit"] = timings.cacheHit;
+    result["peakRssMb"] = peakRssMb();
+    std::cout << QJsonDocument(result).toJson().constData();
+  } catch (const std::exception& e) {
+    std::cerr << "renderbench: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
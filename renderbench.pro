@@ -0,0 +1,51 @@
+# headless rendering benchmark, see renderbench.cpp
+TARGET = renderbench
+
+HEADERS  = scene.h \
+    plyloader.h \
+    plyheader.h \
+    gzipreader.h \
+    plydecoders.h \
+    pointstorage.h \
+    pointcache.h \
+    voxelgrid.h \
+    tileset.h \
+    pointindex.h \
+    pointselection.h \
+    zhistogram.h \
+    pointbudget.h \
+    lodoctree.h \
+    camera.h \
+    framescheduler.h \
+    overlay.h \
+    indirectdraw.h
+SOURCES  = renderbench.cpp \
+    scene.cpp \
+    plyloader.cpp \
+    plyheader.cpp \
+    gzipreader.cpp \
+    plydecoders.cpp \
+    pointstorage.cpp \
+    pointcache.cpp \
+    voxelgrid.cpp \
+    tileset.cpp \
+    pointindex.cpp \
+    pointselection.cpp \
+    zhistogram.cpp \
+    pointbudget.cpp \
+    lodoctree.cpp \
+    camera.cpp \
+    framescheduler.cpp \
+    overlay.cpp \
+    indirectdraw.cpp
+
+QT += widgets concurrent
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+# system zlib, one bundled with Qt has no public headers
+LIBS += -lz
+
+RESOURCES += \
+    resources.qrc
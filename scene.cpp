@@ -1,107 +1,949 @@
 #include "scene.h"
+#include "plywriter.h"
 
 #include <QMouseEvent>
 #include <QOpenGLShaderProgram>
 #include <QCoreApplication>
 #include <QScopedPointer>
+#include <QElapsedTimer>
+#include <QtConcurrent>
+#include <QFile>
+#include <QFileInfo>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLContext>
+#include <QOffscreenSurface>
+#include <QSurfaceFormat>
+#include <QPainter>
 
 #include <cmath>
 #include <cassert>
-#include <iostream>
-#include <fstream>
-#include <string>
-#include <sstream>
+#include <algorithm>
 #include <limits>
 
-const size_t POINT_STRIDE = 4; // x, y, z, index
 
-Scene::Scene(const QString& plyFilePath, QWidget* parent)
+namespace {
+
+// how far from cursor measuring tool looks for points, in pixels
+const int PICK_RADIUS = 10;
+
+// points of chunk culled as a whole
+const size_t CHUNK_POINTS = 1 << 16;
+
+// out-of-core view defaults
+const size_t DEFAULT_LOD_GPU_BUDGET = size_t(512) << 20;
+// bytes of LOD nodes or tiles sent to GPU per frame, rest waits for next frames
+const size_t LOD_UPLOAD_BYTES_PER_FRAME = 32 << 20;
+
+// frames of GPU timer queries in flight, results are read when their monitor comes round
+const size_t TIME_MONITORS = 3;
+const qint64 FPS_INTERVAL = 1000;
+
+const float FRAME_AXIS_LENGTH = 0.05;
+const QColor PICKED_COLOR(255, 255, 0);
+const QColor HIGHLIGHT_COLOR(0, 255, 255);
+const QColor SELECTION_COLOR(255, 128, 0);
+
+// rotation inertia: drags paused longer than that don't spin, speed decays exponentially
+// per second and spin stops below minimal speed, degrees per second
+const qint64 INERTIA_RELEASE_MSECS = 50;
+const float INERTIA_DECAY = 4;
+const float INERTIA_MIN_SPEED = 5;
+
+// Z steps of color ramp texture and fraction of drawn points clipped at either end by percentile stretch
+const int Z_RAMP_SIZE = 256;
+const double PERCENTILE_CLIP = 0.02;
+
+// unsigned shorts of compact vertex: x, y, z, row
+const size_t COMPACT_STRIDE = 4;
+const float COMPACT_MAX = 65535;
+// chunks shuffled by thread pool at once before their upload
+const size_t SHUFFLE_BATCH_CHUNKS = 64;
+
+// context asked for by core renderer, indirect draws are GL 4.3 and persistent mapping GL 4.4
+const int CORE_MAJOR_VERSION = 4;
+const int CORE_MINOR_VERSION = 4;
+// attributes of chunk bounds in core shaders, vertex and row are 0 and 1
+const GLuint CHUNK_MIN_ATTRIBUTE = 2;
+const GLuint CHUNK_SIZE_ATTRIBUTE = 3;
+
+Scene::VertexFormat defaultVertexFormat = Scene::COMPACT_VERTICES;
+float defaultVoxelSize = 0;
+VoxelGrid::Mode defaultVoxelMode = VoxelGrid::CENTROID;
+
+
+// quantize x, y, z of points relative to chunk bounds and rows relative to rows count,
+// vertex shader maps them back with chunk bounds
+void packCompactPoints(const float* points, size_t count, const PointChunk& chunk, size_t rowsCount, GLushort* out) {
+  float scale[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    const float size = chunk.max[axis] - chunk.min[axis];
+    scale[axis] = size > 0 ? COMPACT_MAX / size : 0;
+  }
+  const float rowScale = COMPACT_MAX / std::max<size_t>(rowsCount, 1);
+  for (size_t i = 0; i < count; ++i, points += POINT_STRIDE, out += COMPACT_STRIDE) {
+    for (int axis = 0; axis < 3; ++axis) {
+      const float q = (points[axis] - chunk.min[axis]) * scale[axis] + 0.5f;
+      out[axis] = static_cast<GLushort>(std::max(0.f, std::min(COMPACT_MAX, q)));
+    }
+    out[3] = static_cast<GLushort>(std::min(COMPACT_MAX, points[3] * rowScale + 0.5f));
+  }
+}
+
+
+// vertices of chunk in shuffled order of point budget, floats or compact ones
+void shuffleVertices(const PointStorage& points, const PointChunk& chunk, bool compact, size_t rowsCount,
+                     std::vector<char>& out) {
+  std::vector<float> shuffled(chunk.count * POINT_STRIDE);
+  const size_t stride = PointBudget::shuffleStride(chunk.count);
+  size_t index = 0;
+  for (size_t position = 0; position < chunk.count; ++position) {
+    const float* p = points.point(chunk.first + index);
+    std::copy(p, p + POINT_STRIDE, shuffled.begin() + position * POINT_STRIDE);
+    index += stride;
+    if (index >= chunk.count) {
+      index -= chunk.count;
+    }
+  }
+  if (compact) {
+    out.resize(chunk.count * COMPACT_STRIDE * sizeof(GLushort));
+    packCompactPoints(shuffled.data(), chunk.count, chunk, rowsCount, reinterpret_cast<GLushort*>(out.data()));
+  } else {
+    out.resize(shuffled.size() * sizeof(float));
+    std::copy(shuffled.begin(), shuffled.end(), reinterpret_cast<float*>(out.data()));
+  }
+}
+
+
+// leading points of shuffled chunk making given fraction of it
+size_t slicePoints(size_t count, double fraction) {
+  return std::min(count, static_cast<size_t>(std::ceil(count * fraction)));
+}
+
+
+// bounds float vertices are drawn with, they aren't scaled
+PointChunk unitChunk() {
+  PointChunk chunk;
+  chunk.first = 0;
+  chunk.count = 0;
+  std::fill(chunk.min, chunk.min + 3, 0.f);
+  std::fill(chunk.max, chunk.max + 3, 1.f);
+  return chunk;
+}
+
+
+// shader file of renderer
+QString shaderPath(const char* name, bool core) {
+  return QString(core ? ":/core_%1.glsl" : ":/%1.glsl").arg(name);
+}
+
+
+// compatibility shader source of GLSL 1.20 file, raised to 1.30 with CLIP_DISTANCES defined
+QByteArray compatShaderSource(const QString& path, bool clipDistances) {
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return QByteArray();
+  }
+  QByteArray source = file.readAll();
+  if (clipDistances) {
+    source.replace("#version 120\n", "#version 130\n#define CLIP_DISTANCES\n");
+  }
+  return source;
+}
+
+
+QSurfaceFormat coreFormat() {
+  QSurfaceFormat format = QSurfaceFormat::defaultFormat();
+  format.setVersion(CORE_MAJOR_VERSION, CORE_MINOR_VERSION);
+  format.setProfile(QSurfaceFormat::CoreProfile);
+  return format;
+}
+
+
+// LOD node cube as chunk of its own vertex buffer
+PointChunk nodeChunk(const LodNode& node) {
+  PointChunk chunk;
+  chunk.first = 0;
+  chunk.count = node.count;
+  for (int axis = 0; axis < 3; ++axis) {
+    chunk.min[axis] = node.min[axis];
+    chunk.max[axis] = node.min[axis] + node.size;
+  }
+  return chunk;
+}
+
+
+// tile is quantized and culled as a whole
+PointChunk tileChunk(const Tile& tile) {
+  PointChunk chunk;
+  chunk.first = 0;
+  chunk.count = tile.points.size();
+  for (int axis = 0; axis < 3; ++axis) {
+    chunk.min[axis] = tile.boundMin[axis];
+    chunk.max[axis] = tile.boundMax[axis];
+  }
+  return chunk;
+}
+
+
+// whether box may be seen: it isn't entirely behind any side of view frustum or any
+// of clipping planes. Clipping planes are tested on clip coordinates, as fixed pipeline
+// applies them there when vertex shader doesn't write gl_ClipVertex.
+bool isBoxVisible(const QMatrix4x4& viewMatrix, const float* min, const float* max, const CameraState& camera) {
+  const float* m = viewMatrix.constData();
+  const float rear = static_cast<float>(camera.rearClippingDistance);
+  const float front = static_cast<float>(camera.frontClippingDistance);
+  const float planes[][4] = {
+    {1, 0, 0, 1}, {-1, 0, 0, 1}, {0, 1, 0, 1}, {0, -1, 0, 1}, {0, 0, 1, 1}, {0, 0, -1, 1},
+    {0, 0, -1, rear}, {0, 0, 1, front}
+  };
+  float clip[8][4];
+  for (int corner = 0; corner < 8; ++corner) {
+    const float x = (corner & 1) ? max[0] : min[0];
+    const float y = (corner & 2) ? max[1] : min[1];
+    const float z = (corner & 4) ? max[2] : min[2];
+    for (int i = 0; i < 4; ++i) {
+      clip[corner][i] = m[i] * x + m[4 + i] * y + m[8 + i] * z + m[12 + i];
+    }
+  }
+  for (const auto& plane : planes) {
+    int outside = 0;
+    for (int corner = 0; corner < 8; ++corner) {
+      const float* c = clip[corner];
+      outside += (plane[0] * c[0] + plane[1] * c[1] + plane[2] * c[2] + plane[3] * c[3] < 0);
+    }
+    if (outside == 8) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+
+const char* FrameStats::phaseName(int phase)
+{
+  static const char* names[PHASES_COUNT] = {"points", "overlay", "labels"};
+  return names[phase];
+}
+
+
+void Scene::setDefaultVertexFormat(VertexFormat format)
+{
+  defaultVertexFormat = format;
+}
+
+
+void Scene::setDefaultDownsampling(float voxelSize, VoxelGrid::Mode mode)
+{
+  defaultVoxelSize = voxelSize;
+  defaultVoxelMode = mode;
+}
+
+
+bool Scene::setDefaultRenderer(Renderer renderer)
+{
+  QSurfaceFormat format = QSurfaceFormat::defaultFormat();
+  if (renderer == COMPATIBILITY_RENDERER) {
+    format.setVersion(2, 0);
+    format.setProfile(QSurfaceFormat::NoProfile);
+    QSurfaceFormat::setDefaultFormat(format);
+    return true;
+  }
+
+  // probe context first, drivers without GL 4.4 core profile keep compatibility one
+  // rather than getting core context of lower version neither renderer works with
+  format = coreFormat();
+  QOffscreenSurface surface;
+  surface.setFormat(format);
+  surface.create();
+  QOpenGLContext context;
+  context.setFormat(format);
+  if (!context.create() || !context.makeCurrent(&surface)) {
+    return false;
+  }
+  const QSurfaceFormat created = context.format();
+  const bool available = created.profile() == QSurfaceFormat::CoreProfile &&
+      (created.majorVersion() > CORE_MAJOR_VERSION ||
+       (created.majorVersion() == CORE_MAJOR_VERSION && created.minorVersion() >= CORE_MINOR_VERSION)) &&
+      context.versionFunctions<QOpenGLFunctions_4_4_Core>() != nullptr;
+  context.doneCurrent();
+  if (available) {
+    // default format, so widget's context and one of window composing it share profile
+    QSurfaceFormat::setDefaultFormat(format);
+  }
+  return available;
+}
+
+
+Scene::Scene(const QString& filePath, QWidget* parent)
+  : Scene(QStringList() << filePath, parent)
+{
+}
+
+
+Scene::Scene(const QStringList& filePaths, QWidget* parent)
   : QOpenGLWidget(parent),
     _pointSize(1),
-    _colorMode(COLOR_BY_Z)
+    _colorMode(COLOR_BY_Z),
+    _frameScheduler(this),
+    _compactVertices(defaultVertexFormat == COMPACT_VERTICES),
+    _core(nullptr),
+    _chunkBoundsBuffer(0),
+    _voxelGrid(defaultVoxelSize, defaultVoxelMode)
 {
   _pickpointEnabled = false;
-  _loadPLY(plyFilePath);
+  _selectionEnabled = false;
+  _selectionQueued = false;
+  _zHistogramReady = false;
+  _colorStretch = ZHistogram::LINEAR_STRETCH;
+  _zRampTexture = 0;
+  _zRampDirty = true;
+  _zRampMin = 0;
+  _zRampMax = 0;
+  _zRampVersion = 0;
+  _pointIndexReady = false;
+  _chunksUploaded = false;
+  _uploadedChunks = 0;
+  _indexFromCache = false;
+  _cacheWriteCanceled.store(0);
+  _gpuPickAvailable = false;
+  _clipDistances = false;
+  _loadedPointsCount = 0;
+  _loadReported = false;
+  _uploadNsecs = 0;
+  _bufferPoints = 0;
+  _downsampled = false;
+  _lodGpuBytes = 0;
+  _lodGpuBudget = DEFAULT_LOD_GPU_BUDGET;
+  _frame = 0;
+  _timeMonitor = nullptr;
+  _fpsFrames = 0;
+  _frameStats.frame = 0;
+  _frameStats.submittedPoints = 0;
+  _frameStats.pointBudget = 0;
+  _refining = false;
+  _refinedFraction = 0;
+  std::fill(_viewport, _viewport + 4, 0);
+  _frameStats.fps = 0;
+  for (int phase = 0; phase < FrameStats::PHASES_COUNT; ++phase) {
+    _frameStats.cpuUsecs[phase] = 0;
+    _frameStats.gpuUsecs[phase] = -1;
+  }
+
+  // loaded pieces and tiles grow bounds from empty box
+  const float huge = std::numeric_limits<float>::max();
+  _pointsBoundMin = QVector3D(huge, huge, huge);
+  _pointsBoundMax = -_pointsBoundMin;
+
+  const QString filePath = filePaths.value(0);
+  if (filePaths.size() == 1 && QFileInfo(filePath).suffix().toLower() == "lod") {
+    // stream nodes needed by view, hierarchy has bounds of whole cloud
+    _lodOpenTimer.start();
+    _lod.reset(new LodOctree(filePath));
+    _pointsCount = _lod->pointsCount();
+    _pointsBoundMin = _lod->boundMin();
+    _pointsBoundMax = _lod->boundMax();
+    connect(_lod.data(), &LodOctree::nodesLoaded, this, [this]() {update();});
+  } else if (filePaths.size() != 1 || QFileInfo(filePath).isDir()) {
+    // tiles are loaded by thread pool and shown one by one as they're done
+    _tiles.reset(new TileSet(TileSet::tileFiles(filePaths)));
+    _tiles->setDownsampling(_voxelGrid);
+    _pointsCount = _tiles->pointsCount();
+    _tileBuffers.resize(_tiles->tilesCount());
+    connect(_tiles.data(), &TileSet::tileLoaded, this, &Scene::_onTileLoaded);
+    connect(_tiles.data(), &TileSet::finished, this, [this]() {
+      _startZHistogram();
+      update();
+    });
+    connect(_tiles.data(), &TileSet::failed, this, &Scene::loadFailed);
+    _tiles->start();
+  } else {
+    // parse header right away so wrong files fail here,
+    // vertices are loaded in background and shown as they arrive
+    _loader.reset(new PlyLoader(filePath, true));
+    _pointsCount = _loader->pointsCount();
+    connect(_loader.data(), &PlyLoader::pointsLoaded, this, &Scene::_onPointsLoaded);
+    connect(_loader.data(), &PlyLoader::finished, this, [this]() {
+      if (_voxelGrid.voxelSize() > 0) {
+        _startDownsampling();
+      }
+      update();
+    });
+    connect(_loader.data(), &PlyLoader::failed, this, &Scene::loadFailed);
+    connect(&_downsampleWatcher, &QFutureWatcher<qint64>::finished, this, &Scene::_onPointsDownsampled);
+    connect(&_pointIndexWatcher, &QFutureWatcher<qint64>::finished, this, &Scene::_onPointIndexBuilt);
+    _loader->start();
+  }
+  connect(&_selectionWatcher, &QFutureWatcher<SelectionStats>::finished, this, &Scene::_onSelectionQueried);
+  connect(&_zHistogramWatcher, &QFutureWatcher<void>::finished, this, &Scene::_onZHistogramBuilt);
+  connect(&_exportWatcher, &QFutureWatcher<ExportResult>::finished, this, [this]() {
+    emit exportFinished(_exportWatcher.result());
+  });
   setMouseTracking(true);
+  connect(&_frameScheduler, &FrameScheduler::tick, this, &Scene::_onFrameTick);
 
   // make trivial axes cross
-  _axesLines.push_back(std::make_pair(QVector3D(0.0, 0.0, 0.0), QColor(1.0, 0.0, 0.0)));
-  _axesLines.push_back(std::make_pair(QVector3D(1.0, 0.0, 0.0), QColor(1.0, 0.0, 0.0)));
-  _axesLines.push_back(std::make_pair(QVector3D(0.0, 0.0, 0.0), QColor(0.0, 1.0, 0.0)));
-  _axesLines.push_back(std::make_pair(QVector3D(0.0, 1.0, 0.0), QColor(0.0, 1.0, 0.0)));
-  _axesLines.push_back(std::make_pair(QVector3D(0.0, 0.0, 0.0), QColor(0.0, 0.0, 1.0)));
-  _axesLines.push_back(std::make_pair(QVector3D(0.0, 0.0, 1.0), QColor(0.0, 0.0, 1.0)));
+  _overlay.addPolyline({QVector3D(0, 0, 0), QVector3D(FRAME_AXIS_LENGTH, 0, 0)}, Qt::red);
+  _overlay.addPolyline({QVector3D(0, 0, 0), QVector3D(0, FRAME_AXIS_LENGTH, 0)}, Qt::green);
+  _overlay.addPolyline({QVector3D(0, 0, 0), QVector3D(0, 0, FRAME_AXIS_LENGTH)}, Qt::blue);
+  _highlightMarker = 0;
 
 }
 
 
-void Scene::_loadPLY(const QString& plyFilePath) {
+Scene::~Scene()
+{
+  // waits for cache write too
+  cancelLoading();
+  _downsampleWatcher.waitForFinished();
+  _pointIndexWatcher.waitForFinished();
+  _selectionWatcher.waitForFinished();
+  _zHistogramWatcher.waitForFinished();
+  _exportWatcher.waitForFinished();
+  _cleanup();
+}
 
-  // open stream
-  std::fstream is;
-  is.open(plyFilePath.toStdString().c_str(), std::fstream::in);
 
-  // ensure format with magic header
-  std::string line;
-  std::getline(is, line);
-  if (line != "ply") {
-    throw std::runtime_error("not a ply file");
+const double* Scene::pointsOrigin() const
+{
+  if (_lod) {
+    return _lod->origin();
   }
+  return _tiles ? _tiles->origin() : _loader->origin();
+}
 
-  // parse header looking only for 'element vertex' section size
-  _pointsCount = 0;
-  while (is.good()) {
-    std::getline(is, line);
-    if (line == "end_header") {
-      break;
+
+size_t Scene::keptPointsCount() const
+{
+  if (_tiles && _tiles->isFinished()) {
+    size_t kept = 0;
+    for (int index = 0; index < _tiles->tilesCount(); ++index) {
+      kept += _tiles->tile(index).points.size();
+    }
+    return kept;
+  }
+  return _downsampled ? _loader->points().size() : _pointsCount;
+}
+
+
+void Scene::cancelLoading()
+{
+  if (_loader) {
+    _loader->cancel();
+  }
+  if (_lod) {
+    _lod->cancel();
+  }
+  if (_tiles) {
+    _tiles->cancel();
+  }
+  // half written cache is discarded, points may go away once it's done
+  _cacheWriteCanceled.store(1);
+  _cacheWriteWatcher.waitForFinished();
+}
+
+
+void Scene::setTargetFps(double fps)
+{
+  _pointBudget.setTargetFps(fps);
+  _refineView.clear();
+  update();
+}
+
+
+void Scene::setLodMemoryBudget(size_t ramBytes, size_t gpuBytes)
+{
+  if (_lod) {
+    _lod->setMemoryBudget(ramBytes);
+  }
+  _lodGpuBudget = gpuBytes;
+  update();
+}
+
+
+void Scene::_onPointsLoaded(qulonglong first, qulonglong count,
+                            const QVector3D& boundMin, const QVector3D& boundMax)
+{
+  PointChunk chunk;
+  chunk.first = first;
+  chunk.count = count;
+  for (int axis = 0; axis < 3; ++axis) {
+    chunk.min[axis] = boundMin[axis];
+    chunk.max[axis] = boundMax[axis];
+  }
+  // with downsampling nothing is drawn until reduced points replace loaded ones
+  if (_voxelGrid.voxelSize() <= 0) {
+    _pendingChunks.push_back(chunk);
+  }
+  _loadedPointsCount += count;
+
+  // update bounds
+  _pointsBoundMax[0] = std::max(boundMax[0], _pointsBoundMax[0]);
+  _pointsBoundMax[1] = std::max(boundMax[1], _pointsBoundMax[1]);
+  _pointsBoundMax[2] = std::max(boundMax[2], _pointsBoundMax[2]);
+  _pointsBoundMin[0] = std::min(boundMin[0], _pointsBoundMin[0]);
+  _pointsBoundMin[1] = std::min(boundMin[1], _pointsBoundMin[1]);
+  _pointsBoundMin[2] = std::min(boundMin[2], _pointsBoundMin[2]);
+
+  emit loadProgress(_pointsCount ? static_cast<int>(100 * _loadedPointsCount / _pointsCount) : 100);
+  update();
+}
+
+
+void Scene::_onTileLoaded(int index)
+{
+  const Tile& tile = _tiles->tile(index);
+  _loadedPointsCount += tile.pointsCount;
+  if (!tile.points.empty()) {
+    _pendingTiles.push_back(index);
+    _addSelectionPoints(tile.points, std::vector<PointChunk>());
+    for (int axis = 0; axis < 3; ++axis) {
+      _pointsBoundMin[axis] = std::min(tile.boundMin[axis], _pointsBoundMin[axis]);
+      _pointsBoundMax[axis] = std::max(tile.boundMax[axis], _pointsBoundMax[axis]);
+    }
+  }
+  emit loadProgress(_pointsCount ? static_cast<int>(100 * _loadedPointsCount / _pointsCount) : 100);
+  update();
+}
+
+
+void Scene::_startDownsampling()
+{
+  // within bounds of all loaded points, reduced ones take place of them
+  _downsampleWatcher.setFuture(QtConcurrent::run([this]() {
+    QElapsedTimer downsampleTimer;
+    downsampleTimer.start();
+    try {
+      PointStorage reduced;
+      _voxelGrid.downsample(_loader->points(), _pointsBoundMin, _pointsBoundMax, reduced);
+      _loader->points().swap(reduced);
+    } catch (const std::exception& e) {
+      _downsampleError = QString::fromLocal8Bit(e.what());
+    }
+    return downsampleTimer.elapsed();
+  }));
+}
+
+
+void Scene::_onPointsDownsampled()
+{
+  if (!_downsampleError.isEmpty()) {
+    emit loadFailed(tr("Cannot downsample points: %1").arg(_downsampleError));
+    return;
+  }
+  _downsampled = true;
+  PointChunk chunk;
+  chunk.first = 0;
+  chunk.count = _loader->points().size();
+  for (int axis = 0; axis < 3; ++axis) {
+    chunk.min[axis] = _pointsBoundMin[axis];
+    chunk.max[axis] = _pointsBoundMax[axis];
+  }
+  if (chunk.count > 0) {
+    _pendingChunks.push_back(chunk);
+  }
+  update();
+}
+
+
+void Scene::_startIndexing()
+{
+  // index points for measuring tool and reorder them into spatial chunks without blocking UI,
+  // all points are in vertex buffer already, so it's drawn meanwhile
+  _pointIndexWatcher.setFuture(QtConcurrent::run([this]() {
+    QElapsedTimer buildTimer;
+    buildTimer.start();
+    // cached points are in tree order already, tree and chunks come with them;
+    // downsampled ones are neither taken from cache nor written to it
+    _indexFromCache = !_downsampled && _loader->isCacheHit() &&
+        _pointIndex.restore(_loader->points(), _loader->cache().indexData(), _loader->cache().indexBytes());
+    if (_indexFromCache) {
+      _chunks = _loader->cache().chunks();
     } else {
-      std::stringstream ss(line);
-      std::string tag1, tag2, tag3;
-      ss >> tag1 >> tag2 >> tag3;
-      if (tag1 == "element" && tag2 == "vertex") {
-        _pointsCount = std::atof(tag3.c_str());
-      }
+      _pointIndex.build(_loader->points());
+      _pointIndex.reorder(_loader->points());
+      _chunks = _pointIndex.chunks(CHUNK_POINTS);
     }
+    _packShuffledVertices();
+    return buildTimer.elapsed();
+  }));
+}
+
+
+void Scene::_packShuffledVertices()
+{
+  // by thread pool, paintGL just uploads them
+  std::vector<std::vector<char> > packed(_chunks.size());
+  std::vector<size_t> indices(_chunks.size());
+  for (size_t i = 0; i < indices.size(); ++i) {
+    indices[i] = i;
   }
+  QtConcurrent::blockingMap(indices, [&](size_t index) {
+    shuffleVertices(_loader->points(), _chunks[index], _compactVertices, _pointsCount, packed[index]);
+  });
+  _shuffledVertices.swap(packed);
+}
 
-  // read and parse 'element vertex' section
-  if (_pointsCount > 0) {
-    _pointsData.resize(_pointsCount * POINT_STRIDE);
 
-    std::stringstream ss;
-    std::string line;
-    float *p = _pointsData.data();
-    for (size_t i = 0; is.good() && i < _pointsCount; ++i) {
-      std::getline(is, line);
-      ss.str(line);
-      float x, y, z;
-      ss >> x >> y >> z;
+void Scene::_startCacheWrite()
+{
+  // next open maps points instead of parsing them; points, chunks and tree stay
+  // as they are from now on, so they're read while index is already in use
+  const QVector3D boundMin = _pointsBoundMin;
+  const QVector3D boundMax = _pointsBoundMax;
+  _cacheWriteWatcher.setFuture(QtConcurrent::run([this, boundMin, boundMax]() {
+    return PointCache::write(_loader->filePath(), _loader->points(), _loader->origin(),
+                             boundMin, boundMax, _chunks, _pointIndex, &_cacheWriteCanceled);
+  }));
+}
 
-      *p++ = x;
-      *p++ = y;
-      *p++ = z;
-      *p++ = i;
 
-      // update bounds
-      _pointsBoundMax[0] = std::max(x, _pointsBoundMax[0]);
-      _pointsBoundMax[1] = std::max(y, _pointsBoundMax[1]);
-      _pointsBoundMax[2] = std::max(z, _pointsBoundMax[2]);
-      _pointsBoundMin[0] = std::min(x, _pointsBoundMin[0]);
-      _pointsBoundMin[1] = std::min(y, _pointsBoundMin[1]);
-      _pointsBoundMin[2] = std::min(z, _pointsBoundMin[2]);
+void Scene::_onPointIndexBuilt()
+{
+  _pointIndexReady = true;
+  // cached points are in chunks order already, but not shuffled
+  _chunksUploaded = false;
+  _uploadedChunks = 0;
+  // points are in place for good, selection skips chunks of index
+  _addSelectionPoints(_loader->points(), _chunks);
+  emit pickIndexBuilt(_pointIndexWatcher.result());
+  if (!_indexFromCache && !_downsampled) {
+    _startCacheWrite();
+  }
+  _startZHistogram();
+  update();
+}
+
+
+void Scene::_startZHistogram()
+{
+  // points stay in place from now on, chunks of index or whole tiles are chunks of histogram
+  _zHistogram.clear();
+  if (_tiles) {
+    for (int index = 0; index < _tiles->tilesCount(); ++index) {
+      const Tile& tile = _tiles->tile(index);
+      _zHistogram.addPoints(tile.points, {tileChunk(tile)});
     }
+  } else {
+    _zHistogram.addPoints(_loader->points(), _chunks);
+  }
+  _zHistogramWatcher.setFuture(QtConcurrent::run([this]() {
+    _zHistogram.build();
+  }));
+}
+
+
+void Scene::_onZHistogramBuilt()
+{
+  _zHistogramReady = true;
+  // bounds of loaded pieces are exact too, but not of downsampled points
+  _pointsBoundMin = _zHistogram.boundMin();
+  _pointsBoundMax = _zHistogram.boundMax();
+  _zRampDirty = true;
+  update();
+}
 
-    // check if we've got exact number of points mentioned in header
-    if (p - _pointsData.data() < _pointsData.size()) {
-      throw std::runtime_error("broken ply file");
+
+DrawStats Scene::_drawChunks(const QMatrix4x4& viewMatrix, const CameraState& camera)
+{
+  if (_core && !_chunkBoundsBuffer) {
+    // context was made again
+    _writeChunkBounds();
+  }
+  _cullChunks(viewMatrix, camera, _drawnChunks);
+  quint64 visiblePoints = 0;
+  for (int index : _drawnChunks) {
+    visiblePoints += _chunks[index].count;
+  }
+  const auto slice = _refineSlice(viewMatrix, camera, _drawnChunks, visiblePoints);
+  return _submitChunks(*_shaders, _drawnChunks, slice.first, slice.second);
+}
+
+
+void Scene::_cullChunks(const QMatrix4x4& viewMatrix, const CameraState& camera, std::vector<int>& visible) const
+{
+  visible.clear();
+  for (size_t index = 0; index < _chunks.size(); ++index) {
+    const PointChunk& chunk = _chunks[index];
+    if (isBoxVisible(viewMatrix, chunk.min, chunk.max, camera)) {
+      visible.push_back(static_cast<int>(index));
     }
   }
 }
 
 
-Scene::~Scene()
+DrawStats Scene::_submitChunks(QOpenGLShaderProgram& program, const std::vector<int>& visible,
+                               double fromFraction, double toFraction)
 {
-  _cleanup();
+  // submit same slice of shuffled order of every visible chunk, core renderer sends them
+  // all with single indirect draw, otherwise neighbours in buffer go with single call
+  // unless they're compact or sliced
+  DrawStats stats = {static_cast<int>(_chunks.size()), static_cast<int>(visible.size()), 0};
+  size_t runFirst = 0;
+  size_t runCount = 0;
+  if (_core) {
+    _indirectDraw.begin(visible.size());
+  }
+  for (int index : visible) {
+    const PointChunk& chunk = _chunks[index];
+    const size_t sliceFirst = chunk.first + slicePoints(chunk.count, fromFraction);
+    const size_t sliceCount = chunk.first + slicePoints(chunk.count, toFraction) - sliceFirst;
+    if (sliceCount == 0) {
+      continue;
+    }
+    stats.drawnPoints += sliceCount;
+    if (_core) {
+      _indirectDraw.add(sliceFirst, sliceCount, index);
+      continue;
+    }
+    if (_compactVertices) {
+      _setChunkBounds(program, chunk);
+      glDrawArrays(GL_POINTS, sliceFirst, sliceCount);
+      continue;
+    }
+    if (runCount > 0 && runFirst + runCount != sliceFirst) {
+      glDrawArrays(GL_POINTS, runFirst, runCount);
+      runCount = 0;
+    }
+    if (runCount == 0) {
+      runFirst = sliceFirst;
+    }
+    runCount += sliceCount;
+  }
+  if (runCount > 0) {
+    glDrawArrays(GL_POINTS, runFirst, runCount);
+  }
+
+  if (_core) {
+    // bounds arrays are on just for indirect draw, other draws set them as constants
+    if (_compactVertices) {
+      _core->glEnableVertexAttribArray(CHUNK_MIN_ATTRIBUTE);
+      _core->glEnableVertexAttribArray(CHUNK_SIZE_ATTRIBUTE);
+    }
+    _indirectDraw.draw(GL_POINTS);
+    if (_compactVertices) {
+      _core->glDisableVertexAttribArray(CHUNK_MIN_ATTRIBUTE);
+      _core->glDisableVertexAttribArray(CHUNK_SIZE_ATTRIBUTE);
+    }
+  }
+  return stats;
+}
+
+
+size_t Scene::_vertexBytes() const
+{
+  return _compactVertices ? COMPACT_STRIDE * sizeof(GLushort) : POINT_STRIDE * sizeof(GLfloat);
+}
+
+
+void Scene::_setVertexAttributes()
+{
+  // for vertex buffer bound
+  if (_compactVertices) {
+    const GLsizei stride = COMPACT_STRIDE * sizeof(GLushort);
+    glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, 0);
+    glVertexAttribPointer(1, 1, GL_UNSIGNED_SHORT, GL_TRUE, stride, reinterpret_cast<void *>(3 * sizeof(GLushort)));
+  } else {
+    const GLsizei stride = POINT_STRIDE * sizeof(GLfloat);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, 0);
+    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<void *>(3 * sizeof(GLfloat)));
+  }
+}
+
+
+void Scene::_setChunkBounds(QOpenGLShaderProgram& program, const PointChunk& chunk)
+{
+  const QVector3D min(chunk.min[0], chunk.min[1], chunk.min[2]);
+  const QVector3D size(chunk.max[0] - chunk.min[0], chunk.max[1] - chunk.min[1], chunk.max[2] - chunk.min[2]);
+  if (_core) {
+    // constant attributes while their arrays are off
+    _core->glVertexAttrib3f(CHUNK_MIN_ATTRIBUTE, min.x(), min.y(), min.z());
+    _core->glVertexAttrib3f(CHUNK_SIZE_ATTRIBUTE, size.x(), size.y(), size.z());
+  } else {
+    program.setUniformValue("chunkMin", min);
+    program.setUniformValue("chunkSize", size);
+  }
+}
+
+
+void Scene::_writeChunkBounds()
+{
+  // min and size of every chunk, instanced arrays of vertex array object read them
+  // at base instance of indirect command, which is index of chunk
+  std::vector<GLfloat> bounds(_chunks.size() * 6);
+  for (size_t index = 0; index < _chunks.size(); ++index) {
+    const PointChunk& chunk = _chunks[index];
+    for (int axis = 0; axis < 3; ++axis) {
+      bounds[index * 6 + axis] = chunk.min[axis];
+      bounds[index * 6 + 3 + axis] = chunk.max[axis] - chunk.min[axis];
+    }
+  }
+  if (!_chunkBoundsBuffer) {
+    glGenBuffers(1, &_chunkBoundsBuffer);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, _chunkBoundsBuffer);
+  glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(bounds.size() * sizeof(GLfloat)), bounds.data(), GL_STATIC_DRAW);
+  const GLsizei stride = 6 * sizeof(GLfloat);
+  glVertexAttribPointer(CHUNK_MIN_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, stride, 0);
+  glVertexAttribPointer(CHUNK_SIZE_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<void *>(3 * sizeof(GLfloat)));
+  _core->glVertexAttribDivisor(CHUNK_MIN_ATTRIBUTE, 1);
+  _core->glVertexAttribDivisor(CHUNK_SIZE_ATTRIBUTE, 1);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+void Scene::_uploadShuffledChunks()
+{
+  // chunks are small, so their compact positions are finer than ones of loaded pieces;
+  // they go few at a time like tiles, buffer in load order is drawn meanwhile
+  QElapsedTimer uploadTimer;
+  uploadTimer.start();
+  if (!_chunksBuffer.isCreated()) {
+    _chunksBuffer.create();
+    _chunksBuffer.bind();
+    glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(_loader->points().size() * _vertexBytes()),
+                 nullptr, GL_STATIC_DRAW);
+  } else {
+    _chunksBuffer.bind();
+  }
+  size_t uploaded = 0;
+  std::vector<char> repacked;
+  for (; _uploadedChunks < _chunks.size() && uploaded < LOD_UPLOAD_BYTES_PER_FRAME; ++_uploadedChunks) {
+    const PointChunk& chunk = _chunks[_uploadedChunks];
+    std::vector<char>& vertices = _uploadedChunks < _shuffledVertices.size() ? _shuffledVertices[_uploadedChunks]
+                                                                             : repacked;
+    if (vertices.empty()) {
+      // context was made again, packed vertices are gone
+      shuffleVertices(_loader->points(), chunk, _compactVertices, _pointsCount, vertices);
+    }
+    glBufferSubData(GL_ARRAY_BUFFER, static_cast<GLintptr>(chunk.first * _vertexBytes()),
+                    static_cast<GLsizeiptr>(vertices.size()), vertices.data());
+    uploaded += vertices.size();
+    std::vector<char>().swap(vertices);
+  }
+  _chunksBuffer.release();
+  _uploadNsecs += uploadTimer.nsecsElapsed();
+  if (_uploadedChunks < _chunks.size()) {
+    update();
+    return;
+  }
+
+  // vertex array object of bound one is current, it takes new buffer
+  std::vector<std::vector<char> >().swap(_shuffledVertices);
+  _vertexBuffer.destroy();
+  _vertexBuffer = _chunksBuffer;
+  _chunksBuffer = QOpenGLBuffer();
+  _vertexBuffer.bind();
+  _setVertexAttributes();
+  _vertexBuffer.release();
+  _chunksUploaded = true;
+  if (_core) {
+    _writeChunkBounds();
+  }
+}
+
+
+void Scene::_uploadPendingPoints()
+{
+  if (_pendingChunks.empty()) {
+    return;
+  }
+
+  QElapsedTimer uploadTimer;
+  uploadTimer.start();
+  _vertexBuffer.bind();
+  // buffer of downsampled scene is made once reduced points are known
+  if (_loader->points().size() > _bufferPoints) {
+    _bufferPoints = _loader->points().size();
+    glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(_bufferPoints * _vertexBytes()), nullptr, GL_STATIC_DRAW);
+  }
+  for (const auto& chunk : _pendingChunks) {
+    // loaded pieces are quantized to own bounds, chunks of index replace them later
+    _writeVertices(_loader->points(), chunk);
+    if (_compactVertices) {
+      _loadedChunks.push_back(chunk);
+      continue;
+    }
+
+    // keep drawn ranges sorted and merged, so there're few draw calls
+    const auto range = std::make_pair(chunk.first, chunk.count);
+    auto it = std::lower_bound(_loadedRanges.begin(), _loadedRanges.end(), range);
+    it = _loadedRanges.insert(it, range);
+    if (it != _loadedRanges.begin() && (it - 1)->first + (it - 1)->second == it->first) {
+      (it - 1)->second += it->second;
+      it = _loadedRanges.erase(it) - 1;
+    }
+    if (it + 1 != _loadedRanges.end() && it->first + it->second == (it + 1)->first) {
+      it->second += (it + 1)->second;
+      _loadedRanges.erase(it + 1);
+    }
+  }
+  _vertexBuffer.release();
+  _pendingChunks.clear();
+  _uploadNsecs += uploadTimer.nsecsElapsed();
+}
+
+
+void Scene::_writeVertices(const PointStorage& points, const PointChunk& chunk)
+{
+  // into bound buffer at their indices, run by run of storage blocks
+  std::vector<GLushort> packed;
+  points.forEachRun(chunk.first, chunk.count, [&](const float* run, size_t first, size_t count) {
+    const GLintptr offset = first * _vertexBytes();
+    const GLsizeiptr size = count * _vertexBytes();
+    if (_compactVertices) {
+      packed.resize(count * COMPACT_STRIDE);
+      packCompactPoints(run, count, chunk, _pointsCount, packed.data());
+      glBufferSubData(GL_ARRAY_BUFFER, offset, size, packed.data());
+    } else {
+      glBufferSubData(GL_ARRAY_BUFFER, offset, size, run);
+    }
+    return true;
+  });
+}
+
+
+void Scene::_writeShuffledVertices(const PointStorage& points, const std::vector<PointChunk>& chunks)
+{
+  // into bound buffer at places of chunks, thread pool shuffles and packs batch of them meanwhile
+  std::vector<std::vector<char> > packed(std::min(SHUFFLE_BATCH_CHUNKS, chunks.size()));
+  std::vector<size_t> batch;
+  for (size_t begin = 0; begin < chunks.size(); begin += SHUFFLE_BATCH_CHUNKS) {
+    batch.clear();
+    for (size_t index = begin; index < std::min(begin + SHUFFLE_BATCH_CHUNKS, chunks.size()); ++index) {
+      batch.push_back(index);
+    }
+    QtConcurrent::blockingMap(batch, [&](size_t index) {
+      shuffleVertices(points, chunks[index], _compactVertices, _pointsCount, packed[index - begin]);
+    });
+    for (size_t index : batch) {
+      const std::vector<char>& vertices = packed[index - begin];
+      glBufferSubData(GL_ARRAY_BUFFER, static_cast<GLintptr>(chunks[index].first * _vertexBytes()),
+                      static_cast<GLsizeiptr>(vertices.size()), vertices.data());
+    }
+  }
+}
+
+
+DrawStats Scene::_drawLoadedPoints(QOpenGLShaderProgram& program)
+{
+  DrawStats stats = {0, 0, 0};
+  if (_compactVertices) {
+    for (const auto& chunk : _loadedChunks) {
+      _setChunkBounds(program, chunk);
+      glDrawArrays(GL_POINTS, chunk.first, chunk.count);
+      stats.drawnPoints += chunk.count;
+    }
+    stats.chunks = stats.drawnChunks = static_cast<int>(_loadedChunks.size());
+  } else {
+    for (const auto& range : _loadedRanges) {
+      glDrawArrays(GL_POINTS, range.first, range.second);
+      stats.drawnPoints += range.second;
+    }
+    stats.chunks = stats.drawnChunks = static_cast<int>(_loadedRanges.size());
+  }
+  return stats;
 }
 
 
@@ -109,7 +951,46 @@ void Scene::_cleanup()
 {
   makeCurrent();
   _vertexBuffer.destroy();
+  // shuffled chunks are uploaded again as well
+  _chunksBuffer.destroy();
+  _uploadedChunks = 0;
+  _chunksUploaded = false;
+  for (auto& node : _lodGpuNodes) {
+    node.buffer.destroy();
+  }
+  _lodGpuNodes.clear();
+  _lodGpuBytes = 0;
+  // tiles are uploaded again with next context
+  for (size_t index = 0; index < _tileBuffers.size(); ++index) {
+    if (_tileBuffers[index].isCreated()) {
+      _tileBuffers[index].destroy();
+      _pendingTiles.push_back(static_cast<int>(index));
+    }
+  }
+  _indirectDraw.destroy();
+  if (_chunkBoundsBuffer) {
+    glDeleteBuffers(1, &_chunkBoundsBuffer);
+    _chunkBoundsBuffer = 0;
+  }
   _shaders.reset();
+  _pickShaders.reset();
+  _pickFbo.reset();
+  _pointsFbo.reset();
+  _refineView.clear();
+  _overlay.cleanup();
+  if (_zRampTexture) {
+    glDeleteTextures(1, &_zRampTexture);
+    _zRampTexture = 0;
+    _zRampDirty = true;
+  }
+  for (auto monitor : _timeMonitors) {
+    monitor->destroy();
+    delete monitor;
+  }
+  _timeMonitors.clear();
+  _timeMonitorsPending.clear();
+  _timeMonitorsPoints.clear();
+  _timeMonitor = nullptr;
   doneCurrent();
 }
 
@@ -121,45 +1002,84 @@ void Scene::initializeGL()
   initializeOpenGLFunctions();
   glClearColor(0, 0, 0, 1.0);
 
+  // core profile context of GL 4.4 gets core renderer, any other one the compatibility one
+  _core = nullptr;
+  const QSurfaceFormat format = context()->format();
+  if (format.profile() == QSurfaceFormat::CoreProfile) {
+    _core = context()->versionFunctions<QOpenGLFunctions_4_4_Core>();
+    if (_core && !_core->initializeOpenGLFunctions()) {
+      _core = nullptr;
+    }
+  }
+  if (_core) {
+    _indirectDraw.create(_core);
+  }
+
   // the world is still for now
   _worldMatrix.setToIdentity();
 
   //
   // create shaders and map attributes
   //
-  _shaders.reset(new QOpenGLShaderProgram());
-  auto vsLoaded = _shaders->addShaderFromSourceFile(QOpenGLShader::Vertex, ":/vertex_shader.glsl");
-  auto fsLoaded = _shaders->addShaderFromSourceFile(QOpenGLShader::Fragment, ":/fragment_shader.glsl");
-  assert(vsLoaded && fsLoaded);
-  // vector attributes
-  _shaders->bindAttributeLocation("vertex", 0);
-  _shaders->bindAttributeLocation("pointRowIndex", 1);
-  // constants
-  _shaders->bind();
-  _shaders->setUniformValue("lightPos", QVector3D(0, 0, 50));
-  _shaders->setUniformValue("pointsCount", static_cast<GLfloat>(_pointsCount));
-  _shaders->link();
-  _shaders->release();
+  // compatibility ones are GLSL 1.30 where driver has it, 1.20 otherwise
+  bool linked = _createPointShaders(true);
+  if (!linked && !_core) {
+    linked = _createPointShaders(false);
+  }
+  if (!linked) {
+    emit loadFailed(tr("Cannot build point shaders: %1").arg(_shaders->log()));
+  }
+
+  // id rendering needs gl_VertexID of GLSL 1.30, without it CPU index picks;
+  // it clips by distances, so picks match drawing only with the same clipping
+  _pickShaders.reset(new QOpenGLShaderProgram());
+  _gpuPickAvailable = _clipDistances && _pickShaders->addShaderFromSourceFile(QOpenGLShader::Vertex, shaderPath("pick_vertex_shader", _core))
+      && _pickShaders->addShaderFromSourceFile(QOpenGLShader::Fragment, shaderPath("pick_fragment_shader", _core));
+  _pickShaders->bindAttributeLocation("vertex", 0);
+  _pickShaders->bindAttributeLocation("chunkMin", CHUNK_MIN_ATTRIBUTE);
+  _pickShaders->bindAttributeLocation("chunkSize", CHUNK_SIZE_ATTRIBUTE);
+  _gpuPickAvailable = _gpuPickAvailable && _pickShaders->link();
+  if (!_gpuPickAvailable) {
+    _pickShaders.reset();
+  }
 
   // create array container and load points into buffer
   _vao.create();
   QOpenGLVertexArrayObject::Binder vaoBinder(&_vao);
   _vertexBuffer.create();
   _vertexBuffer.bind();
-  _vertexBuffer.allocate(_pointsData.constData(), _pointsData.size() * sizeof(GLfloat));
+  // points are written into buffer as loader delivers them,
+  // sizes of QOpenGLBuffer are int and large clouds take more than 2GB
+  _bufferPoints = _lod || _tiles || _voxelGrid.voxelSize() > 0 ? 0 : _pointsCount;
+  glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(_bufferPoints * _vertexBytes()),
+               nullptr, GL_STATIC_DRAW);
   QOpenGLFunctions *f = QOpenGLContext::currentContext()->functions();
   f->glEnableVertexAttribArray(0);
   f->glEnableVertexAttribArray(1);
-  f->glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat) + sizeof(GLfloat), 0);
-  f->glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat) + sizeof(GLfloat), reinterpret_cast<void *>(3*sizeof(GLfloat)));
+  _setVertexAttributes();
   _vertexBuffer.release();
 
+  // GPU phase timings need timer queries of GL 3.3 or ARB_timer_query, CPU ones are always there
+  for (size_t i = 0; i < TIME_MONITORS; ++i) {
+    QScopedPointer<QOpenGLTimeMonitor> monitor(new QOpenGLTimeMonitor());
+    monitor->setSampleCount(FrameStats::PHASES_COUNT + 1);
+    if (!monitor->create()) {
+      break;
+    }
+    _timeMonitors.push_back(monitor.take());
+    _timeMonitorsPending.push_back(false);
+    _timeMonitorsPoints.push_back(0);
+  }
+  _fpsTimer.start();
 }
 
 
 void Scene::paintGL()
 {
+  _beginFrameTiming();
+
   // ensure GL flags
+  glGetIntegerv(GL_VIEWPORT, _viewport);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   glEnable(GL_DEPTH_TEST);
   glEnable(GL_VERTEX_PROGRAM_POINT_SIZE); //required for gl_PointSize
@@ -175,85 +1095,602 @@ void Scene::paintGL()
   _cameraMatrix.rotate(camera.rotation.y(), 0, 1, 0);
   _cameraMatrix.rotate(camera.rotation.z(), 0, 0, 1);
 
-  // set clipping planes
-  glEnable(GL_CLIP_PLANE1);
-  glEnable(GL_CLIP_PLANE2);
-  const double rearClippingPlane[] = {0., 0., -1., camera.rearClippingDistance};
-  glClipPlane(GL_CLIP_PLANE1 , rearClippingPlane);
-  const double frontClippingPlane[] = {0., 0., 1., camera.frontClippingDistance};
-  glClipPlane(GL_CLIP_PLANE2 , frontClippingPlane);
-
   //
   // draw points cloud
   //
   QOpenGLVertexArrayObject::Binder vaoBinder(&_vao);
   const auto viewMatrix = _projectionMatrix * _cameraMatrix * _worldMatrix;
-  _shaders->bind();
-  _shaders->setUniformValue("pointsCount", static_cast<GLfloat>(_pointsCount));
-  _shaders->setUniformValue("viewMatrix", viewMatrix);
-  _shaders->setUniformValue("pointSize", _pointSize);
-  _shaders->setUniformValue("colorAxisMode", static_cast<GLfloat>(_colorMode));
-  _shaders->setUniformValue("pointsBoundMin", _pointsBoundMin);
-  _shaders->setUniformValue("pointsBoundMax", _pointsBoundMax);
-  glDrawArrays(GL_POINTS, 0, _pointsData.size());
-  _shaders->release();
+  _updateZRamp();
+  // budgeted points go into own framebuffer, it keeps points drawn by previous frames
+  _refining = _pointBudget.isEnabled() && !_lod && (_tiles || (_pointIndexReady && _chunksUploaded)) &&
+      _bindPointsFbo();
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, _zRampTexture);
+  // nothing but overlay is drawn without point shaders
+  if (_shaders->isLinked()) {
+    _shaders->bind();
+    _setClippingPlanes(*_shaders, camera);
+    _shaders->setUniformValue("pointsCount", static_cast<GLfloat>(_pointsCount));
+    _shaders->setUniformValue("viewMatrix", viewMatrix);
+    _shaders->setUniformValue("pointSize", _pointSize);
+    _shaders->setUniformValue("colorAxisMode", static_cast<GLfloat>(_colorMode));
+    _shaders->setUniformValue("zRamp", 0);
+    _shaders->setUniformValue("zRampMin", _zRampMin);
+    _shaders->setUniformValue("zRampMax", _zRampMax);
+    _shaders->setUniformValue("zRampSize", static_cast<GLfloat>(Z_RAMP_SIZE));
+    // compact vertices have own chunk bounds and rows scaled to 0..1
+    _setChunkBounds(*_shaders, unitChunk());
+    _shaders->setUniformValue("rowScale", _compactVertices ? static_cast<GLfloat>(_pointsCount) : 1.f);
+    _shaders->setUniformValue("selectionActive", _selectionPlanes.empty() ? 0.f : 1.f);
+    if (!_selectionPlanes.empty()) {
+      _shaders->setUniformValueArray("selectionPlanes", _selectionPlanes.data(), static_cast<int>(_selectionPlanes.size()));
+    }
+    if (_lod) {
+      _frameStats.submittedPoints = _drawLodNodes(viewMatrix);
+    } else if (_tiles) {
+      const DrawStats stats = _drawTiles(viewMatrix, camera);
+      _frameStats.submittedPoints = stats.drawnPoints;
+      emit drawStatsChanged(stats);
+    } else {
+      DrawStats stats;
+      if (_pointIndexReady && !_chunksUploaded) {
+        _uploadShuffledChunks();
+      }
+      if (_pointIndexReady && _chunksUploaded) {
+        stats = _drawChunks(viewMatrix, camera);
+      } else {
+        // loading, indexing or uploading chunks, whatever is in buffer is drawn
+        _uploadPendingPoints();
+        stats = _drawLoadedPoints(*_shaders);
+      }
+      _frameStats.submittedPoints = stats.drawnPoints;
+      emit drawStatsChanged(stats);
+    }
+    _shaders->release();
+  }
+  // overlay shaders write no clip distances; they're the same switches as clip planes
+  glDisable(GL_CLIP_DISTANCE0);
+  glDisable(GL_CLIP_DISTANCE1);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  vaoBinder.release();
+  if (_refining) {
+    _pointsFbo->release();
+    QOpenGLFramebufferObject::blitFramebuffer(nullptr, _pointsFbo.data());
+    // without timer queries budget follows CPU time of points phase, so it waits for GPU
+    if (_timeMonitors.empty()) {
+      glFinish();
+    }
+  }
+  _endPhase(FrameStats::POINTS);
+  _frameStats.pointBudget = _refining ? _pointBudget.budget() : 0;
+  if (_refining && _timeMonitors.empty()) {
+    _pointBudget.addFrame(_frameStats.submittedPoints, _frameStats.cpuUsecs[FrameStats::POINTS]);
+  }
+  // still view gets rest of points over next frames
+  if (_refining && _refinedFraction < 1) {
+    _frameScheduler.requestFrame();
+  }
+
+  // histogram of drawn chunks or tiles follows view and clipping planes, ramp of it is used by next frame
+  if (_zHistogramReady && _colorMode == COLOR_BY_Z && _colorStretch != ZHistogram::LINEAR_STRETCH &&
+      _zHistogram.setSubset(_tiles ? _drawnTiles : _drawnChunks)) {
+    _zRampDirty = true;
+    update();
+  }
 
   //
-  // draw picked points and line between
+  // draw frame axis, picked and highlighted points and annotations
   //
-  glBegin(GL_LINES);
-  glColor3f(1., 1., 0.);
-  {
-    QMatrix4x4 mvMatrix = _cameraMatrix * _worldMatrix;
-    for (auto vertex : _pickedPoints) {
-      const auto translated = _projectionMatrix * mvMatrix * vertex;
-      glVertex3f(translated.x(), translated.y(), translated.z());
+  _overlay.draw(viewMatrix, size());
+  _endPhase(FrameStats::OVERLAY);
+  if (_overlay.hasLabels() || !_selectionRect.isNull()) {
+    QPainter painter(this);
+    _overlay.drawLabels(painter, viewMatrix, size());
+    if (!_selectionRect.isNull()) {
+      painter.setPen(SELECTION_COLOR);
+      painter.drawRect(_selectionRect);
     }
   }
-  glEnd();
-  for (auto vertex : _pickedPoints) {
-    _drawMarkerBox(vertex, QColor(1., 1., 0.));
+  _endPhase(FrameStats::LABELS);
+  _endFrameTiming();
+
+  // report loading once all points reached vertex buffer
+  if (!_loadReported && _loader && _loader->isFinished() && _pendingChunks.empty() &&
+      (_voxelGrid.voxelSize() <= 0 || _downsampled)) {
+    _loadReported = true;
+    LoadTimings timings = _loader->timings();
+    timings.upload = _uploadNsecs / 1000000;
+    timings.downsample = _downsampled ? _downsampleWatcher.result() : 0;
+    emit loadFinished(timings);
+    _startIndexing();
   }
+}
 
-  //
-  // draw mouse-highlited point
-  //
-  if (_highlitedPoint != QVector3D()) {
-    _drawMarkerBox(_highlitedPoint, QColor(0., 1., 1.));
+
+void Scene::_updateZRamp()
+{
+  // linear ramp over bounds until points are measured, stretched ones over bins range
+  const bool stretched = _zHistogramReady && _colorStretch != ZHistogram::LINEAR_STRETCH;
+  _zRampMin = stretched ? _zHistogram.binsMin() : _pointsBoundMin.z();
+  _zRampMax = stretched ? _zHistogram.binsMax() : _pointsBoundMax.z();
+  if (!_zRampDirty) {
+    return;
+  }
+  _zRampDirty = false;
+
+  const std::vector<float> ramp = _zHistogram.ramp(stretched ? _colorStretch : ZHistogram::LINEAR_STRETCH,
+                                                   Z_RAMP_SIZE, PERCENTILE_CLIP);
+  // grey RGBA texels, single channel formats differ between GL versions
+  std::vector<GLubyte> texels(ramp.size() * 4, 255);
+  for (size_t i = 0; i < ramp.size(); ++i) {
+    std::fill(texels.begin() + 4 * i, texels.begin() + 4 * i + 3, static_cast<GLubyte>(ramp[i] * 255 + 0.5f));
+  }
+  if (!_zRampTexture) {
+    glGenTextures(1, &_zRampTexture);
+    glBindTexture(GL_TEXTURE_2D, _zRampTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
   }
+  glBindTexture(GL_TEXTURE_2D, _zRampTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, static_cast<GLsizei>(ramp.size()), 1, 0,
+               GL_RGBA, GL_UNSIGNED_BYTE, texels.data());
+  ++_zRampVersion;
+}
 
-  _drawFrameAxis();
 
+bool Scene::_bindPointsFbo()
+{
+  if (!QOpenGLFramebufferObject::hasOpenGLFramebufferBlit()) {
+    return false;
+  }
+  const QSize size(_viewport[2], _viewport[3]);
+  if (!_pointsFbo || _pointsFbo->size() != size) {
+    _pointsFbo.reset(new QOpenGLFramebufferObject(size, QOpenGLFramebufferObject::Depth));
+    _refineView.clear();
+  }
+  return _pointsFbo->bind();
 }
 
 
-void Scene::_drawMarkerBox(const QVector3D& point, const QColor& color) {
-  glBegin(GL_LINE_LOOP);
-  glColor3f(color.red(), color.green(), color.blue());
-  {
-    const float dx = 0.01;
-    const auto aspect = (float)width() / height();
-    const auto dy = dx*aspect;
-    const auto p = _projectionMatrix * _cameraMatrix * _worldMatrix * point;
-    glVertex3f(p.x()-dx, p.y()-dy, p.z());
-    glVertex3f(p.x()+dx, p.y()-dy, p.z());
-    glVertex3f(p.x()+dx, p.y()+dy, p.z());
-    glVertex3f(p.x()-dx, p.y()+dy, p.z());
+std::pair<double, double> Scene::_refineSlice(const QMatrix4x4& viewMatrix, const CameraState& camera,
+                                              const std::vector<int>& visible, quint64 visiblePoints)
+{
+  // fractions of visible chunks drawn by this frame, all of them without budget
+  if (!_refining) {
+    return std::make_pair(0., 1.);
+  }
+
+  // anything that changes picture of points starts it again from first budget of points
+  std::vector<float> view(viewMatrix.constData(), viewMatrix.constData() + 16);
+  const float state[] = {
+    static_cast<float>(camera.frontClippingDistance), static_cast<float>(camera.rearClippingDistance),
+    _pointSize, static_cast<float>(_colorMode), _zRampMin, _zRampMax, static_cast<float>(_zRampVersion)
+  };
+  view.insert(view.end(), state, state + sizeof(state) / sizeof(state[0]));
+  for (const auto& plane : _selectionPlanes) {
+    const float coefficients[] = {plane.x(), plane.y(), plane.z(), plane.w()};
+    view.insert(view.end(), coefficients, coefficients + 4);
   }
-  glEnd();
+  if (view != _refineView || visible != _refineChunks) {
+    _refineView.swap(view);
+    _refineChunks = visible;
+    _refinedFraction = 0;
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  }
+
+  const double from = _refinedFraction;
+  const quint64 budget = _pointBudget.budget();
+  _refinedFraction = visiblePoints > budget ? std::min(1., from + static_cast<double>(budget) / visiblePoints) : 1;
+  return std::make_pair(from, _refinedFraction);
 }
 
 
-void Scene::_drawFrameAxis() {
-  glBegin(GL_LINES);
-  QMatrix4x4 mvMatrix = _cameraMatrix * _worldMatrix;
-  mvMatrix.scale(0.05); // make it small
-  for (auto vertex : _axesLines) {
-    const auto translated = _projectionMatrix * mvMatrix * vertex.first;
-    glColor3f(vertex.second.red(), vertex.second.green(), vertex.second.blue());
-    glVertex3f(translated.x(), translated.y(), translated.z());
+quint64 Scene::_drawLodNodes(const QMatrix4x4& viewMatrix)
+{
+  ++_frame;
+  const std::vector<quint32> selected = _lod->select(viewMatrix, size(), _lodGpuBudget);
+  const auto& nodes = _lod->nodes();
+
+  // coarse nodes go first, so view fills in from coarse to fine as nodes arrive
+  LodStats stats = {static_cast<int>(selected.size()), 0, 0, 0, 0};
+  size_t uploaded = 0;
+  _lodDrawnNodes.clear();
+  for (quint32 index : selected) {
+    auto gpuNode = _lodGpuNodes.find(index);
+    if (gpuNode == _lodGpuNodes.end()) {
+      const auto data = _lod->cached(index);
+      if (!data || uploaded >= LOD_UPLOAD_BYTES_PER_FRAME) {
+        continue;
+      }
+      LodGpuNode node;
+      node.bytes = nodes[index].count * _vertexBytes();
+      node.lastFrame = _frame;
+      node.buffer.create();
+      node.buffer.bind();
+      // node cube bounds its points; leaves of deepest level may be over 2 GB
+      glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(node.bytes), nullptr, GL_STATIC_DRAW);
+      _writeVertices(data->points, nodeChunk(nodes[index]));
+      node.buffer.release();
+      uploaded += node.bytes;
+      _lodGpuBytes += node.bytes;
+      gpuNode = _lodGpuNodes.insert(index, node);
+    }
+
+    gpuNode->lastFrame = _frame;
+    gpuNode->buffer.bind();
+    _setVertexAttributes();
+    if (_compactVertices) {
+      _setChunkBounds(*_shaders, nodeChunk(nodes[index]));
+    }
+    glDrawArrays(GL_POINTS, 0, nodes[index].count);
+    gpuNode->buffer.release();
+    _lodDrawnNodes.push_back(index);
+    stats.drawnPoints += nodes[index].count;
+  }
+  stats.drawnNodes = static_cast<int>(_lodDrawnNodes.size());
+
+  // least recently drawn buffers go once over budget
+  while (_lodGpuBytes > _lodGpuBudget) {
+    auto oldest = _lodGpuNodes.end();
+    for (auto it = _lodGpuNodes.begin(); it != _lodGpuNodes.end(); ++it) {
+      if (it->lastFrame != _frame && (oldest == _lodGpuNodes.end() || it->lastFrame < oldest->lastFrame)) {
+        oldest = it;
+      }
+    }
+    if (oldest == _lodGpuNodes.end()) {
+      break;
+    }
+    _lodGpuBytes -= oldest->bytes;
+    oldest->buffer.destroy();
+    _lodGpuNodes.erase(oldest);
+  }
+
+  stats.cachedBytes = _lod->cachedBytes();
+  stats.gpuBytes = _lodGpuBytes;
+  emit lodStatsChanged(stats);
+
+  // keep drawing while view is incomplete, report first complete one as loaded
+  if (stats.drawnNodes < stats.selectedNodes) {
+    emit loadProgress(100 * stats.drawnNodes / stats.selectedNodes);
+    if (uploaded >= LOD_UPLOAD_BYTES_PER_FRAME) {
+      update();
+    }
+  } else if (!_loadReported) {
+    _loadReported = true;
+    LoadTimings timings = {_lodOpenTimer.elapsed(), 0, 0, 0, 0, false};
+    emit loadProgress(100);
+    emit loadFinished(timings);
+    emit pickIndexBuilt(0);
   }
-  glEnd();
+  return stats.drawnPoints;
+}
+
+
+DrawStats Scene::_drawTiles(const QMatrix4x4& viewMatrix, const CameraState& camera)
+{
+  // tiles loaded since last frame get their buffers, few at a time
+  QElapsedTimer uploadTimer;
+  uploadTimer.start();
+  size_t uploaded = 0;
+  size_t pending = 0;
+  for (; pending < _pendingTiles.size() && uploaded < LOD_UPLOAD_BYTES_PER_FRAME; ++pending) {
+    const int index = _pendingTiles[pending];
+    const Tile& tile = _tiles->tile(index);
+    const size_t bytes = tile.points.size() * _vertexBytes();
+    QOpenGLBuffer& buffer = _tileBuffers[index];
+    buffer.create();
+    buffer.bind();
+    glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(bytes), nullptr, GL_STATIC_DRAW);
+    _writeShuffledVertices(tile.points, {tileChunk(tile)});
+    buffer.release();
+    uploaded += bytes;
+  }
+  _pendingTiles.erase(_pendingTiles.begin(), _pendingTiles.begin() + pending);
+  _uploadNsecs += uploadTimer.nsecsElapsed();
+  if (!_pendingTiles.empty()) {
+    update();
+  }
+
+  DrawStats stats = {0, 0, 0};
+  _drawnTiles.clear();
+  quint64 visiblePoints = 0;
+  for (int index = 0; index < _tiles->tilesCount(); ++index) {
+    if (!_tileBuffers[index].isCreated()) {
+      continue;
+    }
+    ++stats.chunks;
+    const PointChunk chunk = tileChunk(_tiles->tile(index));
+    if (isBoxVisible(viewMatrix, chunk.min, chunk.max, camera)) {
+      _drawnTiles.push_back(index);
+      visiblePoints += chunk.count;
+    }
+  }
+  stats.drawnChunks = static_cast<int>(_drawnTiles.size());
+
+  // same slice of shuffled order of every visible tile
+  const auto slice = _refineSlice(viewMatrix, camera, _drawnTiles, visiblePoints);
+  for (int index : _drawnTiles) {
+    const PointChunk chunk = tileChunk(_tiles->tile(index));
+    const size_t sliceFirst = slicePoints(chunk.count, slice.first);
+    const size_t sliceCount = slicePoints(chunk.count, slice.second) - sliceFirst;
+    if (sliceCount == 0) {
+      continue;
+    }
+    _tileBuffers[index].bind();
+    _setVertexAttributes();
+    if (_compactVertices) {
+      _setChunkBounds(*_shaders, chunk);
+    }
+    glDrawArrays(GL_POINTS, sliceFirst, sliceCount);
+    _tileBuffers[index].release();
+    stats.drawnPoints += sliceCount;
+  }
+
+  // every tile is indexed before it's announced, so measuring tool is ready with loading
+  if (!_loadReported && _tiles->isFinished() && _pendingTiles.empty()) {
+    _loadReported = true;
+    LoadTimings timings = _tiles->timings();
+    timings.upload = _uploadNsecs / 1000000;
+    emit loadProgress(100);
+    emit loadFinished(timings);
+    emit pickIndexBuilt(_tiles->indexMsecs());
+  }
+  return stats;
+}
+
+
+//
+// frame statistics
+//
+void Scene::_beginFrameTiming()
+{
+  _phaseTimer.start();
+  _timeMonitor = nullptr;
+  if (_timeMonitors.empty()) {
+    return;
+  }
+
+  // monitor recorded TIME_MONITORS frames ago is usually done, waiting for it would stall
+  const size_t slot = _frameStats.frame % _timeMonitors.size();
+  QOpenGLTimeMonitor* monitor = _timeMonitors[slot];
+  if (_timeMonitorsPending[slot]) {
+    if (!monitor->isResultAvailable()) {
+      return;
+    }
+    const QVector<GLuint64> intervals = monitor->waitForIntervals();
+    for (int phase = 0; phase < FrameStats::PHASES_COUNT && phase < intervals.size(); ++phase) {
+      _frameStats.gpuUsecs[phase] = static_cast<qint64>(intervals[phase] / 1000);
+    }
+    _pointBudget.addFrame(_timeMonitorsPoints[slot], _frameStats.gpuUsecs[FrameStats::POINTS]);
+    monitor->reset();
+    _timeMonitorsPending[slot] = false;
+  }
+  _timeMonitor = monitor;
+  _timeMonitor->recordSample();
+}
+
+
+void Scene::_endPhase(FrameStats::Phase phase)
+{
+  _frameStats.cpuUsecs[phase] = _phaseTimer.nsecsElapsed() / 1000;
+  _phaseTimer.start();
+  if (_timeMonitor) {
+    _timeMonitor->recordSample();
+  }
+}
+
+
+void Scene::_endFrameTiming()
+{
+  if (_timeMonitor) {
+    const size_t slot = _frameStats.frame % _timeMonitors.size();
+    _timeMonitorsPending[slot] = true;
+    _timeMonitorsPoints[slot] = _refining ? _frameStats.submittedPoints : 0;
+  }
+
+  ++_fpsFrames;
+  const qint64 elapsed = _fpsTimer.elapsed();
+  if (elapsed >= FPS_INTERVAL) {
+    _frameStats.fps = 1000. * _fpsFrames / elapsed;
+    _fpsFrames = 0;
+    _fpsTimer.start();
+  }
+  emit frameStatsChanged(_frameStats);
+  ++_frameStats.frame;
+}
+
+
+bool Scene::_createPointShaders(bool clipDistances)
+{
+  _shaders.reset(new QOpenGLShaderProgram());
+  _clipDistances = clipDistances;
+  bool loaded;
+  if (_core) {
+    loaded = _shaders->addShaderFromSourceFile(QOpenGLShader::Vertex, shaderPath("vertex_shader", true)) &&
+        _shaders->addShaderFromSourceFile(QOpenGLShader::Fragment, shaderPath("fragment_shader", true));
+  } else {
+    loaded = _shaders->addShaderFromSourceCode(QOpenGLShader::Vertex,
+                                               compatShaderSource(":/vertex_shader.glsl", clipDistances)) &&
+        _shaders->addShaderFromSourceCode(QOpenGLShader::Fragment,
+                                          compatShaderSource(":/fragment_shader.glsl", clipDistances));
+  }
+  // vector attributes, chunk bounds are attributes of core shaders
+  _shaders->bindAttributeLocation("vertex", 0);
+  _shaders->bindAttributeLocation("pointRowIndex", 1);
+  _shaders->bindAttributeLocation("chunkMin", CHUNK_MIN_ATTRIBUTE);
+  _shaders->bindAttributeLocation("chunkSize", CHUNK_SIZE_ATTRIBUTE);
+  if (!loaded || !_shaders->link()) {
+    return false;
+  }
+  // constants
+  _shaders->bind();
+  _shaders->setUniformValue("lightPos", QVector3D(0, 0, 50));
+  _shaders->setUniformValue("pointsCount", static_cast<GLfloat>(_pointsCount));
+  _shaders->release();
+  return true;
+}
+
+
+void Scene::_setClippingPlanes(QOpenGLShaderProgram& program, const CameraState& camera)
+{
+  // planes of clip coordinates, same for drawing and picking shaders
+  const QVector4D planes[2] = {
+    QVector4D(0, 0, -1, static_cast<float>(camera.rearClippingDistance)),
+    QVector4D(0, 0, 1, static_cast<float>(camera.frontClippingDistance))
+  };
+  if (_clipDistances) {
+    program.setUniformValueArray("clippingPlanes", planes, 2);
+    glEnable(GL_CLIP_DISTANCE0);
+    glEnable(GL_CLIP_DISTANCE1);
+    return;
+  }
+  // GLSL 1.20 shaders clip gl_ClipVertex, which is position in clip coordinates,
+  // by planes given with identity modelview
+  const double rearClippingPlane[] = {planes[0].x(), planes[0].y(), planes[0].z(), planes[0].w()};
+  const double frontClippingPlane[] = {planes[1].x(), planes[1].y(), planes[1].z(), planes[1].w()};
+  glClipPlane(GL_CLIP_PLANE0, rearClippingPlane);
+  glClipPlane(GL_CLIP_PLANE1, frontClippingPlane);
+  glEnable(GL_CLIP_PLANE0);
+  glEnable(GL_CLIP_PLANE1);
+}
+
+
+bool Scene::_pickOnGpu(const QPoint& pos, QVector3D& point)
+{
+  // window around cursor gets whole viewport of pick pass,
+  // so only chunks under cursor are submitted
+  const int side = 2 * PICK_RADIUS + 1;
+  if (!_pickFbo) {
+    _pickFbo.reset(new QOpenGLFramebufferObject(side, side, QOpenGLFramebufferObject::Depth));
+  }
+  const QMatrix4x4 viewMatrix = _projectionMatrix * _cameraMatrix * _worldMatrix;
+  const float cx = 2.f * pos.x() / width() - 1;
+  const float cy = 1 - 2.f * pos.y() / height();
+  QMatrix4x4 pickMatrix;
+  pickMatrix.scale(float(width()) / side, float(height()) / side, 1);
+  pickMatrix.translate(-cx, -cy, 0);
+  const QMatrix4x4 pickViewMatrix = pickMatrix * viewMatrix;
+  const CameraState camera = _currentCamera->state();
+
+  // pass shares state with frames, so viewport and clear color of them are put back
+  GLint viewport[4];
+  GLfloat clearColor[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+  _pickFbo->bind();
+  glViewport(0, 0, side, side);
+  glClearColor(0, 0, 0, 0);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+
+  // ids resolve to points of LOD node or tile through these bases,
+  // in-memory buffer has single one
+  std::vector<std::pair<GLuint, quint32> > bases;
+  {
+    QOpenGLVertexArrayObject::Binder vaoBinder(&_vao);
+    _pickShaders->bind();
+    _setClippingPlanes(*_pickShaders, camera);
+    _pickShaders->setUniformValue("viewMatrix", pickViewMatrix);
+    _pickShaders->setUniformValue("pointSize", _pointSize);
+    _pickShaders->setUniformValue("idBase", GLuint(0));
+    _setChunkBounds(*_pickShaders, unitChunk());
+    GLuint base = 0;
+    auto submitBuffer = [&](QOpenGLBuffer& buffer, const PointChunk& chunk, quint32 index) {
+      if (!isBoxVisible(pickViewMatrix, chunk.min, chunk.max, camera)) {
+        return;
+      }
+      _pickShaders->setUniformValue("idBase", base);
+      if (_compactVertices) {
+        _setChunkBounds(*_pickShaders, chunk);
+      }
+      buffer.bind();
+      _setVertexAttributes();
+      glDrawArrays(GL_POINTS, 0, chunk.count);
+      buffer.release();
+      bases.push_back(std::make_pair(base, index));
+      base += chunk.count;
+    };
+    if (_lod) {
+      for (quint32 index : _lodDrawnNodes) {
+        auto gpuNode = _lodGpuNodes.find(index);
+        if (gpuNode != _lodGpuNodes.end()) {
+          submitBuffer(gpuNode->buffer, nodeChunk(_lod->nodes()[index]), index);
+        }
+      }
+    } else if (_tiles) {
+      for (int index : _drawnTiles) {
+        submitBuffer(_tileBuffers[index], tileChunk(_tiles->tile(index)), index);
+      }
+    } else if (_chunksUploaded) {
+      std::vector<int> visible;
+      _cullChunks(pickViewMatrix, camera, visible);
+      _submitChunks(*_pickShaders, visible, 0, 1);
+    } else {
+      _drawLoadedPoints(*_pickShaders);
+    }
+    _pickShaders->release();
+    glDisable(GL_CLIP_DISTANCE0);
+    glDisable(GL_CLIP_DISTANCE1);
+  }
+
+  std::vector<uchar> ids(side * side * 4);
+  std::vector<GLfloat> depths(side * side);
+  glReadPixels(0, 0, side, side, GL_RGBA, GL_UNSIGNED_BYTE, ids.data());
+  glReadPixels(0, 0, side, side, GL_DEPTH_COMPONENT, GL_FLOAT, depths.data());
+  _pickFbo->release();
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+  glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+
+  // hit closest to cursor, nearer to camera of equally close ones
+  GLuint hit = 0;
+  int hitDistance2 = PICK_RADIUS * PICK_RADIUS + 1;
+  float hitDepth = 1;
+  for (int y = 0; y < side; ++y) {
+    for (int x = 0; x < side; ++x) {
+      const uchar* rgba = &ids[(y * side + x) * 4];
+      const GLuint id = rgba[0] | (rgba[1] << 8) | (rgba[2] << 16) | (GLuint(rgba[3]) << 24);
+      const int distance2 = (x - PICK_RADIUS) * (x - PICK_RADIUS) + (y - PICK_RADIUS) * (y - PICK_RADIUS);
+      const float depth = depths[y * side + x];
+      if (id != 0 && (distance2 < hitDistance2 || (distance2 == hitDistance2 && depth < hitDepth))) {
+        hit = id;
+        hitDistance2 = distance2;
+        hitDepth = depth;
+      }
+    }
+  }
+  if (hit == 0) {
+    return false;
+  }
+
+  const GLfloat* p = nullptr;
+  if (_lod || _tiles) {
+    auto base = std::upper_bound(bases.begin(), bases.end(), std::make_pair(hit - 1, quint32(0xffffffff))) - 1;
+    if (_tiles) {
+      const Tile& tile = _tiles->tile(base->second);
+      p = tile.points.point(PointBudget::shuffledIndex(hit - 1 - base->first, tile.points.size()));
+    } else {
+      const auto data = _lod->cached(base->second);
+      if (!data) {
+        return false;
+      }
+      p = data->points.point(hit - 1 - base->first);
+    }
+  } else if (_chunksUploaded) {
+    // vertex of shuffled chunk
+    PointChunk key;
+    key.first = hit - 1;
+    const auto chunk = std::upper_bound(_chunks.begin(), _chunks.end(), key, [](const PointChunk& a, const PointChunk& b) {
+      return a.first < b.first;
+    }) - 1;
+    p = _loader->points().point(chunk->first + PointBudget::shuffledIndex(hit - 1 - chunk->first, chunk->count));
+  } else {
+    p = _loader->points().point(hit - 1);
+  }
+  point = QVector3D(p[0], p[1], p[2]);
+  return true;
 }
 
 
@@ -264,23 +1701,56 @@ void Scene::resizeGL(int w, int h)
 }
 
 
-QVector3D Scene::_pickPointFrom2D(const QPoint& pos) const {
-
-  // do slow linear search through small sample
-  // must have is BSP/quadtree for O(logN) searching on large samples
-  float maxDistance = 1e-1;
-  auto ray = _unproject(pos.x(), pos.y());
+QVector3D Scene::_pickPointFrom2D(const QPoint& pos) {
   QVector3D closest;
-  for (size_t i = 0; i < _pointsCount; i++) {
-    const GLfloat *p = &_pointsData[i*4];
-    QVector3D point(p[0], p[1], p[2]);
-
-    float distance = (point - ray).length();
-    if (distance < maxDistance) {
-      closest = point;
-      maxDistance = distance;
+  QElapsedTimer queryTimer;
+  queryTimer.start();
+
+  // ids are resolved through points data, which is reordered while indexing
+  const bool pointsStable = _lod || _tiles || !_loadReported || (_pointIndexReady && _chunksUploaded);
+  if (_gpuPickAvailable && pointsStable && _currentCamera) {
+    makeCurrent();
+    _pickOnGpu(pos, closest);
+    doneCurrent();
+  } else if (_lod) {
+    // every drawn node has own index, take closest of their picks
+    const QMatrix4x4 viewMatrix = _projectionMatrix * _cameraMatrix * _worldMatrix;
+    float closestDistance = PICK_RADIUS;
+    for (quint32 node : _lodDrawnNodes) {
+      const auto data = _lod->cached(node);
+      float distance;
+      const qint64 index = data ? data->index.pick(viewMatrix, size(), pos, closestDistance, &distance) : -1;
+      if (index >= 0) {
+        const GLfloat* p = data->index.point(index);
+        closest = QVector3D(p[0], p[1], p[2]);
+        closestDistance = distance;
+      }
+    }
+  } else if (_tiles) {
+    // same for drawn tiles, each is indexed
+    const QMatrix4x4 viewMatrix = _projectionMatrix * _cameraMatrix * _worldMatrix;
+    float closestDistance = PICK_RADIUS;
+    for (int index : _drawnTiles) {
+      const Tile& tile = _tiles->tile(index);
+      float distance;
+      const qint64 point = tile.index.pick(viewMatrix, size(), pos, closestDistance, &distance);
+      if (point >= 0) {
+        const GLfloat* p = tile.index.point(point);
+        closest = QVector3D(p[0], p[1], p[2]);
+        closestDistance = distance;
+      }
     }
+  } else if (_pointIndexReady) {
+    const QMatrix4x4 viewMatrix = _projectionMatrix * _cameraMatrix * _worldMatrix;
+    const qint64 index = _pointIndex.pick(viewMatrix, size(), pos, PICK_RADIUS);
+    if (index >= 0) {
+      const GLfloat* p = _pointIndex.point(index);
+      closest = QVector3D(p[0], p[1], p[2]);
+    }
+  } else {
+    return closest;
   }
+  emit pickQueryFinished(queryTimer.nsecsElapsed() / 1000);
   return closest;
 }
 
@@ -288,6 +1758,18 @@ QVector3D Scene::_pickPointFrom2D(const QPoint& pos) const {
 void Scene::mousePressEvent(QMouseEvent *event)
 {
   _prevMousePosition = event->pos();
+  // grabbing stops spin
+  _inertiaVelocity = QVector2D();
+  _inertiaRemainder = QVector2D();
+  _dragVelocity = QVector2D();
+  _dragTimer.start();
+
+  if (event->button() == Qt::LeftButton && _selectionEnabled && !(event->modifiers() & Qt::ShiftModifier)) {
+    // drag selects instead of rotating
+    _selectionStart = event->pos();
+    _selectScreenRect(QRect(_selectionStart, _selectionStart));
+    return;
+  }
 
   if (event->button() == Qt::LeftButton && _pickpointEnabled)
   {
@@ -300,7 +1782,7 @@ void Scene::mousePressEvent(QMouseEvent *event)
 
       _pickedPoints << closest;
       emit pickpointsChanged(_pickedPoints);
-      update();
+      _updatePickOverlay();
     }
   }
 }
@@ -313,9 +1795,13 @@ void Scene::mouseMoveEvent(QMouseEvent *event)
   const bool panningMode = (event->modifiers() & Qt::ShiftModifier);
   _prevMousePosition = event->pos();
 
-  if (event->buttons() & Qt::LeftButton) {
+  if ((event->buttons() & Qt::LeftButton) && !_selectionRect.isNull()) {
+    _selectScreenRect(QRect(_selectionStart, event->pos()).normalized());
+  } else if (event->buttons() & Qt::LeftButton) {
 
     if (panningMode) {
+      // single step along each axis dragged along, announced as one change
+      Camera::UpdateGuard update(*_currentCamera);
       if (dx > 0) {
         _currentCamera->right();
       }
@@ -330,12 +1816,60 @@ void Scene::mouseMoveEvent(QMouseEvent *event)
       }
     } else {
       _currentCamera->rotate(dy, dx, 0);
+      // smoothed drag speed becomes spin speed on release
+      const double seconds = _dragTimer.isValid() ? _dragTimer.nsecsElapsed() / 1e9 : 0;
+      if (seconds > 0) {
+        _dragVelocity = 0.5f * _dragVelocity + 0.5f * QVector2D(dy, dx) / static_cast<float>(seconds);
+      }
     }
+    _dragTimer.start();
   }
 
   if (_pickpointEnabled) {
     _highlitedPoint = _pickPointFrom2D(event->pos());
-    update();
+    _updateHighlightOverlay();
+  }
+}
+
+
+void Scene::mouseReleaseEvent(QMouseEvent *event)
+{
+  // velocity is gathered by rotating drags only
+  if (event->button() == Qt::LeftButton && _dragTimer.isValid() && _dragTimer.elapsed() < INERTIA_RELEASE_MSECS &&
+      _dragVelocity.length() > INERTIA_MIN_SPEED) {
+    _inertiaVelocity = _dragVelocity;
+    _inertiaRemainder = QVector2D();
+    _frameScheduler.requestTick();
+  }
+  _dragVelocity = QVector2D();
+  _dragTimer.invalidate();
+  // selected region stays, its outline goes
+  if (!_selectionRect.isNull()) {
+    _selectionRect = QRect();
+    _frameScheduler.requestFrame();
+  }
+}
+
+
+void Scene::_onFrameTick(double seconds)
+{
+  if (_inertiaVelocity.isNull()) {
+    return;
+  }
+  // camera turns by whole degrees, fractions add up over ticks
+  _inertiaRemainder += _inertiaVelocity * static_cast<float>(seconds);
+  const int dx = static_cast<int>(_inertiaRemainder.x());
+  const int dy = static_cast<int>(_inertiaRemainder.y());
+  _inertiaRemainder -= QVector2D(dx, dy);
+  if (dx != 0 || dy != 0) {
+    _currentCamera->rotate(dx, dy, 0);
+  }
+
+  _inertiaVelocity *= std::exp(-INERTIA_DECAY * static_cast<float>(seconds));
+  if (_inertiaVelocity.length() < INERTIA_MIN_SPEED) {
+    _inertiaVelocity = QVector2D();
+  } else {
+    _frameScheduler.requestTick();
   }
 }
 
@@ -355,6 +1889,13 @@ void Scene::setColorAxisMode(colorAxisMode value) {
 }
 
 
+void Scene::setColorStretch(ZHistogram::Stretch stretch) {
+  _colorStretch = stretch;
+  _zRampDirty = true;
+  update();
+}
+
+
 void Scene::attachCamera(QSharedPointer<Camera> camera) {
   if (_currentCamera) {
     disconnect(_currentCamera.data(), &Camera::changed, this, &Scene::_onCameraChanged);
@@ -365,7 +1906,7 @@ void Scene::attachCamera(QSharedPointer<Camera> camera) {
 
 
 void Scene::_onCameraChanged(const CameraState&) {
-  update();
+  _frameScheduler.requestFrame();
 }
 
 
@@ -373,46 +1914,196 @@ void Scene::setPickpointEnabled(bool enabled) {
   _pickpointEnabled = enabled;
   if (!enabled) {
     _highlitedPoint = QVector3D();
-    update();
+    _updateHighlightOverlay();
+  }
+}
+
+
+void Scene::setSelectionEnabled(bool enabled) {
+  _selectionEnabled = enabled;
+}
+
+
+void Scene::clearSelection() {
+  _selectionRect = QRect();
+  _selectionPlanes.clear();
+  _startSelectionQuery();
+  _frameScheduler.requestFrame();
+}
+
+
+void Scene::_selectScreenRect(const QRect& rect) {
+  // rectangle covers its right and bottom pixels too, so it isn't null while dragged
+  _selectionRect = rect;
+  const QRectF ndcRect(QPointF(2. * _selectionRect.left() / width() - 1, 1 - 2. * (_selectionRect.bottom() + 1) / height()),
+                       QPointF(2. * (_selectionRect.right() + 1) / width() - 1, 1 - 2. * _selectionRect.top() / height()));
+  const CameraState camera = _currentCamera->state();
+  _selectionPlanes = PointSelection::screenBoxPlanes(_projectionMatrix * _cameraMatrix * _worldMatrix, ndcRect,
+                                                     camera.frontClippingDistance, camera.rearClippingDistance);
+  _startSelectionQuery();
+  _frameScheduler.requestFrame();
+}
+
+
+void Scene::_startSelectionQuery() {
+  // drags outrun queries, only the latest region is queried after running one
+  if (_selectionWatcher.isRunning()) {
+    _selectionQueued = true;
+    return;
+  }
+  _selectionQueued = false;
+  _flushSelectionPoints();
+  const std::vector<QVector4D> planes = _selectionPlanes;
+  _selectionWatcher.setFuture(QtConcurrent::run([this, planes]() {
+    if (planes.empty()) {
+      // cleared selection has nothing in it
+      SelectionStats stats = {0, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, 0};
+      return stats;
+    }
+    return _selection.query(planes);
+  }));
+}
+
+
+void Scene::_addSelectionPoints(const PointStorage& points, const std::vector<PointChunk>& chunks) {
+  // running query reads selection, GUI doesn't wait for it
+  SelectionPoints pending = {&points, chunks};
+  _selectionPendingPoints.push_back(pending);
+  _flushSelectionPoints();
+}
+
+
+void Scene::_flushSelectionPoints() {
+  if (_selectionWatcher.isRunning()) {
+    return;
+  }
+  for (const auto& pending : _selectionPendingPoints) {
+    if (pending.chunks.empty()) {
+      _selection.addPoints(*pending.points);
+    } else {
+      _selection.addPoints(*pending.points, pending.chunks);
+    }
   }
+  _selectionPendingPoints.clear();
+}
+
+
+void Scene::_onSelectionQueried() {
+  _flushSelectionPoints();
+  if (_selectionQueued) {
+    _startSelectionQuery();
+    return;
+  }
+  emit selectionChanged(_selectionWatcher.result());
 }
 
 
 void Scene::clearPickedpoints() {
   _pickedPoints.clear();
   emit pickpointsChanged(_pickedPoints);
-  update();
+  _updatePickOverlay();
 }
 
 
-QVector3D Scene::_unproject(int x, int y) const {
-  // with Qt5.5 we can make use of new QVector3D::unproject()
+void Scene::_updatePickOverlay() {
+  for (Overlay::Id id : _pickOverlay) {
+    _overlay.remove(id);
+  }
+  _pickOverlay.clear();
+  for (const auto& point : _pickedPoints) {
+    _pickOverlay << _overlay.addMarker(point, PICKED_COLOR);
+  }
+  if (_pickedPoints.size() == 2) {
+    const QString distance = QString::number(_pickedPoints[0].distanceToPoint(_pickedPoints[1]));
+    _pickOverlay << _overlay.addPolyline(_pickedPoints, PICKED_COLOR, distance);
+  }
+  _frameScheduler.requestFrame();
+}
 
-  const QMatrix4x4 mvMatrix = _projectionMatrix * _cameraMatrix * _worldMatrix;
-  const QMatrix4x4 inverted = mvMatrix.inverted();
 
-  // normalized device coordinates
-  double ndcX = 2*(double)x / width() - 1;
-  double ndcY = 2*(double)(height() - y) / height() - 1;
-  QVector4D nearPoint4 = inverted * QVector4D(ndcX, ndcY, 1, 1);
-  QVector4D farPoint4 = inverted * QVector4D(ndcX, ndcY, -1, 1);
-  if (nearPoint4.w() == 0.0) {
-    return QVector3D();
+void Scene::_updateHighlightOverlay() {
+  // highlight marker follows cursor, just its vertices are rewritten
+  if (_highlitedPoint == QVector3D()) {
+    _overlay.remove(_highlightMarker);
+    _highlightMarker = 0;
+  } else if (_highlightMarker) {
+    _overlay.moveMarker(_highlightMarker, _highlitedPoint);
+  } else {
+    _highlightMarker = _overlay.addMarker(_highlitedPoint, HIGHLIGHT_COLOR);
   }
+  _frameScheduler.requestFrame();
+}
+
+
+Overlay::Id Scene::addMarker(const QVector3D& position, const QColor& color, const QString& label) {
+  const Overlay::Id id = _overlay.addMarker(position, color, label);
+  _frameScheduler.requestFrame();
+  return id;
+}
+
 
-  double w = 1.0/nearPoint4.w();
-  QVector3D nearPoint = QVector3D(nearPoint4);
-  nearPoint *= w;
+Overlay::Id Scene::addPolyline(const QVector<QVector3D>& points, const QColor& color, const QString& label) {
+  const Overlay::Id id = _overlay.addPolyline(points, color, label);
+  _frameScheduler.requestFrame();
+  return id;
+}
 
-  w = 1.0/farPoint4.w();
-  QVector3D farPoint = QVector3D(farPoint4);
-  farPoint *= w;
 
-  QVector3D direction = farPoint - nearPoint;
-  if (direction.z() == 0.0) {
-    return QVector3D();
+void Scene::removeAnnotation(Overlay::Id id) {
+  _overlay.remove(id);
+  _frameScheduler.requestFrame();
+}
+
+
+bool Scene::exportPly(const QString& plyFilePath, ExportRegion region) {
+  // points must stay in place while they're written, so loading and indexing are done
+  const bool ready = _tiles ? _tiles->isFinished() : (_loader && _pointIndexReady);
+  if (!ready || _exportWatcher.isRunning() || !_currentCamera) {
+    return false;
+  }
+  std::vector<QVector4D> planes;
+  QString comment = "exported by pcviewer";
+  if (region == EXPORT_CLIPPED) {
+    // whole view cut by clipping planes, as drawn
+    const CameraState camera = _currentCamera->state();
+    planes = PointSelection::screenBoxPlanes(_projectionMatrix * _cameraMatrix * _worldMatrix,
+                                             QRectF(QPointF(-1, -1), QPointF(1, 1)),
+                                             camera.frontClippingDistance, camera.rearClippingDistance);
+    comment += ", clipped view";
+  } else if (region == EXPORT_SELECTION) {
+    if (_selectionPlanes.empty()) {
+      return false;
+    }
+    planes = _selectionPlanes;
+    comment += ", selected box";
+  }
+  if (keptPointsCount() != _pointsCount) {
+    comment += QString(", voxel grid of %1").arg(_voxelGrid.voxelSize());
   }
 
-  double t = -nearPoint.z() / direction.z();
-  return nearPoint + direction * t;
+  _exportWatcher.setFuture(QtConcurrent::run([this, plyFilePath, planes, comment]() {
+    ExportResult result = {0, 0, QString()};
+    QElapsedTimer exportTimer;
+    exportTimer.start();
+    try {
+      // points are found in their files by rows, so every other property is kept
+      PlyWriter writer(pointsOrigin());
+      if (_tiles) {
+        for (int index = 0; index < _tiles->tilesCount(); ++index) {
+          const Tile& tile = _tiles->tile(index);
+          writer.addPoints(tile.points, tile.filePath, tile.firstRow);
+        }
+      } else {
+        writer.addPoints(_loader->points(), _loader->filePath());
+      }
+      writer.setRegion(planes);
+      writer.setComment(comment);
+      result.points = writer.write(plyFilePath);
+    } catch (const std::exception& e) {
+      result.error = e.what();
+    }
+    result.msecs = exportTimer.elapsed();
+    return result;
+  }));
+  return true;
 }
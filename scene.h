@@ -2,38 +2,153 @@
 
 #include <QOpenGLWidget>
 #include <QOpenGLFunctions>
+#include <QOpenGLFunctions_4_4_Core>
 #include <QOpenGLVertexArrayObject>
 #include <QOpenGLShaderProgram>
 #include <QOpenGLBuffer>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLTimeMonitor>
 #include <QMatrix4x4>
 #include <QVector3D>
 #include <QSharedPointer>
+#include <QFutureWatcher>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QVector2D>
 
 #include <camera.h>
+#include <plyloader.h>
+#include <pointindex.h>
+#include <pointselection.h>
+#include <lodoctree.h>
+#include <tileset.h>
+#include <framescheduler.h>
+#include <overlay.h>
+#include <voxelgrid.h>
+#include <zhistogram.h>
+#include <pointbudget.h>
+#include <indirectdraw.h>
 #include <vector>
 
 
+// what was submitted for drawing in last frame
+struct DrawStats {
+  int chunks;
+  int drawnChunks;
+  quint64 drawnPoints;
+};
+
+
+// where time of last frame went, by phase of paintGL
+struct FrameStats {
+  enum Phase {POINTS, OVERLAY, LABELS, PHASES_COUNT};
+  static const char* phaseName(int phase);
+
+  quint64 frame;
+  qint64 cpuUsecs[PHASES_COUNT];
+  // GPU timer query results arrive few frames late, -1 until then or without timer queries
+  qint64 gpuUsecs[PHASES_COUNT];
+  quint64 submittedPoints;
+  quint64 pointBudget;  // zero without budget
+  double fps;
+};
+
+
+// outcome of exporting points into PLY file
+struct ExportResult {
+  quint64 points;
+  qint64 msecs;
+  QString error;  // empty on success
+};
+
+
 class Scene : public QOpenGLWidget, protected QOpenGLFunctions
 {
   Q_OBJECT
 
 public:
   enum colorAxisMode {COLOR_BY_ROW, COLOR_BY_Z};
+  // compact vertices are 16-bit positions relative to bounds of their chunk
+  // with row in place of index, floats are kept as fallback
+  enum VertexFormat {FLOAT_VERTICES, COMPACT_VERTICES};
+  // GL backend: compatibility profile shaders (GLSL 1.30 with clip distances, or 1.20
+  // with fixed function clipping planes), or GL 4.4 core profile ones with visible chunks
+  // of in-memory points submitted by single indirect draw
+  enum Renderer {COMPATIBILITY_RENDERER, CORE_RENDERER};
+  // points exported: all loaded ones, ones between clipping planes within view, or selected ones
+  enum ExportRegion {EXPORT_ALL, EXPORT_CLIPPED, EXPORT_SELECTION};
+
+  // format of scenes created afterwards
+  static void setDefaultVertexFormat(VertexFormat format);
+  // PLY points of scenes created afterwards are reduced by voxel grid before upload,
+  // zero voxel size keeps all of them
+  static void setDefaultDownsampling(float voxelSize, VoxelGrid::Mode mode = VoxelGrid::CENTROID);
+  // core renderer asks for GL 4.4 core profile by default surface format of application
+  // if context of it can be made, false and compatibility renderer otherwise;
+  // call once application exists and before any window is shown
+  static bool setDefaultRenderer(Renderer renderer);
 
-  Scene(const QString& plyFilePath, QWidget* parent = 0);
+  // PLY files are loaded into memory, LOD octree files (*.lod) are streamed
+  Scene(const QString& filePath, QWidget* parent = 0);
+  // several PLY files or directories of them are loaded as tiles of one cloud
+  Scene(const QStringList& filePaths, QWidget* parent = 0);
   ~Scene();
 
+  bool isOutOfCore() const {return !_lod.isNull();}
+  // backend of this scene's context, compatibility one until it's initialized
+  Renderer renderer() const {return _core ? CORE_RENDERER : COMPATIBILITY_RENDERER;}
+  size_t pointsCount() const {return _pointsCount;}
+  // points left by downsampling once loaded, pointsCount() without it
+  size_t keptPointsCount() const;
+  // points are relative to it, add it for file coordinates
+  const double* pointsOrigin() const;
+  // repaints and continuous motion of this view go through it
+  FrameScheduler& frameScheduler() {return _frameScheduler;}
+
+  // persistent annotations over points (e.g. survey control points), positions are
+  // relative to pointsOrigin()
+  Overlay::Id addMarker(const QVector3D& position, const QColor& color, const QString& label = QString());
+  Overlay::Id addPolyline(const QVector<QVector3D>& points, const QColor& color, const QString& label = QString());
+  void removeAnnotation(Overlay::Id id);
+
+  // writes loaded points (kept ones if downsampled) with properties of their files in
+  // background, exportFinished() follows; false if points aren't in place yet, out-of-core
+  // view, another export is running or there's no selection to export
+  bool exportPly(const QString& plyFilePath, ExportRegion region);
+
 
 public slots:
   void setPointSize(size_t size);
   void setColorAxisMode(colorAxisMode value);
+  // how Z maps to intensity, histogram based ones follow drawn points once loaded points are measured
+  void setColorStretch(ZHistogram::Stretch stretch);
   void attachCamera(QSharedPointer<Camera> camera);
   void setPickpointEnabled(bool enabled);
   void clearPickedpoints();
+  // while enabled, rectangle dragged by left button selects points behind it
+  void setSelectionEnabled(bool enabled);
+  void clearSelection();
+  void cancelLoading();
+  // memory held for out-of-core view
+  void setLodMemoryBudget(size_t ramBytes, size_t gpuBytes);
+  // in-memory points and tiles are drawn within budget adapted to frame rate while view
+  // changes and refined over next frames once it's still, zero draws all points every frame
+  void setTargetFps(double fps);
 
 
 signals:
   void pickpointsChanged(const QVector<QVector3D> points);
+  void loadProgress(int percent);
+  void loadFinished(const LoadTimings& timings);
+  void loadFailed(const QString& error);
+  void pickIndexBuilt(qint64 msecs);
+  void pickQueryFinished(qint64 usecs);
+  // statistics of points in selected region, also when selection is cleared
+  void selectionChanged(const SelectionStats& stats);
+  void lodStatsChanged(const LodStats& stats);
+  void drawStatsChanged(const DrawStats& stats);
+  void frameStatsChanged(const FrameStats& stats);
+  void exportFinished(const ExportResult& result);
 
 
 protected:
@@ -43,40 +158,205 @@ protected:
 
   void mousePressEvent(QMouseEvent *event) Q_DECL_OVERRIDE;
   void mouseMoveEvent(QMouseEvent *event) Q_DECL_OVERRIDE;
+  void mouseReleaseEvent(QMouseEvent *event) Q_DECL_OVERRIDE;
 
 
 private slots:
   void _onCameraChanged(const CameraState& state);
+  void _onPointsLoaded(qulonglong first, qulonglong count, const QVector3D& boundMin, const QVector3D& boundMax);
+  void _onPointsDownsampled();
+  void _onTileLoaded(int index);
+  void _onPointIndexBuilt();
+  void _onSelectionQueried();
+  void _onZHistogramBuilt();
+  void _onFrameTick(double seconds);
 
 private:
-  void _loadPLY(const QString& plyFilePath);
+  size_t _vertexBytes() const;
+  void _setVertexAttributes();
+  void _setChunkBounds(QOpenGLShaderProgram& program, const PointChunk& chunk);
+  void _writeChunkBounds();
+  void _writeVertices(const PointStorage& points, const PointChunk& chunk);
+  void _writeShuffledVertices(const PointStorage& points, const std::vector<PointChunk>& chunks);
+  void _uploadPendingPoints();
+  DrawStats _drawLoadedPoints(QOpenGLShaderProgram& program);
+  void _startDownsampling();
+  void _startIndexing();
+  void _packShuffledVertices();
+  void _uploadShuffledChunks();
+  void _startCacheWrite();
+  DrawStats _drawChunks(const QMatrix4x4& viewMatrix, const CameraState& camera);
+  void _cullChunks(const QMatrix4x4& viewMatrix, const CameraState& camera, std::vector<int>& visible) const;
+  DrawStats _submitChunks(QOpenGLShaderProgram& program, const std::vector<int>& visible,
+                          double fromFraction, double toFraction);
+  bool _bindPointsFbo();
+  std::pair<double, double> _refineSlice(const QMatrix4x4& viewMatrix, const CameraState& camera,
+                                         const std::vector<int>& visible, quint64 visiblePoints);
+  bool _createPointShaders(bool clipDistances);
+  void _setClippingPlanes(QOpenGLShaderProgram& program, const CameraState& camera);
+  bool _pickOnGpu(const QPoint& pos, QVector3D& point);
+  quint64 _drawLodNodes(const QMatrix4x4& viewMatrix);
+  DrawStats _drawTiles(const QMatrix4x4& viewMatrix, const CameraState& camera);
+  void _beginFrameTiming();
+  void _endPhase(FrameStats::Phase phase);
+  void _endFrameTiming();
   void _cleanup();
-  void _drawFrameAxis();
-  QVector3D _unproject(int x, int y) const;
-  QVector3D _pickPointFrom2D(const QPoint& pos) const;
-  void _drawMarkerBox(const QVector3D& point, const QColor& color);
+  QVector3D _pickPointFrom2D(const QPoint& pos);
+  void _updatePickOverlay();
+  void _updateHighlightOverlay();
+  void _selectScreenRect(const QRect& rect);
+  void _startSelectionQuery();
+  void _addSelectionPoints(const PointStorage& points, const std::vector<PointChunk>& chunks);
+  void _flushSelectionPoints();
+  void _startZHistogram();
+  void _updateZRamp();
 
   float _pointSize;
   colorAxisMode _colorMode;
-  std::vector<std::pair<QVector3D, QColor> > _axesLines;
+  // frame axis, measuring tool and annotations
+  Overlay _overlay;
+  QVector<Overlay::Id> _pickOverlay;
+  Overlay::Id _highlightMarker;
 
   QPoint _prevMousePosition;
+  FrameScheduler _frameScheduler;
+  // rotation keeps going after drag with decaying speed, degrees per second
+  QElapsedTimer _dragTimer;
+  QVector2D _dragVelocity;
+  QVector2D _inertiaVelocity;
+  QVector2D _inertiaRemainder;
   QOpenGLVertexArrayObject _vao;
   QOpenGLBuffer _vertexBuffer;
   QScopedPointer<QOpenGLShaderProgram> _shaders;
+  // shaders clip by distances (GLSL 1.30 and core ones) rather than fixed function planes
+  bool _clipDistances;
+  bool _compactVertices;
+  // functions of GL 4.4 core profile context, null for compatibility renderer; bounds of
+  // chunks are instanced attributes read at base instance of their indirect draw commands
+  QOpenGLFunctions_4_4_Core* _core;
+  IndirectDraw _indirectDraw;
+  GLuint _chunkBoundsBuffer;
 
   QMatrix4x4 _projectionMatrix;
   QMatrix4x4 _cameraMatrix;
   QMatrix4x4 _worldMatrix;
 
-  QVector<float> _pointsData;
+  QScopedPointer<PlyLoader> _loader;
   size_t _pointsCount;
+  size_t _loadedPointsCount;
+  // loaded chunks waiting for upload, drawn ones and [first point, points count) ranges
+  // of drawn float vertices merged into few draw calls
+  std::vector<PointChunk> _pendingChunks;
+  std::vector<PointChunk> _loadedChunks;
+  std::vector<std::pair<size_t, size_t> > _loadedRanges;
+  qint64 _uploadNsecs;
+  bool _loadReported;
+  size_t _bufferPoints;
+
+  // loaded points are reduced in background before any of them is uploaded
+  VoxelGrid _voxelGrid;
+  QFutureWatcher<qint64> _downsampleWatcher;
+  QString _downsampleError;
+  bool _downsampled;
+
+  // out-of-core view, nodes of LOD octree get own vertex buffers within budget
+  struct LodGpuNode {
+    QOpenGLBuffer buffer;
+    size_t bytes;
+    quint64 lastFrame;
+  };
+  QScopedPointer<LodOctree> _lod;
+  QHash<quint32, LodGpuNode> _lodGpuNodes;
+  std::vector<quint32> _lodDrawnNodes;
+  size_t _lodGpuBytes;
+  size_t _lodGpuBudget;
+  quint64 _frame;
+  QElapsedTimer _lodOpenTimer;
+
+  // tiles of several PLY files, every loaded one gets own vertex buffer culled by its bounds
+  QScopedPointer<TileSet> _tiles;
+  std::vector<QOpenGLBuffer> _tileBuffers;
+  std::vector<int> _pendingTiles;
+  std::vector<int> _drawnTiles;
   QVector3D _pointsBoundMin;
   QVector3D _pointsBoundMax;
-  QVector3D _ray;
 
   QSharedPointer<Camera> _currentCamera;
 
+  // spatial index for measuring tool, built in background once points are loaded
+  PointIndex _pointIndex;
+  QFutureWatcher<qint64> _pointIndexWatcher;
+  bool _pointIndexReady;
+  // indexing reorders points, so buffer is drawn by spatial chunks culled against view
+  std::vector<PointChunk> _chunks;
+  bool _chunksUploaded;
+  // shuffled vertices of chunks are packed while indexing and uploaded few per frame
+  // into own buffer, it replaces one in load order once all of them are there
+  std::vector<std::vector<char> > _shuffledVertices;
+  size_t _uploadedChunks;
+  QOpenGLBuffer _chunksBuffer;
+  std::vector<int> _drawnChunks;
+  // cached points come in tree order with their tree, so nothing is built
+  bool _indexFromCache;
+  // cache is written once index is in use, canceling loading drops it
+  QFutureWatcher<bool> _cacheWriteWatcher;
+  QAtomicInt _cacheWriteCanceled;
+
+  // point ids are rendered around cursor and read back, CPU index is fallback
+  QScopedPointer<QOpenGLShaderProgram> _pickShaders;
+  QScopedPointer<QOpenGLFramebufferObject> _pickFbo;
+  bool _gpuPickAvailable;
+
+  // phase timers of frames in flight, GPU results are read once available
+  FrameStats _frameStats;
+  QElapsedTimer _phaseTimer;
+  std::vector<QOpenGLTimeMonitor*> _timeMonitors;
+  std::vector<bool> _timeMonitorsPending;
+  std::vector<quint64> _timeMonitorsPoints;  // budgeted points of frame, zero without budget
+  QOpenGLTimeMonitor* _timeMonitor;
+  QElapsedTimer _fpsTimer;
+  int _fpsFrames;
+
+  // box selection: rectangle dragged on screen becomes planes of points space, points
+  // between them are counted in background and highlighted by vertex shader
+  PointSelection _selection;
+  bool _selectionEnabled;
+  QPoint _selectionStart;
+  QRect _selectionRect;  // outline while dragging
+  std::vector<QVector4D> _selectionPlanes;  // empty without selection
+  QFutureWatcher<SelectionStats> _selectionWatcher;
+  bool _selectionQueued;
+  // points loaded while query runs are added once it's done, empty chunks for rows split
+  struct SelectionPoints {
+    const PointStorage* points;
+    std::vector<PointChunk> chunks;
+  };
+  std::vector<SelectionPoints> _selectionPendingPoints;
+
+  // coloring by Z: intensity is looked up in ramp texture by Z within ramp range,
+  // ramp of stretch by histogram is made again whenever drawn chunks or tiles change
+  ZHistogram _zHistogram;
+  QFutureWatcher<void> _zHistogramWatcher;
+  bool _zHistogramReady;
+  ZHistogram::Stretch _colorStretch;
+  GLuint _zRampTexture;
+  bool _zRampDirty;
+  float _zRampMin;
+  float _zRampMax;
+  quint64 _zRampVersion;
+
+  // points of budgeted frames accumulate in own framebuffer copied into widget's one,
+  // fraction of visible chunks drawn so far is kept while view and its chunks stay the same
+  PointBudget _pointBudget;
+  QScopedPointer<QOpenGLFramebufferObject> _pointsFbo;
+  GLint _viewport[4];
+  bool _refining;
+  double _refinedFraction;
+  std::vector<float> _refineView;
+  std::vector<int> _refineChunks;
+
+  QFutureWatcher<ExportResult> _exportWatcher;
+
   bool _pickpointEnabled;
   QVector<QVector3D> _pickedPoints;
   QVector3D _highlitedPoint;
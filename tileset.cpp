@@ -0,0 +1,201 @@
+#include "tileset.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+
+namespace {
+
+// points decoded at once by tile task
+const size_t SCAN_BATCH_POINTS = 1 << 16;
+
+} // namespace
+
+
+QStringList TileSet::tileFiles(const QStringList& paths)
+{
+  QStringList files;
+  for (const auto& path : paths) {
+    if (QFileInfo(path).isDir()) {
+      const QDir dir(path);
+      for (const auto& name : dir.entryList(QStringList() << "*.ply" << "*.PLY" << "*.ply.gz" << "*.PLY.GZ", QDir::Files, QDir::Name)) {
+        files << dir.filePath(name);
+      }
+    } else {
+      files << path;
+    }
+  }
+  return files;
+}
+
+
+TileSet::TileSet(const QStringList& plyFilePaths, QObject* parent)
+  : QObject(parent),
+    _pointsCount(0),
+    _voxelGrid(0),
+    _canceled(0),
+    _finished(false),
+    _boundsNsecs(0),
+    _downsampleNsecs(0),
+    _indexNsecs(0)
+{
+  _timings.header = _timings.parse = _timings.bounds = _timings.upload = _timings.downsample = 0;
+  _timings.cacheHit = false;
+  std::fill(_origin, _origin + 3, 0.);
+  if (plyFilePaths.isEmpty()) {
+    throw std::runtime_error("no ply files to open");
+  }
+
+  QElapsedTimer headerTimer;
+  headerTimer.start();
+  for (const auto& path : plyFilePaths) {
+    std::unique_ptr<Tile> tile(new Tile());
+    tile->filePath = path;
+    tile->firstRow = _pointsCount;
+    try {
+      const PlyHeader header = PlyHeader::read(path);
+      const int vertexIndex = header.elementIndex("vertex");
+      tile->pointsCount = vertexIndex >= 0 ? header.elements[vertexIndex].count : 0;
+    } catch (const std::exception& e) {
+      throw std::runtime_error(QFileInfo(path).fileName().toStdString() + ": " + e.what());
+    }
+    _pointsCount += tile->pointsCount;
+    _tiles.push_back(std::move(tile));
+  }
+  // tiles are drawn together, so they share origin near first point of the set
+  const PlyLoader first(plyFilePaths[0]);
+  std::copy(first.origin(), first.origin() + 3, _origin);
+  _timings.header = headerTimer.elapsed();
+
+  connect(&_loadWatcher, &QFutureWatcher<void>::finished, this, &TileSet::_onTilesLoaded);
+}
+
+
+TileSet::~TileSet()
+{
+  cancel();
+}
+
+
+void TileSet::start()
+{
+  _loadTimer.start();
+  _loading.resize(_tiles.size());
+  std::iota(_loading.begin(), _loading.end(), 0);
+  _loadWatcher.setFuture(QtConcurrent::map(_loading, [this](int index) {_loadTile(index);}));
+}
+
+
+void TileSet::cancel()
+{
+  _canceled.store(1);
+  _loadWatcher.cancel();
+  _loadWatcher.waitForFinished();
+}
+
+
+LoadTimings TileSet::timings() const
+{
+  LoadTimings t = _timings;
+  t.bounds = _boundsNsecs.load() / 1000000;
+  t.downsample = _downsampleNsecs.load() / 1000000;
+  return t;
+}
+
+
+void TileSet::_loadTile(int index)
+{
+  if (_canceled.load()) {
+    return;
+  }
+
+  Tile& tile = *_tiles[index];
+  try {
+    PlyLoader loader(tile.filePath);
+    loader.setOrigin(_origin);
+    tile.points.allocate(loader.pointsCount());
+    tile.boundMin = QVector3D(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                              std::numeric_limits<float>::max());
+    tile.boundMax = -tile.boundMin;
+
+    // decoded batches are copied into tile with rows of whole set
+    qint64 boundsNsecs = 0;
+    const bool complete = loader.scan(SCAN_BATCH_POINTS, [&](const float* batch, size_t first, size_t count) {
+      if (_canceled.load()) {
+        return false;
+      }
+      tile.points.forEachRun(first, count, [&](float* run, size_t runFirst, size_t runCount) {
+        std::memcpy(run, batch, runCount * POINT_STRIDE * sizeof(float));
+        for (size_t i = 0; i < runCount; ++i) {
+          run[i * POINT_STRIDE + 3] = static_cast<float>(tile.firstRow + runFirst + i);
+        }
+        batch += runCount * POINT_STRIDE;
+        return true;
+      });
+
+      QElapsedTimer boundsTimer;
+      boundsTimer.start();
+      tile.points.forEachRun(first, count, [&](const float* run, size_t, size_t runCount) {
+        for (size_t i = 0; i < runCount; ++i, run += POINT_STRIDE) {
+          for (int axis = 0; axis < 3; ++axis) {
+            tile.boundMin[axis] = std::min(run[axis], tile.boundMin[axis]);
+            tile.boundMax[axis] = std::max(run[axis], tile.boundMax[axis]);
+          }
+        }
+        return true;
+      });
+      boundsNsecs += boundsTimer.nsecsElapsed();
+      return true;
+    });
+    _boundsNsecs.fetchAndAddRelaxed(boundsNsecs);
+    if (_canceled.load()) {
+      return;
+    }
+    if (!complete) {
+      throw std::runtime_error("broken ply file");
+    }
+
+    if (_voxelGrid.voxelSize() > 0 && !tile.points.empty()) {
+      QElapsedTimer downsampleTimer;
+      downsampleTimer.start();
+      PointStorage reduced;
+      _voxelGrid.downsample(tile.points, tile.boundMin, tile.boundMax, reduced);
+      tile.points.swap(reduced);
+      _downsampleNsecs.fetchAndAddRelaxed(downsampleTimer.nsecsElapsed());
+    }
+
+    QElapsedTimer indexTimer;
+    indexTimer.start();
+    tile.index.build(tile.points);
+    _indexNsecs.fetchAndAddRelaxed(indexTimer.nsecsElapsed());
+  } catch (const std::exception& e) {
+    QMutexLocker locker(&_errorMutex);
+    if (_error.isEmpty()) {
+      _error = QFileInfo(tile.filePath).fileName() + ": " + QString::fromLocal8Bit(e.what());
+    }
+    return;
+  }
+  emit tileLoaded(index);
+}
+
+
+void TileSet::_onTilesLoaded()
+{
+  if (_canceled.load()) {
+    return;
+  }
+  _timings.parse = _loadTimer.elapsed();
+  if (!_error.isEmpty()) {
+    emit failed(_error);
+    return;
+  }
+  _finished = true;
+  emit finished();
+}
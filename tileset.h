@@ -0,0 +1,100 @@
+#pragma once
+
+#include <QObject>
+#include <QStringList>
+#include <QVector3D>
+#include <QFutureWatcher>
+#include <QElapsedTimer>
+#include <QAtomicInteger>
+#include <QMutex>
+
+#include "plyloader.h"
+#include "pointindex.h"
+#include "voxelgrid.h"
+
+#include <memory>
+#include <vector>
+
+
+// PLY file of tile set, points are relative to origin of set
+struct Tile {
+  QString filePath;
+  size_t pointsCount;  // in file
+  size_t firstRow;     // rows continue from tile to tile, so coloring by row spans set
+  PointStorage points;
+  PointIndex index;    // for measuring tool
+  QVector3D boundMin;
+  QVector3D boundMax;
+};
+
+
+//
+// Many PLY files (tiles of mapping run) loaded as one cloud.
+//
+// Headers are read in constructor, so wrong files fail early, and points of all
+// tiles are stored relative to origin of the first one. After start() tiles are
+// decoded, bounded, optionally downsampled and indexed by thread pool, tile per task,
+// so loading scales with cores once there are more tiles than cores.
+// Tiles are announced as they're done and don't change afterwards.
+//
+class TileSet : public QObject
+{
+  Q_OBJECT
+
+public:
+  // directories are replaced by *.ply and *.ply.gz files in them sorted by name
+  static QStringList tileFiles(const QStringList& paths);
+
+  TileSet(const QStringList& plyFilePaths, QObject* parent = 0);
+  ~TileSet();
+
+  // tiles are reduced by given grid, zero voxel size keeps all points; call before start()
+  void setDownsampling(const VoxelGrid& grid) {_voxelGrid = grid;}
+  void start();
+  void cancel();
+
+  int tilesCount() const {return static_cast<int>(_tiles.size());}
+  // valid once announced with tileLoaded()
+  const Tile& tile(int index) const {return *_tiles[index];}
+  size_t pointsCount() const {return _pointsCount;}
+  const double* origin() const {return _origin;}
+  bool isFinished() const {return _finished;}
+  // parse is wall time of all tiles, bounds and downsample are summed over workers
+  LoadTimings timings() const;
+  // summed over workers
+  qint64 indexMsecs() const {return _indexNsecs.load() / 1000000;}
+
+
+signals:
+  // emitted by loading threads
+  void tileLoaded(int index);
+  void finished();
+  void failed(const QString& error);
+
+
+private slots:
+  void _onTilesLoaded();
+
+
+private:
+  void _loadTile(int index);
+
+  std::vector<std::unique_ptr<Tile> > _tiles;
+  std::vector<int> _loading;
+  size_t _pointsCount;
+  double _origin[3];
+  VoxelGrid _voxelGrid;
+
+  QFutureWatcher<void> _loadWatcher;
+  QAtomicInt _canceled;
+  bool _finished;
+  // of first broken tile
+  QMutex _errorMutex;
+  QString _error;
+
+  QElapsedTimer _loadTimer;
+  LoadTimings _timings;
+  QAtomicInteger<qint64> _boundsNsecs;
+  QAtomicInteger<qint64> _downsampleNsecs;
+  QAtomicInteger<qint64> _indexNsecs;
+};
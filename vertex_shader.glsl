@@ -2,18 +2,47 @@
 
 uniform float pointSize;
 uniform mat4 viewMatrix;
+// compact vertices are 0..1 within their chunk bounds and row is 0..1 of rows,
+// floats come with zero min, unit size and scale
+uniform vec3 chunkMin;
+uniform vec3 chunkSize;
+uniform float rowScale;
+// points on inner side of all planes of box selection are highlighted
+uniform float selectionActive;
+uniform vec4 selectionPlanes[8];
+// GLSL 1.30 version (see Scene::_createPointShaders()) clips by rear and front planes
+// of clip coordinates like pick shader, 1.20 one by fixed function planes
+#ifdef CLIP_DISTANCES
+uniform vec4 clippingPlanes[2];
+#endif
 
 attribute vec4 vertex;
 attribute float pointRowIndex;
 
 varying float pointIdx;
 varying vec3 vert;
+varying float selected;
 
 void main() {
-  gl_Position = viewMatrix * vertex;
+  vec4 position = vec4(chunkMin + vertex.xyz * chunkSize, 1.0);
+  gl_Position = viewMatrix * position;
   gl_PointSize  = pointSize;
+#ifdef CLIP_DISTANCES
+  gl_ClipDistance[0] = dot(clippingPlanes[0], gl_Position);
+  gl_ClipDistance[1] = dot(clippingPlanes[1], gl_Position);
+#else
+  gl_ClipVertex = gl_Position;
+#endif
 
   // for use in fragment shader
-  pointIdx = pointRowIndex;
-  vert = vertex.xyz;
+  pointIdx = pointRowIndex * rowScale;
+  vert = position.xyz;
+  selected = selectionActive;
+  if (selectionActive > 0.5) {
+    for (int i = 0; i < 8; ++i) {
+      if (dot(selectionPlanes[i], position) < 0.0) {
+        selected = 0.0;
+      }
+    }
+  }
 }
@@ -10,6 +10,12 @@
 #include <QGroupBox>
 #include <QCheckBox>
 #include <QSlider>
+#include <QProgressBar>
+#include <QSpinBox>
+#include <QFormLayout>
+#include <QFileDialog>
+#include <QFile>
+#include <QElapsedTimer>
 
 #include "camera.h"
 #include "scene.h"
@@ -18,6 +24,37 @@
 #include <cassert>
 
 
+// camera steps per second of held movement key, close to usual key auto-repeat
+const double KEY_STEPS_PER_SECOND = 30;
+
+
+// direction of movement key in camera steps, null for other keys
+QVector3D keyMotion(int key)
+{
+  switch (key) {
+    case Qt::Key_Left:
+    case Qt::Key_A:
+      return QVector3D(1, 0, 0);
+    case Qt::Key_Right:
+    case Qt::Key_D:
+      return QVector3D(-1, 0, 0);
+    case Qt::Key_Up:
+    case Qt::Key_W:
+      return QVector3D(0, 0, 1);
+    case Qt::Key_Down:
+    case Qt::Key_S:
+      return QVector3D(0, 0, -1);
+    case Qt::Key_Space:
+    case Qt::Key_Q:
+      return QVector3D(0, -1, 0);
+    case Qt::Key_C:
+    case Qt::Key_Z:
+      return QVector3D(0, 1, 0);
+    default:
+      return QVector3D();
+  }
+}
+
 
 QSlider* createAnglecontrolSlider()
 {
@@ -29,7 +66,7 @@ QSlider* createAnglecontrolSlider()
 }
 
 
-Viewer::Viewer(const QString& filePath)
+Viewer::Viewer(const QStringList& filePaths)
 {
   // accept keyboard input
   setFocusPolicy(Qt::StrongFocus);
@@ -38,8 +75,10 @@ Viewer::Viewer(const QString& filePath)
   //
   // make and connect scene widget
   //
-  _scene = new Scene(filePath);
+  _scene = new Scene(filePaths);
   connect(_scene, &Scene::pickpointsChanged, this, &Viewer::_updateMeasureInfo);
+  connect(_scene, &Scene::loadFailed, this, &Viewer::loadFailed);
+  connect(&_scene->frameScheduler(), &FrameScheduler::tick, this, &Viewer::_moveByHeldKeys);
 
   //
   // make shared camera
@@ -79,6 +118,12 @@ Viewer::Viewer(const QString& filePath)
   connect(cbColorMode, static_cast<void(QComboBox::*)( int ) >(&QComboBox::currentIndexChanged), [=](const int newValue) {
     _scene->setColorAxisMode(newValue == 0 ? Scene::COLOR_BY_Z : Scene::COLOR_BY_ROW);
   });
+  // order of items is order of stretches
+  auto cbColorStretch = new QComboBox();
+  cbColorStretch->addItems(QStringList()<<"Z linear"<<"Z percentile 2-98%"<<"Z equalized");
+  connect(cbColorStretch, static_cast<void(QComboBox::*)( int ) >(&QComboBox::currentIndexChanged), [=](const int newValue) {
+    _scene->setColorStretch(static_cast<ZHistogram::Stretch>(newValue));
+  });
 
   //
   // make 'clipping planes' controllers
@@ -121,14 +166,211 @@ Viewer::Viewer(const QString& filePath)
     _scene->setPickpointEnabled(state == Qt::Checked);
   });
 
+  // box selection takes left drag over from rotation, shift still pans
+  auto cbSelectBox = new QCheckBox(tr("Select box (drag)"));
+  cbSelectBox->setChecked(false);
+  connect(cbSelectBox, &QCheckBox::toggled, [=](bool checked) {
+    _scene->setSelectionEnabled(checked);
+  });
+  _lblSelectionInfo = new QLabel();
+  connect(_scene, &Scene::selectionChanged, this, &Viewer::_updateSelectionInfo);
+
   auto btnClearMT = new QPushButton(tr("Clear"));
   btnClearMT->setMaximumWidth(100);
   connect(btnClearMT, &QPushButton::pressed, [=]() {
     _scene->clearPickedpoints();
+    _scene->clearSelection();
+  });
+
+  // spatial index timings
+  auto lblPickInfo = new QLabel(tr("Indexing..."));
+  auto pickIndexMsecs = QSharedPointer<qint64>(new qint64(0));
+  connect(_scene, &Scene::pickIndexBuilt, [=](qint64 msecs) {
+    *pickIndexMsecs = msecs;
+    lblPickInfo->setText(tr("Index built: %1 ms").arg(msecs));
   });
+  connect(_scene, &Scene::pickQueryFinished, [=](qint64 usecs) {
+    lblPickInfo->setText(tr("Index built: %1 ms\nPick query: %2 us").arg(*pickIndexMsecs).arg(usecs));
+  });
+
   mtLayout->addWidget(cbActiveMT);
+  mtLayout->addWidget(cbSelectBox);
   mtLayout->addWidget(btnClearMT);
   mtLayout->addWidget(_lblDistanceInfo);
+  mtLayout->addWidget(_lblSelectionInfo);
+  mtLayout->addWidget(lblPickInfo);
+
+  //
+  // compose 'Export' group
+  //
+  auto gbExport = new QGroupBox(tr("Export"));
+  auto exLayout = new QVBoxLayout();
+  gbExport->setLayout(exLayout);
+  auto cbExportRegion = new QComboBox();
+  // order of items is order of export regions
+  cbExportRegion->addItems(QStringList()<<"All points"<<"Clipped view"<<"Selected box");
+  auto lblExportInfo = new QLabel();
+  auto btnExport = new QPushButton(tr("Export PLY..."));
+  btnExport->setMaximumWidth(120);
+  connect(btnExport, &QPushButton::pressed, [=]() {
+    const QString path = QFileDialog::getSaveFileName(this, tr("Export points"), QString(), "PLY (*.ply)");
+    if (path.isEmpty()) {
+      return;
+    }
+    const auto region = static_cast<Scene::ExportRegion>(cbExportRegion->currentIndex());
+    if (_scene->exportPly(path, region)) {
+      btnExport->setEnabled(false);
+      lblExportInfo->setText(tr("Exporting..."));
+    } else {
+      lblExportInfo->setText(region == Scene::EXPORT_SELECTION ? tr("Nothing selected or points not ready")
+                                                               : tr("Points not ready"));
+    }
+  });
+  connect(_scene, &Scene::exportFinished, [=](const ExportResult& result) {
+    btnExport->setEnabled(true);
+    lblExportInfo->setText(result.error.isEmpty() ? tr("Exported %1 points in %2 ms").arg(result.points).arg(result.msecs)
+                                                  : tr("Export failed: %1").arg(result.error));
+  });
+  exLayout->addWidget(cbExportRegion);
+  exLayout->addWidget(btnExport);
+  exLayout->addWidget(lblExportInfo);
+  gbExport->setVisible(!_scene->isOutOfCore());
+
+  //
+  // make loading progress and timings info
+  //
+  auto pbLoading = new QProgressBar();
+  pbLoading->setRange(0, 100);
+  pbLoading->setValue(0);
+  _lblLoadInfo = new QLabel(tr("Loading..."));
+  auto lblDrawInfo = new QLabel();
+  connect(_scene, &Scene::drawStatsChanged, [=](const DrawStats& stats) {
+    lblDrawInfo->setText(tr("Drawn chunks: %1 of %2\nDrawn points: %3")
+                         .arg(stats.drawnChunks).arg(stats.chunks).arg(stats.drawnPoints));
+  });
+  connect(_scene, &Scene::loadProgress, pbLoading, &QProgressBar::setValue);
+  connect(_scene, &Scene::loadFinished, [=](const LoadTimings& timings) {
+    pbLoading->hide();
+    QString info = tr("Header: %1 ms\nParse: %2 ms\nBounds: %3 ms\nUpload: %4 ms\nCache: %5")
+        .arg(timings.header).arg(timings.parse).arg(timings.bounds).arg(timings.upload)
+        .arg(timings.cacheHit ? tr("hit") : tr("miss"));
+    if (_scene->keptPointsCount() != _scene->pointsCount()) {
+      info += tr("\nVoxel grid: %1 ms, %2 of %3 points kept")
+          .arg(timings.downsample).arg(_scene->keptPointsCount()).arg(_scene->pointsCount());
+    }
+    _lblLoadInfo->setText(info);
+  });
+
+  //
+  // make out-of-core memory budget controls and stats
+  //
+  auto gbLodBudget = new QGroupBox(tr("Memory budget"));
+  auto lbLayout = new QFormLayout();
+  gbLodBudget->setLayout(lbLayout);
+  auto sbRamBudget = new QSpinBox();
+  sbRamBudget->setRange(64, 1 << 20);
+  sbRamBudget->setSingleStep(256);
+  sbRamBudget->setSuffix(tr(" MB"));
+  sbRamBudget->setValue(1024);
+  auto sbGpuBudget = new QSpinBox();
+  sbGpuBudget->setRange(64, 1 << 20);
+  sbGpuBudget->setSingleStep(128);
+  sbGpuBudget->setSuffix(tr(" MB"));
+  sbGpuBudget->setValue(512);
+  auto updateBudget = [=]() {
+    _scene->setLodMemoryBudget(size_t(sbRamBudget->value()) << 20, size_t(sbGpuBudget->value()) << 20);
+  };
+  connect(sbRamBudget, static_cast<void(QSpinBox::*)(int)>(&QSpinBox::valueChanged), updateBudget);
+  connect(sbGpuBudget, static_cast<void(QSpinBox::*)(int)>(&QSpinBox::valueChanged), updateBudget);
+  auto lblLodStats = new QLabel();
+  connect(_scene, &Scene::lodStatsChanged, [=](const LodStats& stats) {
+    lblLodStats->setText(tr("Nodes: %1 of %2\nPoints: %3\nRAM: %4 MB\nGPU: %5 MB")
+                         .arg(stats.drawnNodes).arg(stats.selectedNodes).arg(stats.drawnPoints)
+                         .arg(stats.cachedBytes >> 20).arg(stats.gpuBytes >> 20));
+  });
+  lbLayout->addRow(tr("RAM"), sbRamBudget);
+  lbLayout->addRow(tr("GPU"), sbGpuBudget);
+  lbLayout->addRow(lblLodStats);
+  gbLodBudget->setVisible(_scene->isOutOfCore());
+  updateBudget();
+
+  //
+  // make frame statistics HUD and CSV recording
+  //
+  auto gbFrameStats = new QGroupBox(tr("Frame statistics"));
+  auto fsLayout = new QVBoxLayout();
+  gbFrameStats->setLayout(fsLayout);
+  // point budget holds frame rate of large clouds, rest of points comes while view is still
+  auto sbTargetFps = new QSpinBox();
+  sbTargetFps->setRange(0, 240);
+  sbTargetFps->setSingleStep(10);
+  sbTargetFps->setPrefix(tr("Target FPS: "));
+  sbTargetFps->setSpecialValueText(tr("Point budget: off"));
+  connect(sbTargetFps, static_cast<void(QSpinBox::*)(int)>(&QSpinBox::valueChanged), [=](int fps) {
+    _scene->setTargetFps(fps);
+  });
+  sbTargetFps->setVisible(!_scene->isOutOfCore());
+  auto cbShowFrameStats = new QCheckBox(tr("Show"));
+  auto lblFrameStats = new QLabel();
+  lblFrameStats->setVisible(false);
+  connect(cbShowFrameStats, &QCheckBox::toggled, lblFrameStats, &QLabel::setVisible);
+  auto btnRecordFrameStats = new QPushButton(tr("Record CSV..."));
+  btnRecordFrameStats->setCheckable(true);
+  btnRecordFrameStats->setMaximumWidth(120);
+  auto frameStatsCsv = QSharedPointer<QFile>(new QFile());
+  auto csvTimer = QSharedPointer<QElapsedTimer>(new QElapsedTimer());
+  connect(btnRecordFrameStats, &QPushButton::toggled, [=](bool checked) {
+    frameStatsCsv->close();
+    if (!checked) {
+      btnRecordFrameStats->setText(tr("Record CSV..."));
+      return;
+    }
+    const QString path = QFileDialog::getSaveFileName(this, tr("Record frame statistics"), QString(), "CSV (*.csv)");
+    frameStatsCsv->setFileName(path);
+    if (path.isEmpty() || !frameStatsCsv->open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+      btnRecordFrameStats->setChecked(false);
+      return;
+    }
+    QByteArray header = "frame,msecs,fps,submittedPoints";
+    for (int phase = 0; phase < FrameStats::PHASES_COUNT; ++phase) {
+      header += QByteArray(",cpu_") + FrameStats::phaseName(phase) + "_us";
+    }
+    for (int phase = 0; phase < FrameStats::PHASES_COUNT; ++phase) {
+      header += QByteArray(",gpu_") + FrameStats::phaseName(phase) + "_us";
+    }
+    frameStatsCsv->write(header + "\n");
+    csvTimer->start();
+    btnRecordFrameStats->setText(tr("Stop recording"));
+  });
+  connect(_scene, &Scene::frameStatsChanged, [=](const FrameStats& stats) {
+    if (lblFrameStats->isVisible()) {
+      QString text = tr("FPS: %1\nSubmitted points: %2\nPhase: CPU / GPU us")
+          .arg(stats.fps, 0, 'f', 1).arg(stats.submittedPoints);
+      for (int phase = 0; phase < FrameStats::PHASES_COUNT; ++phase) {
+        const QString gpu = stats.gpuUsecs[phase] < 0 ? tr("n/a") : QString::number(stats.gpuUsecs[phase]);
+        text += tr("\n%1: %2 / %3").arg(FrameStats::phaseName(phase)).arg(stats.cpuUsecs[phase]).arg(gpu);
+      }
+      if (stats.pointBudget > 0) {
+        text += tr("\nPoint budget: %1").arg(stats.pointBudget);
+      }
+      lblFrameStats->setText(text);
+    }
+    if (frameStatsCsv->isOpen()) {
+      QString line = QString("%1,%2,%3,%4").arg(stats.frame).arg(csvTimer->elapsed())
+          .arg(stats.fps, 0, 'f', 2).arg(stats.submittedPoints);
+      for (int phase = 0; phase < FrameStats::PHASES_COUNT; ++phase) {
+        line += QString(",%1").arg(stats.cpuUsecs[phase]);
+      }
+      for (int phase = 0; phase < FrameStats::PHASES_COUNT; ++phase) {
+        line += QString(",%1").arg(stats.gpuUsecs[phase]);
+      }
+      frameStatsCsv->write(line.toLatin1() + "\n");
+    }
+  });
+  fsLayout->addWidget(sbTargetFps);
+  fsLayout->addWidget(cbShowFrameStats);
+  fsLayout->addWidget(btnRecordFrameStats);
+  fsLayout->addWidget(lblFrameStats);
 
   //
   // compose control panel
@@ -141,6 +383,7 @@ Viewer::Viewer(const QString& filePath)
   controlPanel->addWidget(pointSizeSlider);
   controlPanel->addSpacing(20);
   controlPanel->addWidget(cbColorMode);
+  controlPanel->addWidget(cbColorStretch);
   controlPanel->addSpacing(40);
   controlPanel->addWidget(new QLabel(tr("Camera angles")));
   controlPanel->addWidget(xSlider);
@@ -154,7 +397,13 @@ Viewer::Viewer(const QString& filePath)
   controlPanel->addWidget(farClippingPlaneSlider);
   controlPanel->addSpacing(20);
   controlPanel->addWidget(gbMeasuringTool);
+  controlPanel->addWidget(gbExport);
+  controlPanel->addWidget(gbLodBudget);
+  controlPanel->addWidget(gbFrameStats);
   controlPanel->addStretch(2);
+  controlPanel->addWidget(pbLoading);
+  controlPanel->addWidget(_lblLoadInfo);
+  controlPanel->addWidget(lblDrawInfo);
 
   //
   // compose main layout
@@ -173,6 +422,7 @@ Viewer::Viewer(const QString& filePath)
 
   _updatePointSize(1);
   cbColorMode->setCurrentIndex(0);
+  cbColorStretch->setCurrentIndex(ZHistogram::PERCENTILE_STRETCH);
 
   _camera->setPosition(QVector3D(0, -0.1, -0.2));
   _camera->rotate(0, 50, 0);
@@ -181,6 +431,11 @@ Viewer::Viewer(const QString& filePath)
 }
 
 
+void Viewer::cancelLoading() {
+  _scene->cancelLoading();
+}
+
+
 void Viewer::wheelEvent(QWheelEvent* e) {
   if (e->angleDelta().y() > 0) {
     _camera->forward();
@@ -191,45 +446,50 @@ void Viewer::wheelEvent(QWheelEvent* e) {
 
 
 void Viewer::keyPressEvent(QKeyEvent* keyEvent) {
-  switch ( keyEvent->key() )
-  {
-    case Qt::Key_Escape:
-      QApplication::instance()->quit();  // DEV MODE
-      break;
+  if (keyEvent->key() == Qt::Key_Escape) {
+    QApplication::instance()->quit();  // DEV MODE
+    return;
+  }
 
-    case Qt::Key_Left:
-    case Qt::Key_A:
-      _camera->left();
-      break;
+  const QVector3D motion = keyMotion(keyEvent->key());
+  if (motion.isNull()) {
+    QWidget::keyPressEvent(keyEvent);
+    return;
+  }
+  // auto-repeat is ignored, held keys move camera every frame tick
+  if (!keyEvent->isAutoRepeat() && !_heldKeys.contains(keyEvent->key())) {
+    _heldKeys.insert(keyEvent->key());
+    // single press moves by step right away
+    _camera->move(motion);
+    _scene->frameScheduler().requestTick();
+  }
+}
 
-    case Qt::Key_Right:
-    case Qt::Key_D:
-      _camera->right();
-      break;
 
-    case Qt::Key_Up:
-    case Qt::Key_W:
-      _camera->forward();
-      break;
+void Viewer::keyReleaseEvent(QKeyEvent* keyEvent) {
+  if (keyEvent->isAutoRepeat() || !_heldKeys.remove(keyEvent->key())) {
+    QWidget::keyReleaseEvent(keyEvent);
+  }
+}
 
-    case Qt::Key_Down:
-    case Qt::Key_S:
-      _camera->backward();
-      break;
 
-    case Qt::Key_Space:
-    case Qt::Key_Q:
-      _camera->up();
-      break;
+void Viewer::focusOutEvent(QFocusEvent* event) {
+  // releases aren't delivered without focus
+  _heldKeys.clear();
+  QWidget::focusOutEvent(event);
+}
 
-    case Qt::Key_C:
-    case Qt::Key_Z:
-      _camera->down();
-      break;
 
-    default:
-      QWidget::keyPressEvent(keyEvent);
+void Viewer::_moveByHeldKeys(double seconds) {
+  if (_heldKeys.isEmpty()) {
+    return;
   }
+  QVector3D motion;
+  for (int key : _heldKeys) {
+    motion += keyMotion(key);
+  }
+  _camera->move(motion * static_cast<float>(seconds * KEY_STEPS_PER_SECOND));
+  _scene->frameScheduler().requestTick();
 }
 
 
@@ -240,18 +500,51 @@ void Viewer::_updatePointSize(int value) {
 
 
 void Viewer::_updateMeasureInfo(const QVector<QVector3D>& points) {
+  // points are shown in file coordinates, they're relative to origin in scene
+  const double* origin = _scene->pointsOrigin();
+  auto coordinates = [origin](const QVector3D& p) {
+    return tr("(%1,  %2,  %3)\n").arg(origin[0] + p.x(), 0, 'g', 10)
+                                 .arg(origin[1] + p.y(), 0, 'g', 10)
+                                 .arg(origin[2] + p.z(), 0, 'g', 10);
+  };
+
   QString text;
   if (!points.empty()) {
-    const QVector3D& p = points[0];
-    text += tr("(%1,  %2,  %3)\n").arg(p.x()).arg(p.y()).arg(p.z());
+    text += coordinates(points[0]);
   }
 
   if (points.size() == 2) {
-    const QVector3D& p = points[1];
-    text += tr("(%1,  %2,  %3)\n").arg(p.x()).arg(p.y()).arg(p.z());
+    text += coordinates(points[1]);
 
     float distance = points[0].distanceToPoint(points[1]);
     text += tr("Distance:  %1").arg(distance);
   }
   _lblDistanceInfo->setText(text);
 }
+
+
+void Viewer::_updateSelectionInfo(const SelectionStats& stats) {
+  if (stats.count == 0) {
+    // out-of-core view keeps no points to count
+    _lblSelectionInfo->setText(_scene->isOutOfCore() ? tr("Selection needs loaded points") : QString());
+    return;
+  }
+  // shown in file coordinates like picked points
+  const double* origin = _scene->pointsOrigin();
+  auto coordinates = [origin](double x, double y, double z) {
+    return tr("(%1,  %2,  %3)").arg(origin[0] + x, 0, 'g', 10)
+                               .arg(origin[1] + y, 0, 'g', 10)
+                               .arg(origin[2] + z, 0, 'g', 10);
+  };
+  _lblSelectionInfo->setText(
+        tr("Selected points: %1\nCentroid: %2\nBox min: %3\nBox max: %4\nZ min / max / mean: %5 / %6 / %7\n"
+           "Selection query: %8 ms")
+        .arg(stats.count)
+        .arg(coordinates(stats.centroid[0], stats.centroid[1], stats.centroid[2]))
+        .arg(coordinates(stats.min[0], stats.min[1], stats.min[2]))
+        .arg(coordinates(stats.max[0], stats.max[1], stats.max[2]))
+        .arg(origin[2] + stats.min[2], 0, 'g', 10)
+        .arg(origin[2] + stats.max[2], 0, 'g', 10)
+        .arg(origin[2] + stats.centroid[2], 0, 'g', 10)
+        .arg(stats.usecs / 1000., 0, 'f', 1));
+}
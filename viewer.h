@@ -4,8 +4,11 @@
 #include <QVector3D>
 #include <QSharedPointer>
 #include <QLabel>
+#include <QSet>
+#include <QStringList>
 
 #include "camera.h"
+#include "pointselection.h"
 
 // declare but not include to hide scene interface
 class Scene;
@@ -16,17 +19,28 @@ class Viewer : public QWidget
 
 public:
 
-  Viewer(const QString& filePath);
+  // single PLY or LOD file, or several PLY files and directories of them as tiles
+  Viewer(const QStringList& filePaths);
+
+  void cancelLoading();
+
+
+signals:
+  void loadFailed(const QString& error);
 
 
 protected:
   void wheelEvent(QWheelEvent *);
   void keyPressEvent(QKeyEvent *);
+  void keyReleaseEvent(QKeyEvent *);
+  void focusOutEvent(QFocusEvent *);
 
 
 private slots:
   void _updatePointSize(int);
   void _updateMeasureInfo(const QVector<QVector3D>& points);
+  void _updateSelectionInfo(const SelectionStats& stats);
+  void _moveByHeldKeys(double seconds);
 
 
 private:
@@ -35,5 +49,9 @@ private:
   QSharedPointer<Camera> _camera;
   QLabel* _lblColorBy;
   QLabel* _lblDistanceInfo;
+  QLabel* _lblSelectionInfo;
+  QLabel* _lblLoadInfo;
+  // movement keys held down, camera moves on frame ticks rather than key auto-repeat
+  QSet<int> _heldKeys;
 
 };
@@ -0,0 +1,228 @@
+#include "voxelgrid.h"
+
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+
+namespace {
+
+// voxel coordinates are packed into 64-bit key, 21 bits per axis
+const int AXIS_BITS = 21;
+const quint64 AXIS_CELLS = quint64(1) << AXIS_BITS;
+
+// points scattered by single task, their indices within task fit 32 bits
+const size_t TASK_SHIFT = 22;
+const size_t TASK_POINTS = size_t(1) << TASK_SHIFT;
+// buckets reduced independently, high bits of voxel hash pick them
+const int BUCKET_BITS = 10;
+const size_t BUCKETS = size_t(1) << BUCKET_BITS;
+
+
+// finalizer of splitmix64, keys of neighbour voxels differ in few low bits only
+inline quint64 mix(quint64 key) {
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
+}
+
+
+struct Grid {
+  float min[3];
+  float scale;
+
+  quint64 key(const float* point) const {
+    quint64 key = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      // points slightly out of bounds go to border voxels
+      const float cell = std::max((point[axis] - min[axis]) * scale, 0.f);
+      key |= std::min(static_cast<quint64>(cell), AXIS_CELLS - 1) << (axis * AXIS_BITS);
+    }
+    return key;
+  }
+};
+
+
+// points of one voxel so far
+struct Voxel {
+  quint64 key;
+  size_t first;  // index of its first point
+  double sum[3];
+  quint64 count;
+};
+
+} // namespace
+
+
+bool VoxelGrid::modeFromName(const QString& name, Mode& mode)
+{
+  if (name == "centroid") {
+    mode = CENTROID;
+  } else if (name == "first") {
+    mode = FIRST_POINT;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+
+VoxelGrid::VoxelGrid(float voxelSize, Mode mode)
+  : _voxelSize(voxelSize),
+    _mode(mode)
+{
+}
+
+
+void VoxelGrid::downsample(const PointStorage& points, const QVector3D& boundMin, const QVector3D& boundMax,
+                           PointStorage& out) const
+{
+  if (!(_voxelSize > 0)) {
+    throw std::runtime_error("voxel size must be positive");
+  }
+  Grid grid;
+  grid.scale = 1 / _voxelSize;
+  for (int axis = 0; axis < 3; ++axis) {
+    grid.min[axis] = boundMin[axis];
+    if ((boundMax[axis] - boundMin[axis]) * grid.scale >= AXIS_CELLS - 1) {
+      throw std::runtime_error("voxel size is too small for extent of points");
+    }
+  }
+  const size_t count = points.size();
+  if (count == 0) {
+    out.clear();
+    return;
+  }
+
+  //
+  // count points of every bucket by task, so tasks may scatter them without locks:
+  // bucket holds indices of task 0, then of task 1 and so on, each in rows order
+  //
+  const size_t tasksCount = (count + TASK_POINTS - 1) >> TASK_SHIFT;
+  std::vector<size_t> tasks(tasksCount);
+  std::iota(tasks.begin(), tasks.end(), 0);
+  std::vector<size_t> counts(tasksCount * BUCKETS, 0);
+  QtConcurrent::blockingMap(tasks, [&](size_t task) {
+    size_t* taskCounts = &counts[task * BUCKETS];
+    const size_t first = task << TASK_SHIFT;
+    points.forEachRun(first, std::min(TASK_POINTS, count - first), [&](const float* run, size_t, size_t runCount) {
+      for (size_t i = 0; i < runCount; ++i) {
+        ++taskCounts[mix(grid.key(run + i * POINT_STRIDE)) >> (64 - BUCKET_BITS)];
+      }
+      return true;
+    });
+  });
+
+  std::vector<size_t> offsets(tasksCount * BUCKETS);
+  std::vector<size_t> bucketOffsets(BUCKETS + 1, 0);
+  size_t offset = 0;
+  for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+    bucketOffsets[bucket] = offset;
+    for (size_t task = 0; task < tasksCount; ++task) {
+      offsets[task * BUCKETS + bucket] = offset;
+      offset += counts[task * BUCKETS + bucket];
+    }
+  }
+  bucketOffsets[BUCKETS] = offset;
+
+  std::vector<quint32> indices(count);
+  QtConcurrent::blockingMap(tasks, [&](size_t task) {
+    std::vector<size_t> positions(offsets.begin() + task * BUCKETS, offsets.begin() + (task + 1) * BUCKETS);
+    const size_t first = task << TASK_SHIFT;
+    points.forEachRun(first, std::min(TASK_POINTS, count - first), [&](const float* run, size_t runFirst, size_t runCount) {
+      for (size_t i = 0; i < runCount; ++i) {
+        const size_t bucket = mix(grid.key(run + i * POINT_STRIDE)) >> (64 - BUCKET_BITS);
+        indices[positions[bucket]++] = static_cast<quint32>(runFirst + i - first);
+      }
+      return true;
+    });
+  });
+
+  //
+  // reduce every bucket with table of its voxels, voxels keep order of their first points
+  //
+  std::vector<size_t> buckets(BUCKETS);
+  std::iota(buckets.begin(), buckets.end(), 0);
+  std::vector<std::vector<float> > reduced(BUCKETS);
+  QtConcurrent::blockingMap(buckets, [&](size_t bucket) {
+    const size_t bucketPoints = bucketOffsets[bucket + 1] - bucketOffsets[bucket];
+    if (bucketPoints == 0) {
+      return;
+    }
+    // at most half full, slots hold voxel index + 1
+    size_t tableSize = 16;
+    while (tableSize < 2 * bucketPoints) {
+      tableSize *= 2;
+    }
+    const quint64 mask = tableSize - 1;
+    std::vector<quint32> table(tableSize, 0);
+    std::vector<Voxel> voxels;
+
+    for (size_t task = 0; task < tasksCount; ++task) {
+      const size_t begin = offsets[task * BUCKETS + bucket];
+      const size_t end = begin + counts[task * BUCKETS + bucket];
+      for (size_t i = begin; i < end; ++i) {
+        const size_t index = (task << TASK_SHIFT) + indices[i];
+        const float* point = points.point(index);
+        const quint64 key = grid.key(point);
+        quint64 slot = mix(key) & mask;
+        while (table[slot] != 0 && voxels[table[slot] - 1].key != key) {
+          slot = (slot + 1) & mask;
+        }
+        if (table[slot] == 0) {
+          const Voxel voxel = {key, index, {0, 0, 0}, 0};
+          voxels.push_back(voxel);
+          table[slot] = static_cast<quint32>(voxels.size());
+        }
+        Voxel& voxel = voxels[table[slot] - 1];
+        if (_mode == CENTROID) {
+          voxel.sum[0] += point[0];
+          voxel.sum[1] += point[1];
+          voxel.sum[2] += point[2];
+        }
+        ++voxel.count;
+      }
+    }
+
+    std::vector<float>& result = reduced[bucket];
+    result.resize(voxels.size() * POINT_STRIDE);
+    float* p = result.data();
+    for (const auto& voxel : voxels) {
+      const float* first = points.point(voxel.first);
+      if (_mode == CENTROID) {
+        p[0] = static_cast<float>(voxel.sum[0] / voxel.count);
+        p[1] = static_cast<float>(voxel.sum[1] / voxel.count);
+        p[2] = static_cast<float>(voxel.sum[2] / voxel.count);
+        p[3] = first[3];
+      } else {
+        std::memcpy(p, first, POINT_STRIDE * sizeof(float));
+      }
+      p += POINT_STRIDE;
+    }
+  });
+  std::vector<quint32>().swap(indices);
+
+  //
+  // gather buckets into storage
+  //
+  std::vector<size_t> firsts(BUCKETS + 1, 0);
+  for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+    firsts[bucket + 1] = firsts[bucket] + reduced[bucket].size() / POINT_STRIDE;
+  }
+  out.allocate(firsts[BUCKETS]);
+  QtConcurrent::blockingMap(buckets, [&](size_t bucket) {
+    const float* source = reduced[bucket].data();
+    out.forEachRun(firsts[bucket], firsts[bucket + 1] - firsts[bucket], [&](float* run, size_t, size_t runCount) {
+      std::memcpy(run, source, runCount * POINT_STRIDE * sizeof(float));
+      source += runCount * POINT_STRIDE;
+      return true;
+    });
+    std::vector<float>().swap(reduced[bucket]);
+  });
+}
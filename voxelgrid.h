@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QString>
+#include <QVector3D>
+
+#include "pointstorage.h"
+
+
+//
+// Voxel grid downsampling: points falling into same cube of grid are replaced by
+// single point, either their centroid or first of them in rows order. Kept point
+// takes row of the first one, so coloring by row still follows the file.
+//
+// Points are scattered into buckets by hash of their voxel, then every bucket is
+// reduced by own worker with open addressing table. Both passes run on thread pool
+// without locks, input is read sequentially except within single bucket.
+//
+class VoxelGrid
+{
+public:
+  enum Mode {CENTROID, FIRST_POINT};
+
+  // "centroid" or "first", false for unknown name
+  static bool modeFromName(const QString& name, Mode& mode);
+
+  VoxelGrid(float voxelSize, Mode mode = CENTROID);
+
+  float voxelSize() const {return _voxelSize;}
+  Mode mode() const {return _mode;}
+
+  // replaces points of out with reduced ones, grid starts at boundMin and points are
+  // expected within bounds; out must be other storage than points.
+  // Throws std::runtime_error when voxel is too small for bounds, std::bad_alloc
+  void downsample(const PointStorage& points, const QVector3D& boundMin, const QVector3D& boundMax,
+                  PointStorage& out) const;
+
+
+private:
+  float _voxelSize;
+  Mode _mode;
+};
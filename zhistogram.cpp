@@ -0,0 +1,299 @@
+#include "zhistogram.h"
+
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#define Z_HISTOGRAM_SSE
+#endif
+
+
+namespace {
+
+// bins range is narrowed to where all but that fraction of points at either end are,
+// at most that many times and only while it shrinks to less than quarter
+const double RANGE_CLIP = 1e-3;
+const int RANGE_PASSES = 2;
+const double RANGE_NARROWING = 0.25;
+
+const float HUGE_COORDINATE = std::numeric_limits<float>::max();
+
+
+// prefix sums of bins, k-th is count of points below bin k
+std::vector<quint64> cumulate(const std::vector<quint64>& bins) {
+  std::vector<quint64> cumulative(bins.size() + 1, 0);
+  for (size_t k = 0; k < bins.size(); ++k) {
+    cumulative[k + 1] = cumulative[k] + bins[k];
+  }
+  return cumulative;
+}
+
+
+// position in bins where cumulative count reaches given one, within bin linearly
+double binsPosition(const std::vector<quint64>& cumulative, double count) {
+  const size_t bins = cumulative.size() - 1;
+  size_t k = std::upper_bound(cumulative.begin(), cumulative.end(), static_cast<quint64>(count)) - cumulative.begin();
+  k = std::min(std::max<size_t>(k, 1), bins) - 1;
+  const quint64 inBin = cumulative[k + 1] - cumulative[k];
+  const double fraction = inBin > 0 ? (count - cumulative[k]) / inBin : 0;
+  return k + std::max(0., std::min(1., fraction));
+}
+
+} // namespace
+
+
+ZHistogram::ZHistogram()
+  : _built(false),
+    _binsMin(0),
+    _binsMax(0),
+    _subsetCount(0)
+{
+}
+
+
+void ZHistogram::addPoints(const PointStorage& points, const std::vector<PointChunk>& chunks)
+{
+  for (const auto& pointChunk : chunks) {
+    Chunk chunk;
+    chunk.points = &points;
+    chunk.first = pointChunk.first;
+    chunk.count = pointChunk.count;
+    _chunks.push_back(chunk);
+  }
+  _built = false;
+}
+
+
+void ZHistogram::clear()
+{
+  _chunks.clear();
+  _chunkBins.clear();
+  _inSubset.clear();
+  _subsetBins.clear();
+  _subsetCount = 0;
+  _built = false;
+}
+
+
+void ZHistogram::_scanBounds(const float* p, size_t count, float* min, float* max)
+{
+  size_t i = 0;
+
+#ifdef Z_HISTOGRAM_SSE
+  // x, y, z and row of point are lanes already, row lane is dropped; no point is left over
+  __m128 minLanes = _mm_set1_ps(HUGE_COORDINATE);
+  __m128 maxLanes = _mm_set1_ps(-HUGE_COORDINATE);
+  for (; i < count; ++i, p += POINT_STRIDE) {
+    const __m128 point = _mm_loadu_ps(p);
+    minLanes = _mm_min_ps(minLanes, point);
+    maxLanes = _mm_max_ps(maxLanes, point);
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, minLanes);
+  for (int axis = 0; axis < 3; ++axis) {
+    min[axis] = std::min(min[axis], lanes[axis]);
+  }
+  _mm_storeu_ps(lanes, maxLanes);
+  for (int axis = 0; axis < 3; ++axis) {
+    max[axis] = std::max(max[axis], lanes[axis]);
+  }
+#else
+  for (; i < count; ++i, p += POINT_STRIDE) {
+    for (int axis = 0; axis < 3; ++axis) {
+      min[axis] = std::min(min[axis], p[axis]);
+      max[axis] = std::max(max[axis], p[axis]);
+    }
+  }
+#endif
+}
+
+
+void ZHistogram::_scanBins(const float* p, size_t count, float binsMin, float binScale, quint32* bins)
+{
+  const float lastBin = BINS - 1;
+  size_t i = 0;
+
+#ifdef Z_HISTOGRAM_SSE
+  // z of 4 points goes to bin indices at once, counting is scalar
+  const __m128 offset = _mm_set1_ps(binsMin);
+  const __m128 scale = _mm_set1_ps(binScale);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 last = _mm_set1_ps(lastBin);
+  for (; count - i >= 4; i += 4, p += 4 * POINT_STRIDE) {
+    __m128 x = _mm_loadu_ps(p);
+    __m128 y = _mm_loadu_ps(p + POINT_STRIDE);
+    __m128 z = _mm_loadu_ps(p + 2 * POINT_STRIDE);
+    __m128 row = _mm_loadu_ps(p + 3 * POINT_STRIDE);
+    _MM_TRANSPOSE4_PS(x, y, z, row);
+    // max goes second, so NaN lands in first bin
+    const __m128 position = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(z, offset), scale), zero), last);
+    int indices[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(indices), _mm_cvttps_epi32(position));
+    ++bins[indices[0]];
+    ++bins[indices[1]];
+    ++bins[indices[2]];
+    ++bins[indices[3]];
+  }
+#endif
+
+  // points left over by SSE loop or all of them without it
+  for (; i < count; ++i, p += POINT_STRIDE) {
+    const float position = std::max(0.f, std::min(lastBin, (p[2] - binsMin) * binScale));
+    ++bins[static_cast<int>(position)];
+  }
+}
+
+
+void ZHistogram::_binChunks()
+{
+  const float range = _binsMax - _binsMin;
+  const float binScale = range > 0 ? BINS / range : 0;
+  const float binsMin = _binsMin;
+  _chunkBins.assign(_chunks.size() * BINS, 0);
+  quint32* chunkBins = _chunkBins.data();
+  const Chunk* chunks = _chunks.data();
+  std::vector<size_t> indices(_chunks.size());
+  for (size_t i = 0; i < indices.size(); ++i) {
+    indices[i] = i;
+  }
+  QtConcurrent::blockingMap(indices, [=](size_t& index) {
+    const Chunk& chunk = chunks[index];
+    quint32* bins = chunkBins + index * BINS;
+    chunk.points->forEachRun(chunk.first, chunk.count, [&](const float* run, size_t, size_t runCount) {
+      _scanBins(run, runCount, binsMin, binScale, bins);
+      return true;
+    });
+  });
+}
+
+
+void ZHistogram::build()
+{
+  QtConcurrent::blockingMap(_chunks, [](Chunk& chunk) {
+    std::fill(chunk.min, chunk.min + 3, HUGE_COORDINATE);
+    std::fill(chunk.max, chunk.max + 3, -HUGE_COORDINATE);
+    chunk.points->forEachRun(chunk.first, chunk.count, [&](const float* run, size_t, size_t runCount) {
+      _scanBounds(run, runCount, chunk.min, chunk.max);
+      return true;
+    });
+  });
+  _boundMin = QVector3D(HUGE_COORDINATE, HUGE_COORDINATE, HUGE_COORDINATE);
+  _boundMax = -_boundMin;
+  quint64 count = 0;
+  for (const auto& chunk : _chunks) {
+    count += chunk.count;
+    for (int axis = 0; axis < 3 && chunk.count > 0; ++axis) {
+      _boundMin[axis] = std::min(chunk.min[axis], _boundMin[axis]);
+      _boundMax[axis] = std::max(chunk.max[axis], _boundMax[axis]);
+    }
+  }
+  if (count == 0) {
+    _boundMin = _boundMax = QVector3D();
+  }
+
+  // bins over Z bounds first, then over range without few extreme points
+  _binsMin = _boundMin.z();
+  _binsMax = _boundMax.z();
+  for (int pass = 0; ; ++pass) {
+    _binChunks();
+    if (pass == RANGE_PASSES || count == 0) {
+      break;
+    }
+    std::vector<quint64> bins(BINS, 0);
+    for (size_t i = 0; i < _chunkBins.size(); ++i) {
+      bins[i % BINS] += _chunkBins[i];
+    }
+    const std::vector<quint64> cumulative = cumulate(bins);
+    const double low = std::floor(binsPosition(cumulative, RANGE_CLIP * count));
+    const double high = std::ceil(binsPosition(cumulative, (1 - RANGE_CLIP) * count));
+    if (high - low > RANGE_NARROWING * BINS) {
+      break;
+    }
+    const float binSize = (_binsMax - _binsMin) / BINS;
+    const float binsMin = _binsMin + static_cast<float>(low) * binSize;
+    const float binsMax = _binsMin + static_cast<float>(std::max(high, low + 1)) * binSize;
+    if (!(binsMax > binsMin) || (binsMin == _binsMin && binsMax == _binsMax)) {
+      break;
+    }
+    _binsMin = binsMin;
+    _binsMax = binsMax;
+  }
+
+  _inSubset.assign(_chunks.size(), 0);
+  _subsetBins.assign(BINS, 0);
+  _subsetCount = 0;
+  _built = true;
+}
+
+
+bool ZHistogram::setSubset(const std::vector<int>& chunks)
+{
+  if (!_built) {
+    return false;
+  }
+  std::vector<char> inSubset(_chunks.size(), 0);
+  for (int index : chunks) {
+    if (index >= 0 && static_cast<size_t>(index) < inSubset.size()) {
+      inSubset[index] = 1;
+    }
+  }
+
+  // only chunks that came into or out of view are added or subtracted
+  bool changed = false;
+  for (size_t index = 0; index < inSubset.size(); ++index) {
+    if (inSubset[index] == _inSubset[index]) {
+      continue;
+    }
+    changed = true;
+    const quint32* bins = _chunkBins.data() + index * BINS;
+    if (inSubset[index]) {
+      for (int k = 0; k < BINS; ++k) {
+        _subsetBins[k] += bins[k];
+      }
+      _subsetCount += _chunks[index].count;
+    } else {
+      for (int k = 0; k < BINS; ++k) {
+        _subsetBins[k] -= bins[k];
+      }
+      _subsetCount -= _chunks[index].count;
+    }
+  }
+  _inSubset.swap(inSubset);
+  return changed;
+}
+
+
+std::vector<float> ZHistogram::ramp(Stretch stretch, int size, double clipFraction) const
+{
+  std::vector<float> intensities(std::max(size, 2));
+  const double steps = intensities.size() - 1;
+  if (stretch == LINEAR_STRETCH || _subsetCount == 0) {
+    for (size_t i = 0; i < intensities.size(); ++i) {
+      intensities[i] = static_cast<float>(i / steps);
+    }
+    return intensities;
+  }
+
+  const std::vector<quint64> cumulative = cumulate(_subsetBins);
+  const double total = static_cast<double>(cumulative.back());
+  const double low = binsPosition(cumulative, clipFraction * total);
+  const double high = binsPosition(cumulative, (1 - clipFraction) * total);
+  for (size_t i = 0; i < intensities.size(); ++i) {
+    const double position = i / steps * BINS;
+    double intensity;
+    if (stretch == PERCENTILE_STRETCH) {
+      intensity = high > low ? (position - low) / (high - low) : (position >= low ? 1 : 0);
+    } else {
+      // fraction of subset below Z of this step
+      const size_t k = std::min(static_cast<size_t>(position), static_cast<size_t>(BINS - 1));
+      intensity = (cumulative[k] + (position - k) * _subsetBins[k]) / total;
+    }
+    intensities[i] = static_cast<float>(std::max(0., std::min(1., intensity)));
+  }
+  return intensities;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <QVector3D>
+
+#include "pointstorage.h"
+#include "pointindex.h"
+
+#include <vector>
+
+
+//
+// Z distribution of loaded points for coloring by Z.
+//
+// Points are registered by chunks, thread pool measures exact bounds of every chunk
+// and then its Z histogram with SSE. Bins cover Z range where almost all points are,
+// the range is narrowed once or twice from the full one, so few outliers don't
+// squeeze the rest of points into a couple of bins. Histogram of any subset of
+// chunks is a sum of theirs, one of drawn chunks is kept up to date by adding and
+// subtracting chunks as they come into and out of view.
+//
+class ZHistogram
+{
+public:
+  // how Z maps to intensity: linearly over bounds of all points, linearly between
+  // percentiles of drawn points (outliers are clipped), or by cumulative count of
+  // drawn points (every intensity level gets about the same number of them)
+  enum Stretch {LINEAR_STRETCH, PERCENTILE_STRETCH, EQUALIZED_STRETCH};
+
+  static const int BINS = 1024;
+
+  ZHistogram();
+
+  // points must outlive histogram or clear(); chunks are numbered in order of registration
+  void addPoints(const PointStorage& points, const std::vector<PointChunk>& chunks);
+  void clear();
+
+  // measures registered chunks, blocks until thread pool is done;
+  // not thread safe against anything else
+  void build();
+  bool isBuilt() const {return _built;}
+
+  // of all registered points, valid once built
+  const QVector3D& boundMin() const {return _boundMin;}
+  const QVector3D& boundMax() const {return _boundMax;}
+  // Z range of bins, points beyond it count in first or last bin
+  float binsMin() const {return _binsMin;}
+  float binsMax() const {return _binsMax;}
+
+  // makes given chunks current subset; returns whether it differs from previous one
+  bool setSubset(const std::vector<int>& chunks);
+  quint64 subsetCount() const {return _subsetCount;}
+
+  // intensities 0..1 of `size` Z values spread evenly over bins range by histogram
+  // of current subset, fraction of its points below and above is clipped by percentile stretch
+  std::vector<float> ramp(Stretch stretch, int size, double clipFraction) const;
+
+
+private:
+  struct Chunk {
+    const PointStorage* points;
+    size_t first;
+    size_t count;
+    float min[3];
+    float max[3];
+  };
+
+  static void _scanBounds(const float* points, size_t count, float* min, float* max);
+  static void _scanBins(const float* points, size_t count, float binsMin, float binScale, quint32* bins);
+  void _binChunks();
+
+  std::vector<Chunk> _chunks;
+  std::vector<quint32> _chunkBins;  // BINS per chunk
+  bool _built;
+  QVector3D _boundMin;
+  QVector3D _boundMax;
+  float _binsMin;
+  float _binsMax;
+
+  std::vector<char> _inSubset;
+  std::vector<quint64> _subsetBins;
+  quint64 _subsetCount;
+};